@@ -78,7 +78,8 @@
    allowed */
 #undef WITH_SESSION_SECURITY
 
-/* If defined, vdagentd will use a static uinput device */
+/* If defined, vdagentd will create the uinput device at startup and never
+   destroy it */
 #undef WITH_STATIC_UINPUT
 
 /* If defined, vdagentd will support socket activation with systemd */
@@ -27,6 +27,7 @@
 #include <glib-unix.h>
 #include <gio/gunixsocketaddress.h>
 #include "udscs.h"
+#include "vdagentd-proto.h"
 #include "vdagentd-proto-strings.h"
 #include "vdagent-connection.h"
 
@@ -40,13 +41,51 @@ struct _UdscsConnection {
     VDAgentConnection parent_instance;
     int debug;
     udscs_read_callback read_callback;
+    /* bytes of the message started by udscs_write_start() still to come */
+    uint32_t write_remaining;
+    VDAgentWritePriority write_priority;
+    /* DeferredWrite of messages of that lane written meanwhile,
+     * queued once it's complete */
+    GQueue deferred;
+    /* type of the message started by udscs_write_start(), and its
+     * selection if it is clipboard data */
+    uint32_t write_type;
+    uint8_t write_selection;
+    /* VDAGENTD_CLIPBOARD_DATA messages of each selection not written yet */
+    guint clipboard_data_queued[256];
+    /* body of the message being read, if it's stored in a buffer of
+     * our own, see udscs_get_message_bytes() */
+    uint8_t *body;
+    /* data of the message passed to the read callback */
+    uint8_t *message_data;
+    uint32_t message_size;
 };
 
+/* Bodies at least this large are read into a buffer which the read
+ * callback may take over */
+#define OWNED_BODY_MIN_SIZE (16 * 1024)
+
+/* Payloads passed to udscs_write_bytes() at least this large are queued
+ * by reference, smaller ones are copied next to the header */
+#define PAYLOAD_REF_MIN_SIZE 1024
+
+/* A message or part of one, see udscs_write_start() */
+typedef struct {
+    GBytes *bytes;
+    gboolean last;
+} DeferredWrite;
+
+static void deferred_write_free(DeferredWrite *write)
+{
+    g_bytes_unref(write->bytes);
+    g_free(write);
+}
+
 G_DEFINE_TYPE(UdscsConnection, udscs_connection, VDAGENT_TYPE_CONNECTION)
 
-static void debug_print_message_header(UdscsConnection             *conn,
-                                       struct udscs_message_header *header,
-                                       const gchar                 *direction)
+static void debug_print_message_header(UdscsConnection                   *conn,
+                                       const struct udscs_message_header *header,
+                                       const gchar                       *direction)
 {
     const gchar *type = "invalid message";
 
@@ -60,12 +99,94 @@ static void debug_print_message_header(UdscsConnection             *conn,
         conn, direction, type, header->arg1, header->arg2, header->size);
 }
 
+/* Clipboard contents and file transfers are sent in the bulk lane,
+ * so they don't delay the other messages. File-xfer status messages
+ * go there too so they stay ordered with respect to the data. */
+static VDAgentWritePriority message_priority(uint32_t type)
+{
+    switch (type) {
+    case VDAGENTD_CLIPBOARD_DATA:
+    case VDAGENTD_FILE_XFER_STATUS:
+    case VDAGENTD_FILE_XFER_DATA:
+        return VDAGENT_WRITE_PRIORITY_BULK;
+    default:
+        return VDAGENT_WRITE_PRIORITY_INTERACTIVE;
+    }
+}
+
+/* Like message_priority(), but a grab or release of a selection whose
+ * data is still queued must not overtake it, so it waits in the bulk lane */
+static VDAgentWritePriority conn_message_priority(UdscsConnection *conn,
+                                                  uint32_t type, uint32_t arg1)
+{
+    switch (type) {
+    case VDAGENTD_CLIPBOARD_GRAB:
+    case VDAGENTD_CLIPBOARD_RELEASE:
+        if (arg1 < G_N_ELEMENTS(conn->clipboard_data_queued) &&
+            conn->clipboard_data_queued[arg1] > 0) {
+            return VDAGENT_WRITE_PRIORITY_BULK;
+        }
+        return VDAGENT_WRITE_PRIORITY_INTERACTIVE;
+    default:
+        return message_priority(type);
+    }
+}
+
+typedef struct {
+    /* not a reference, the queued data is freed with the connection */
+    UdscsConnection *conn;
+    uint8_t selection;
+    GBytes *bytes;
+} ClipboardDataEnd;
+
+static void clipboard_data_written(gpointer user_data)
+{
+    ClipboardDataEnd *end = user_data;
+
+    end->conn->clipboard_data_queued[end->selection]--;
+    g_bytes_unref(end->bytes);
+    g_free(end);
+}
+
+/* Takes @bytes, the last part of clipboard data of @selection counted in
+ * clipboard_data_queued, and returns it wrapped so the count goes down
+ * once it has been written */
+static GBytes *clipboard_data_end(UdscsConnection *conn, uint8_t selection,
+                                  GBytes *bytes)
+{
+    ClipboardDataEnd *end = g_new(ClipboardDataEnd, 1);
+    gconstpointer data;
+    gsize size;
+
+    end->conn = conn;
+    end->selection = selection;
+    end->bytes = bytes;
+    data = g_bytes_get_data(bytes, &size);
+    return g_bytes_new_with_free_func(data, size, clipboard_data_written, end);
+}
+
 static gsize conn_handle_header(VDAgentConnection *conn,
                                 gpointer           header_buf)
 {
     return ((struct udscs_message_header *)header_buf)->size;
 }
 
+static guint conn_get_body_vectors(VDAgentConnection *conn,
+                                   gpointer           header_buf,
+                                   gsize              size,
+                                   GInputVector      *vectors)
+{
+    UdscsConnection *self = UDSCS_CONNECTION(conn);
+
+    if (size < OWNED_BODY_MIN_SIZE) {
+        return 0;
+    }
+    self->body = g_malloc(size);
+    vectors[0].buffer = self->body;
+    vectors[0].size = size;
+    return 1;
+}
+
 static void conn_handle_message(VDAgentConnection *conn,
                                 gpointer           header_buf,
                                 gpointer           data)
@@ -75,11 +196,34 @@ static void conn_handle_message(VDAgentConnection *conn,
 
     debug_print_message_header(self, header, "received");
 
+    if (data == NULL && header->size > 0) {
+        data = self->body;
+    }
+    self->message_data = data;
+    self->message_size = header->size;
+
+    /* the callback may destroy the connection */
+    g_object_ref(self);
     self->read_callback(self, header, data);
+    self->message_data = NULL;
+    g_clear_pointer(&self->body, g_free);
+    g_object_unref(self);
+}
+
+GBytes *udscs_get_message_bytes(UdscsConnection *conn)
+{
+    g_return_val_if_fail(conn->message_data != NULL, NULL);
+
+    if (conn->body) {
+        conn->message_data = NULL;
+        return g_bytes_new_take(g_steal_pointer(&conn->body), conn->message_size);
+    }
+    return g_bytes_new(conn->message_data, conn->message_size);
 }
 
 static void udscs_connection_init(UdscsConnection *self)
 {
+    g_queue_init(&self->deferred);
 }
 
 static void udscs_connection_finalize(GObject *obj)
@@ -89,6 +233,8 @@ static void udscs_connection_finalize(GObject *obj)
     if (self->debug) {
         syslog(LOG_DEBUG, "%p disconnected", self);
     }
+    g_queue_clear_full(&self->deferred, (GDestroyNotify)deferred_write_free);
+    g_free(self->body);
 
     G_OBJECT_CLASS(udscs_connection_parent_class)->finalize(obj);
 }
@@ -102,6 +248,7 @@ static void udscs_connection_class_init(UdscsConnectionClass *klass)
 
     conn_class->handle_header = conn_handle_header;
     conn_class->handle_message = conn_handle_message;
+    conn_class->get_body_vectors = conn_get_body_vectors;
 }
 
 UdscsConnection *udscs_connect(const char *socketname,
@@ -134,8 +281,29 @@ UdscsConnection *udscs_connect(const char *socketname,
     return conn;
 }
 
-void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
-    uint32_t arg2, const uint8_t *data, uint32_t size)
+/* Queue @bytes as a fragment of a message going to the lane of @priority */
+static void write_message_part(UdscsConnection *conn, VDAgentWritePriority priority,
+                               GBytes *bytes, gboolean last)
+{
+    DeferredWrite *write;
+
+    /* it would end up in the middle of the message being streamed */
+    if (conn->write_remaining > 0 && priority == conn->write_priority) {
+        write = g_new(DeferredWrite, 1);
+        write->bytes = bytes;
+        write->last = last;
+        g_queue_push_tail(&conn->deferred, write);
+        return;
+    }
+
+    vdagent_connection_write_fragment(VDAGENT_CONNECTION(conn), bytes,
+                                      priority, last);
+}
+
+/* Serializes a message, the result can be queued to any number
+ * of connections with write_message() */
+static GBytes *message_new(uint32_t type, uint32_t arg1, uint32_t arg2,
+                           const uint8_t *data, uint32_t size)
 {
     gpointer buf;
     guint buf_size;
@@ -152,9 +320,134 @@ void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
     memcpy(buf, &header, sizeof(header));
     memcpy(buf + sizeof(header), data, size);
 
+    return g_bytes_new_take(buf, buf_size);
+}
+
+static void write_message(UdscsConnection *conn, GBytes *message)
+{
+    const struct udscs_message_header *header = g_bytes_get_data(message, NULL);
+    VDAgentWritePriority priority;
+    GBytes *bytes = g_bytes_ref(message);
+
+    debug_print_message_header(conn, header, "sent");
+
+    priority = conn_message_priority(conn, header->type, header->arg1);
+    if (header->type == VDAGENTD_CLIPBOARD_DATA) {
+        conn->clipboard_data_queued[header->arg1 & 0xff]++;
+        bytes = clipboard_data_end(conn, header->arg1, bytes);
+    }
+    write_message_part(conn, priority, bytes, TRUE);
+}
+
+void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, const uint8_t *data, uint32_t size)
+{
+    GBytes *message = message_new(type, arg1, arg2, data, size);
+
+    write_message(conn, message);
+    g_bytes_unref(message);
+}
+
+void udscs_write_bytes(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, GBytes *data)
+{
+    struct udscs_message_header header;
+    VDAgentWritePriority priority;
+    gsize size = data ? g_bytes_get_size(data) : 0;
+
+    if (size < PAYLOAD_REF_MIN_SIZE) {
+        udscs_write(conn, type, arg1, arg2,
+                    size ? g_bytes_get_data(data, NULL) : NULL, size);
+        return;
+    }
+
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = size;
+
     debug_print_message_header(conn, &header, "sent");
 
-    vdagent_connection_write(VDAGENT_CONNECTION(conn), buf, buf_size);
+    priority = conn_message_priority(conn, type, arg1);
+    data = g_bytes_ref(data);
+    if (type == VDAGENTD_CLIPBOARD_DATA) {
+        conn->clipboard_data_queued[arg1 & 0xff]++;
+        data = clipboard_data_end(conn, arg1, data);
+    }
+    write_message_part(conn, priority, g_bytes_new(&header, sizeof(header)), FALSE);
+    write_message_part(conn, priority, data, TRUE);
+}
+
+void udscs_write_start(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, uint32_t size)
+{
+    struct udscs_message_header header;
+    GBytes *bytes;
+
+    g_return_if_fail(conn->write_remaining == 0);
+
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = size;
+
+    debug_print_message_header(conn, &header, "sent");
+
+    conn->write_remaining = size;
+    conn->write_priority = message_priority(type);
+    conn->write_type = type;
+    conn->write_selection = arg1;
+    bytes = g_bytes_new(&header, sizeof(header));
+    if (type == VDAGENTD_CLIPBOARD_DATA) {
+        /* counted from the start, grabs and releases written
+         * before the data is complete have to wait for it too */
+        conn->clipboard_data_queued[conn->write_selection]++;
+        if (size == 0) {
+            bytes = clipboard_data_end(conn, conn->write_selection, bytes);
+        }
+    }
+    vdagent_connection_write_fragment(VDAGENT_CONNECTION(conn), bytes,
+                                      conn->write_priority, size == 0);
+}
+
+static void write_fragment(UdscsConnection *conn, GBytes *bytes)
+{
+    conn->write_remaining -= g_bytes_get_size(bytes);
+    if (conn->write_remaining == 0 && conn->write_type == VDAGENTD_CLIPBOARD_DATA) {
+        bytes = clipboard_data_end(conn, conn->write_selection, bytes);
+    }
+    vdagent_connection_write_fragment(VDAGENT_CONNECTION(conn), bytes,
+                                      conn->write_priority,
+                                      conn->write_remaining == 0);
+
+    if (conn->write_remaining == 0) {
+        DeferredWrite *write;
+
+        while ((write = g_queue_pop_head(&conn->deferred))) {
+            vdagent_connection_write_fragment(VDAGENT_CONNECTION(conn),
+                                              write->bytes,
+                                              conn->write_priority,
+                                              write->last);
+            g_free(write);
+        }
+    }
+}
+
+void udscs_write_append(UdscsConnection *conn, const uint8_t *data,
+    uint32_t size)
+{
+    g_return_if_fail(size > 0 && size <= conn->write_remaining);
+
+    write_fragment(conn, g_bytes_new(data, size));
+}
+
+void udscs_write_abort(UdscsConnection *conn)
+{
+    if (conn->write_remaining == 0) {
+        return;
+    }
+    write_fragment(conn, g_bytes_new_take(g_malloc0(conn->write_remaining),
+                                          conn->write_remaining));
 }
 
 #ifndef UDSCS_NO_SERVER
@@ -289,9 +582,32 @@ void udscs_server_write_all(struct udscs_server *server,
         uint32_t type, uint32_t arg1, uint32_t arg2,
         const uint8_t *data, uint32_t size)
 {
+    udscs_server_write_matching(server, NULL, NULL,
+                                type, arg1, arg2, data, size);
+}
+
+void udscs_server_write_matching(struct udscs_server *server,
+        udscs_server_filter_callback filter, void *priv,
+        uint32_t type, uint32_t arg1, uint32_t arg2,
+        const uint8_t *data, uint32_t size)
+{
+    GBytes *message = NULL;
     GList *l;
+
     for (l = server->connections; l; l = l->next) {
-        udscs_write(UDSCS_CONNECTION(l->data), type, arg1, arg2, data, size);
+        UdscsConnection *conn = UDSCS_CONNECTION(l->data);
+
+        if (filter && !filter(conn, priv)) {
+            continue;
+        }
+        /* all the write queues share the one copy */
+        if (message == NULL) {
+            message = message_new(type, arg1, arg2, data, size);
+        }
+        write_message(conn, message);
+    }
+    if (message) {
+        g_bytes_unref(message);
     }
 }
 
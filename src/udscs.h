@@ -48,6 +48,13 @@ struct udscs_message_header {
 typedef void (*udscs_read_callback)(UdscsConnection *conn,
     struct udscs_message_header *header, uint8_t *data);
 
+/* Returns the data of the message passed to the read callback of @conn,
+ * may be called once from that callback. Large messages are handed over
+ * without copying, the data pointer passed to the callback then stays
+ * valid only as long as the returned GBytes.
+ */
+GBytes *udscs_get_message_bytes(UdscsConnection *conn);
+
 /* Connect to the unix domain socket specified by socketname.
  * Only sockets bound to a pathname are supported.
  *
@@ -67,6 +74,31 @@ UdscsConnection *udscs_connect(const char *socketname,
 void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
         uint32_t arg2, const uint8_t *data, uint32_t size);
 
+/* Like udscs_write(), but the data is queued by reference instead of being
+ * copied after the header, @data is kept until it has been written.
+ * @data may be NULL for messages without data.
+ */
+void udscs_write_bytes(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, GBytes *data);
+
+/* Queue the header of a message whose @size bytes of data are passed
+ * later in one or more udscs_write_append() calls, so large messages
+ * can be relayed without holding them in memory as a whole.
+ * Messages written with udscs_write() meanwhile are held back until
+ * the data is complete if they would otherwise be sent in between.
+ */
+void udscs_write_start(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, uint32_t size);
+
+void udscs_write_append(UdscsConnection *conn, const uint8_t *data,
+        uint32_t size);
+
+/* Complete the message started with udscs_write_start() with zeros when the
+ * rest of its data has been lost. The receiver can't tell, the caller has
+ * to let it know the message is invalid in some other way.
+ */
+void udscs_write_abort(UdscsConnection *conn);
+
 #ifndef UDSCS_NO_SERVER
 
 /* ---------- Server-side API ---------- */
@@ -119,6 +151,21 @@ void udscs_server_write_all(struct udscs_server *server,
     uint32_t type, uint32_t arg1, uint32_t arg2,
     const uint8_t *data, uint32_t size);
 
+/* Callback type for udscs_server_write_matching, returns TRUE if the
+ * message should be sent to @conn.
+ */
+typedef gboolean (*udscs_server_filter_callback)(UdscsConnection *conn,
+    void *priv);
+
+/* Like udscs_server_write_all, but only send the message to the clients
+ * @filter returns TRUE for, passing through @priv to all @filter calls.
+ * The message is serialized once and shared by all the clients.
+ */
+void udscs_server_write_matching(struct udscs_server *server,
+    udscs_server_filter_callback filter, void *priv,
+    uint32_t type, uint32_t arg1, uint32_t arg2,
+    const uint8_t *data, uint32_t size);
+
 /* Callback type for udscs_server_for_all_clients. Clients can be disconnected
  * from this callback just like with a read callback.
  */
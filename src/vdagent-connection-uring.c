@@ -0,0 +1,363 @@
+/*  vdagent-connection-uring.c
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <config.h>
+
+#include <syslog.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <liburing.h>
+#include <glib-unix.h>
+#include <gio/gunixinputstream.h>
+
+#include "vdagent-connection-uring.h"
+
+/* Must hold a read and a write, each with a linked poll,
+ * plus one cancellation for each of them */
+#define URING_ENTRIES 8
+#define URING_MAX_VECTORS 64
+
+enum {
+    URING_OP_READ = 1,
+    URING_OP_WRITE,
+    URING_OP_POLL_IN,
+    URING_OP_POLL_OUT,
+    URING_OP_CANCEL,
+};
+
+struct VDAgentUring {
+    struct io_uring ring;
+    int             fd;
+    int             event_fd;
+    GSource        *source;
+
+    VDAgentUringCb  read_cb;
+    VDAgentUringCb  write_cb;
+    gpointer        user_data;
+
+    /* Submissions are collected and passed to the kernel
+     * in a single io_uring_submit() */
+    gboolean        submit_pending;
+    gboolean        in_dispatch;
+    gboolean        freed;
+
+    gboolean        read_pending;
+    gpointer        read_buf;
+    gsize           read_size;
+    /* Read completion consumed by vdagent_uring_wait_write() */
+    gboolean        read_done;
+    gssize          read_res;
+
+    gboolean        write_pending;
+    struct iovec    iov[URING_MAX_VECTORS];
+    guint           n_iov;
+};
+
+static int stream_get_fd(GIOStream *io_stream)
+{
+    if (G_IS_SOCKET_CONNECTION(io_stream)) {
+        GSocket *socket = g_socket_connection_get_socket(G_SOCKET_CONNECTION(io_stream));
+        return g_socket_get_fd(socket);
+    }
+    GInputStream *in = g_io_stream_get_input_stream(io_stream);
+    if (G_IS_UNIX_INPUT_STREAM(in)) {
+        return g_unix_input_stream_get_fd(G_UNIX_INPUT_STREAM(in));
+    }
+    return -1;
+}
+
+static struct io_uring_sqe *get_sqe(VDAgentUring *uring)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&uring->ring);
+    if (sqe == NULL) {
+        /* Not expected given URING_ENTRIES, make room anyway */
+        io_uring_submit(&uring->ring);
+        sqe = io_uring_get_sqe(&uring->ring);
+    }
+    uring->submit_pending = TRUE;
+    return sqe;
+}
+
+static void submit(VDAgentUring *uring)
+{
+    if (uring->submit_pending) {
+        uring->submit_pending = FALSE;
+        io_uring_submit(&uring->ring);
+    }
+}
+
+/* Sockets obtained from GSocket are non-blocking, so the operation may
+ * fail with EAGAIN, in that case it is retried after a linked poll */
+static void prep_poll(VDAgentUring *uring, short events, guint op)
+{
+    struct io_uring_sqe *sqe = get_sqe(uring);
+    io_uring_prep_poll_add(sqe, uring->fd, events);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(op));
+}
+
+static void prep_read(VDAgentUring *uring, gboolean poll_first)
+{
+    if (poll_first) {
+        prep_poll(uring, POLLIN, URING_OP_POLL_IN);
+    }
+    struct io_uring_sqe *sqe = get_sqe(uring);
+    io_uring_prep_read(sqe, uring->fd, uring->read_buf, uring->read_size, -1);
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_READ));
+    uring->read_pending = TRUE;
+}
+
+static void prep_write(VDAgentUring *uring, gboolean poll_first)
+{
+    if (poll_first) {
+        prep_poll(uring, POLLOUT, URING_OP_POLL_OUT);
+    }
+    struct io_uring_sqe *sqe = get_sqe(uring);
+    io_uring_prep_writev(sqe, uring->fd, uring->iov, uring->n_iov, -1);
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_WRITE));
+    uring->write_pending = TRUE;
+}
+
+static void handle_completion(VDAgentUring *uring, guint op, gssize res)
+{
+    switch (op) {
+    case URING_OP_READ:
+        uring->read_pending = FALSE;
+        if (res == -EAGAIN) {
+            prep_read(uring, TRUE);
+            break;
+        }
+        uring->read_cb(res, uring->user_data);
+        break;
+    case URING_OP_WRITE:
+        uring->write_pending = FALSE;
+        if (res == -EAGAIN) {
+            prep_write(uring, TRUE);
+        }
+        uring->write_cb(res, uring->user_data);
+        break;
+    default:
+        /* Errors of a poll are reported by the linked operation */
+        break;
+    }
+}
+
+static gboolean uring_source_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    VDAgentUring *uring = user_data;
+    struct io_uring_cqe *cqe;
+    eventfd_t value;
+
+    eventfd_read(uring->event_fd, &value);
+
+    uring->in_dispatch = TRUE;
+    if (uring->read_done) {
+        uring->read_done = FALSE;
+        uring->read_cb(uring->read_res, uring->user_data);
+    }
+    while (!uring->freed && io_uring_peek_cqe(&uring->ring, &cqe) == 0) {
+        guint op = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+        gssize res = cqe->res;
+
+        io_uring_cqe_seen(&uring->ring, cqe);
+        handle_completion(uring, op, res);
+    }
+    uring->in_dispatch = FALSE;
+
+    /* The callbacks may have freed the backend */
+    if (uring->freed) {
+        g_free(uring);
+        return G_SOURCE_REMOVE;
+    }
+    submit(uring);
+    return G_SOURCE_CONTINUE;
+}
+
+VDAgentUring *vdagent_uring_new(GIOStream     *io_stream,
+                                GMainContext  *context,
+                                VDAgentUringCb read_cb,
+                                VDAgentUringCb write_cb,
+                                gpointer       user_data)
+{
+    VDAgentUring *uring;
+    int fd, ret;
+
+    fd = stream_get_fd(io_stream);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    uring = g_new0(VDAgentUring, 1);
+    ret = io_uring_queue_init(URING_ENTRIES, &uring->ring, 0);
+    if (ret < 0) {
+        syslog(LOG_DEBUG, "io_uring not available: %s, using GIO", g_strerror(-ret));
+        g_free(uring);
+        return NULL;
+    }
+
+    uring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (uring->event_fd < 0 ||
+        io_uring_register_eventfd(&uring->ring, uring->event_fd) < 0) {
+        syslog(LOG_DEBUG, "io_uring eventfd setup failed, using GIO");
+        if (uring->event_fd >= 0) {
+            close(uring->event_fd);
+        }
+        io_uring_queue_exit(&uring->ring);
+        g_free(uring);
+        return NULL;
+    }
+
+    uring->fd = fd;
+    uring->read_cb = read_cb;
+    uring->write_cb = write_cb;
+    uring->user_data = user_data;
+
+    uring->source = g_unix_fd_source_new(uring->event_fd, G_IO_IN);
+    g_source_set_callback(uring->source, G_SOURCE_FUNC(uring_source_cb), uring, NULL);
+    g_source_attach(uring->source, context);
+    return uring;
+}
+
+static void prep_cancel(VDAgentUring *uring, guint op)
+{
+    struct io_uring_sqe *sqe = get_sqe(uring);
+    io_uring_prep_cancel(sqe, GUINT_TO_POINTER(op), 0);
+    io_uring_sqe_set_data(sqe, GUINT_TO_POINTER(URING_OP_CANCEL));
+}
+
+void vdagent_uring_free(VDAgentUring *uring)
+{
+    struct io_uring_cqe *cqe;
+
+    if (uring->read_pending || uring->write_pending) {
+        /* A read or write waiting for its linked poll is cancelled
+         * together with the poll */
+        prep_cancel(uring, URING_OP_POLL_IN);
+        prep_cancel(uring, URING_OP_POLL_OUT);
+        prep_cancel(uring, URING_OP_READ);
+        prep_cancel(uring, URING_OP_WRITE);
+        submit(uring);
+    }
+    while (uring->read_pending || uring->write_pending) {
+        int ret = io_uring_wait_cqe(&uring->ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        } else if (ret < 0) {
+            syslog(LOG_ERR, "io_uring wait failed: %s", g_strerror(-ret));
+            break;
+        }
+        guint op = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+        if (op == URING_OP_READ) {
+            uring->read_pending = FALSE;
+        } else if (op == URING_OP_WRITE) {
+            uring->write_pending = FALSE;
+        }
+        io_uring_cqe_seen(&uring->ring, cqe);
+    }
+
+    g_source_destroy(uring->source);
+    g_source_unref(uring->source);
+    io_uring_queue_exit(&uring->ring);
+    close(uring->event_fd);
+
+    if (uring->in_dispatch) {
+        uring->freed = TRUE;
+    } else {
+        g_free(uring);
+    }
+}
+
+void vdagent_uring_read(VDAgentUring *uring, gpointer buf, gsize size)
+{
+    g_return_if_fail(!uring->read_pending && !uring->read_done);
+
+    uring->read_buf = buf;
+    uring->read_size = size;
+    prep_read(uring, FALSE);
+    if (!uring->in_dispatch) {
+        submit(uring);
+    }
+}
+
+void vdagent_uring_writev(VDAgentUring        *uring,
+                          const GOutputVector *vectors,
+                          gsize                n_vectors)
+{
+    gsize i;
+
+    g_return_if_fail(!uring->write_pending);
+    g_return_if_fail(n_vectors > 0 && n_vectors <= URING_MAX_VECTORS);
+
+    for (i = 0; i < n_vectors; i++) {
+        uring->iov[i].iov_base = (gpointer)vectors[i].buffer;
+        uring->iov[i].iov_len = vectors[i].size;
+    }
+    uring->n_iov = n_vectors;
+    prep_write(uring, FALSE);
+    if (!uring->in_dispatch) {
+        submit(uring);
+    }
+}
+
+gboolean vdagent_uring_write_pending(VDAgentUring *uring)
+{
+    return uring->write_pending;
+}
+
+void vdagent_uring_wait_write(VDAgentUring *uring)
+{
+    struct io_uring_cqe *cqe;
+    gboolean in_dispatch = uring->in_dispatch;
+
+    /* The write callback may free the backend */
+    uring->in_dispatch = TRUE;
+    submit(uring);
+    while (!uring->freed && uring->write_pending) {
+        int ret = io_uring_wait_cqe(&uring->ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        } else if (ret < 0) {
+            syslog(LOG_ERR, "io_uring wait failed: %s", g_strerror(-ret));
+            break;
+        }
+        guint op = GPOINTER_TO_UINT(io_uring_cqe_get_data(cqe));
+        gssize res = cqe->res;
+        io_uring_cqe_seen(&uring->ring, cqe);
+
+        if (op == URING_OP_READ && res != -EAGAIN) {
+            /* The eventfd is already signalled, so the GSource
+             * delivers this on the next iteration */
+            uring->read_pending = FALSE;
+            uring->read_done = TRUE;
+            uring->read_res = res;
+        } else {
+            handle_completion(uring, op, res);
+        }
+        if (!uring->freed) {
+            submit(uring);
+        }
+    }
+    uring->in_dispatch = in_dispatch;
+
+    if (uring->freed && !in_dispatch) {
+        g_free(uring);
+    }
+}
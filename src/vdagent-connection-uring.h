@@ -0,0 +1,68 @@
+/*  vdagent-connection-uring.h
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_CONNECTION_URING_H
+#define __VDAGENT_CONNECTION_URING_H
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* io_uring backend used internally by VDAgentConnection.
+ *
+ * At most one read and one write are in flight at any time.
+ * Completions are reported from a GSource attached to the context
+ * passed to vdagent_uring_new().
+ * @res is the number of bytes transferred, or a negative errno.
+ * A write that would block is resubmitted behind a poll on its own,
+ * @write_cb is still invoked with -EAGAIN for accounting. */
+typedef struct VDAgentUring VDAgentUring;
+typedef void (*VDAgentUringCb)(gssize res, gpointer user_data);
+
+/* Returns NULL if the fd of @io_stream can't be obtained
+ * or the kernel doesn't support io_uring,
+ * the caller should then fall back to the GIO streams. */
+VDAgentUring *vdagent_uring_new(GIOStream     *io_stream,
+                                GMainContext  *context,
+                                VDAgentUringCb read_cb,
+                                VDAgentUringCb write_cb,
+                                gpointer       user_data);
+
+/* Cancels any pending operation and waits until the kernel releases
+ * the buffers, no callback is invoked after this returns. */
+void vdagent_uring_free(VDAgentUring *uring);
+
+/* @buf must stay valid until @read_cb is invoked. */
+void vdagent_uring_read(VDAgentUring *uring, gpointer buf, gsize size);
+
+/* The data pointed to by @vectors must stay valid until @write_cb
+ * is invoked, the array itself is copied. */
+void vdagent_uring_writev(VDAgentUring        *uring,
+                          const GOutputVector *vectors,
+                          gsize                n_vectors);
+
+gboolean vdagent_uring_write_pending(VDAgentUring *uring);
+
+/* Blocks until the pending write completes and @write_cb returns.
+ * Read completions received meanwhile are delivered later from the GSource. */
+void vdagent_uring_wait_write(VDAgentUring *uring);
+
+G_END_DECLS
+
+#endif
@@ -16,6 +16,8 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <config.h>
+
 #include <syslog.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -25,24 +27,152 @@
 #include <gio/gunixsocketaddress.h>
 
 #include "vdagent-connection.h"
+#ifdef HAVE_LIBURING
+#include "vdagent-connection-uring.h"
+#endif
+
+/* Upper bound for the number of queued messages gathered into one write */
+#define WRITE_MAX_VECTORS 64
+#define WRITE_DEFAULT_MAX_BYTES (256 * 1024)
+
+/* Default write queue watermarks, see vdagent_connection_set_write_watermarks() */
+#define WRITE_DEFAULT_HIGH_WATERMARK (1024 * 1024)
+#define WRITE_DEFAULT_LOW_WATERMARK (256 * 1024)
+
+#define READ_DEFAULT_BUFFER_SIZE (64 * 1024)
+/* Message bodies passed to handle_message are aligned to this */
+#define BODY_ALIGNMENT 8
+
+/* Default delays in milliseconds between read retries while waiting
+ * for the remote side to open the connection, the delay doubles on
+ * every retry, see vdagent_connection_set_open_backoff() */
+#define OPEN_RETRY_DEFAULT_INITIAL_DELAY 10
+#define OPEN_RETRY_DEFAULT_MAX_DELAY 160
+
+/* Pooled buffers are recycled in power-of-two size classes
+ * from 64 bytes to 1 MiB, larger ones are allocated directly */
+#define POOL_MIN_SHIFT 6
+#define POOL_MAX_SHIFT 20
+#define POOL_N_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_CLASS_SIZE(size_class) ((gsize)1 << ((size_class) + POOL_MIN_SHIFT))
+#define POOL_DEFAULT_MAX_RETAINED (4 * 1024 * 1024)
+
+/* Precedes every buffer handed out by the pool */
+typedef struct PoolBuffer {
+    struct PoolBuffer *next;
+    gsize              size_class;
+} PoolBuffer;
+
+/* Element of the write queues */
+typedef struct WriteEntry {
+    GBytes            *bytes;
+    gint64             queue_time;
+    /* more fragments of the same message follow */
+    gboolean           more;
+} WriteEntry;
 
 typedef struct {
     GIOStream         *io_stream;
+    /* context the I/O happens in and the one callbacks are invoked in,
+     * they differ only if the connection runs its own I/O thread */
+    GMainContext      *context;
+    GMainContext      *main_context;
+    gboolean           use_io_thread;
+    GThread           *io_thread;
+    GMainLoop         *io_loop;
     gboolean           opening;
+    guint              open_retry_initial;
+    guint              open_retry_max;
+    guint              open_retry_delay;
+    GSource           *open_retry_source;
+    gint64             open_start_time;
+    gint64             open_time;
     VDAgentConnErrorCb error_cb;
     GCancellable      *cancellable;
 
-    GQueue            *write_queue;
+    /* one queue of GBytes per VDAgentWritePriority */
+    GQueue             write_queues[VDAGENT_WRITE_N_PRIORITIES];
+    guint              n_queued;
+    /* bytes of the head of write_queues[write_lane] already written */
     gsize              bytes_written;
+    guint              write_lane;
+    /* a fragmented message on write_lane has been partially written,
+     * its next fragment has to be written before anything else */
+    gboolean           frame_open;
+    /* the pollable output source is attached */
+    gboolean           writing;
+    gsize              queued_bytes;
+    /* held back by the subclass, see vdagent_connection_set_write_backlog() */
+    gsize              write_backlog;
+    /* fill_write_queue() is running, the write in progress goes on */
+    gboolean           filling;
+    gsize              high_watermark;
+    gsize              low_watermark;
+    gboolean           write_blocked;
+    VDAgentConnWritableCb writable_cb;
+    gpointer           writable_cb_data;
+    guint              max_write_vectors;
+    gsize              max_write_bytes;
 
     gsize              header_size;
     gpointer           header_buf;
+    /* header as read, before handle_header() had a go at it */
+    gpointer           raw_header_buf;
+    gboolean           header_read;
+    gsize              data_size;
     gpointer           data_buf;
+    gsize              body_bytes_pending;
+    /* buffers provided by get_body_vectors(), if any,
+     * body_vectors[body_vector] is filled up to body_vector_pos */
+    GInputVector       body_vectors[VDAGENT_CONNECTION_MAX_BODY_VECTORS];
+    guint              n_body_vectors;
+    guint              body_vector;
+    gsize              body_vector_pos;
+
+    /* incoming data, read_buf[read_start:read_end] hasn't been parsed yet */
+    guint8            *read_buf;
+    gsize              read_buf_size;
+    gsize              read_start;
+    gsize              read_end;
+    gboolean           read_paused;
+    gboolean           read_throttled;
+    /* an error was reported from the I/O thread */
+    gboolean           read_failed;
+    /* no read is in flight because reading was paused */
+    gboolean           read_stalled;
+
+    /* invoked from the I/O context, see vdagent_connection_set_read_tap() */
+    VDAgentConnReadTap read_tap;
+    gpointer           read_tap_data;
+    GDestroyNotify     read_tap_notify;
+
+    PoolBuffer        *pool[POOL_N_CLASSES];
+    gsize              pool_max_retained;
+    /* protected by stats_lock */
+    VDAgentBufferPoolStats pool_stats;
+
+    /* written from the I/O thread, read from any thread */
+    GMutex             stats_lock;
+    VDAgentConnectionStats stats;
+
+#ifdef HAVE_LIBURING
+    /* if set, reads and writes are submitted to io_uring
+     * instead of going through the GIO streams */
+    VDAgentUring      *uring;
+    /* the write in flight */
+    GOutputVector      uring_vectors[WRITE_MAX_VECTORS];
+    guint              uring_lanes[WRITE_MAX_VECTORS];
+    gsize              uring_n_vectors;
+#endif
 } VDAgentConnectionPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE(VDAgentConnection, vdagent_connection, G_TYPE_OBJECT)
 
-static void read_next_message(VDAgentConnection *self);
+static void read_next_block(VDAgentConnection *self);
+#ifdef HAVE_LIBURING
+static void uring_read_cb(gssize res, gpointer user_data);
+static void uring_write_cb(gssize res, gpointer user_data);
+#endif
 
 GIOStream *vdagent_file_open(const gchar *path, GError **err)
 {
@@ -81,8 +211,22 @@ GIOStream *vdagent_socket_connect(const gchar *path, GError **err)
 static void vdagent_connection_init(VDAgentConnection *self)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint i;
+
     priv->cancellable = g_cancellable_new();
-    priv->write_queue = g_queue_new();
+    priv->open_retry_initial = OPEN_RETRY_DEFAULT_INITIAL_DELAY;
+    priv->open_retry_max = OPEN_RETRY_DEFAULT_MAX_DELAY;
+    priv->open_time = -1;
+    for (i = 0; i < VDAGENT_WRITE_N_PRIORITIES; i++) {
+        g_queue_init(&priv->write_queues[i]);
+    }
+    priv->max_write_vectors = WRITE_MAX_VECTORS;
+    priv->max_write_bytes = WRITE_DEFAULT_MAX_BYTES;
+    priv->high_watermark = WRITE_DEFAULT_HIGH_WATERMARK;
+    priv->low_watermark = WRITE_DEFAULT_LOW_WATERMARK;
+    priv->read_buf_size = READ_DEFAULT_BUFFER_SIZE;
+    priv->pool_max_retained = POOL_DEFAULT_MAX_RETAINED;
+    g_mutex_init(&priv->stats_lock);
 }
 
 static void vdagent_connection_dispose(GObject *obj)
@@ -90,20 +234,61 @@ static void vdagent_connection_dispose(GObject *obj)
     VDAgentConnection *self = VDAGENT_CONNECTION(obj);
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
 
+#ifdef HAVE_LIBURING
+    g_clear_pointer(&priv->uring, vdagent_uring_free);
+#endif
     g_clear_object(&priv->cancellable);
     g_clear_object(&priv->io_stream);
+    g_clear_pointer(&priv->io_loop, g_main_loop_unref);
+    g_clear_pointer(&priv->context, g_main_context_unref);
+    g_clear_pointer(&priv->main_context, g_main_context_unref);
 
     G_OBJECT_CLASS(vdagent_connection_parent_class)->dispose(obj);
 }
 
+/* Free pooled buffers until at most @max_retained bytes are kept */
+static void pool_trim(VDAgentConnection *self, gsize max_retained)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    PoolBuffer *buf;
+    gint i;
+
+    for (i = POOL_N_CLASSES - 1; i >= 0; i--) {
+        while (priv->pool_stats.retained > max_retained && priv->pool[i]) {
+            buf = priv->pool[i];
+            priv->pool[i] = buf->next;
+            g_mutex_lock(&priv->stats_lock);
+            priv->pool_stats.retained -= POOL_CLASS_SIZE(i);
+            g_mutex_unlock(&priv->stats_lock);
+            g_free(buf);
+        }
+    }
+}
+
+static void write_entry_free(WriteEntry *entry)
+{
+    g_bytes_unref(entry->bytes);
+    g_free(entry);
+}
+
 static void vdagent_connection_finalize(GObject *obj)
 {
     VDAgentConnection *self = VDAGENT_CONNECTION(obj);
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint i;
 
-    g_queue_free_full(priv->write_queue, (GDestroyNotify)g_bytes_unref);
+    for (i = 0; i < VDAGENT_WRITE_N_PRIORITIES; i++) {
+        g_queue_clear_full(&priv->write_queues[i], (GDestroyNotify)write_entry_free);
+    }
     g_free(priv->header_buf);
-    g_free(priv->data_buf);
+    g_free(priv->raw_header_buf);
+    if (priv->read_tap_notify) {
+        priv->read_tap_notify(priv->read_tap_data);
+    }
+    vdagent_connection_buffer_free(self, priv->data_buf);
+    g_free(priv->read_buf);
+    pool_trim(self, 0);
+    g_mutex_clear(&priv->stats_lock);
 
     G_OBJECT_CLASS(vdagent_connection_parent_class)->finalize(obj);
 }
@@ -115,6 +300,33 @@ static void vdagent_connection_class_init(VDAgentConnectionClass *klass)
     gobject_class->finalize = vdagent_connection_finalize;
 }
 
+static gpointer io_thread_func(gpointer user_data)
+{
+    VDAgentConnectionPrivate *priv = user_data;
+
+    g_main_context_push_thread_default(priv->context);
+    g_main_loop_run(priv->io_loop);
+    g_main_context_pop_thread_default(priv->context);
+    return NULL;
+}
+
+/* TRUE if called from another thread than the I/O thread of @self */
+static gboolean needs_marshalling(VDAgentConnectionPrivate *priv)
+{
+    return priv->io_thread != NULL && g_thread_self() != priv->io_thread;
+}
+
+static gboolean start_reading_cb(gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (!g_cancellable_is_cancelled(priv->cancellable)) {
+        read_next_block(self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
 void vdagent_connection_setup(VDAgentConnection *self,
                               GIOStream         *io_stream,
                               gboolean           wait_on_opening,
@@ -122,13 +334,262 @@ void vdagent_connection_setup(VDAgentConnection *self,
                               VDAgentConnErrorCb error_cb)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    priv->main_context = g_main_context_ref_thread_default();
+    priv->context = priv->use_io_thread ?
+        g_main_context_new() : g_main_context_ref(priv->main_context);
     priv->io_stream = io_stream;
     priv->opening = wait_on_opening;
+    priv->open_start_time = g_get_monotonic_time();
+    if (!wait_on_opening) {
+        priv->open_time = 0;
+    }
     priv->header_size = header_size;
     priv->header_buf = g_malloc(header_size);
+    priv->raw_header_buf = g_malloc(header_size);
+    priv->read_buf_size = MAX(priv->read_buf_size, 2 * header_size);
+    priv->read_buf = g_malloc(priv->read_buf_size);
     priv->error_cb = error_cb;
+#ifdef HAVE_LIBURING
+    priv->uring = vdagent_uring_new(io_stream, priv->context,
+                                    uring_read_cb, uring_write_cb, self);
+#endif
+
+    if (!priv->use_io_thread) {
+        read_next_block(self);
+        return;
+    }
+
+    priv->io_loop = g_main_loop_new(priv->context, FALSE);
+    priv->io_thread = g_thread_new("vdagent-io", io_thread_func, priv);
+
+    /* started from the I/O thread once io_thread is set, so its
+     * callbacks never see the connection without it */
+    g_main_context_invoke_full(priv->context, G_PRIORITY_DEFAULT,
+                               start_reading_cb, g_object_ref(self),
+                               g_object_unref);
+}
+
+void vdagent_connection_use_io_thread(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(priv->io_stream == NULL);
+    priv->use_io_thread = TRUE;
+}
+
+gboolean vdagent_connection_uses_io_uring(VDAgentConnection *self)
+{
+#ifdef HAVE_LIBURING
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    return priv->uring != NULL;
+#else
+    return FALSE;
+#endif
+}
+
+void vdagent_connection_invoke(VDAgentConnection *self,
+                               GSourceFunc        func,
+                               gpointer           data,
+                               GDestroyNotify     notify)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (needs_marshalling(priv)) {
+        g_main_context_invoke_full(priv->context, G_PRIORITY_DEFAULT,
+                                   func, data, notify);
+        return;
+    }
+
+    func(data);
+    if (notify) {
+        notify(data);
+    }
+}
+
+gboolean vdagent_connection_is_closed(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    return g_cancellable_is_cancelled(priv->cancellable);
+}
+
+typedef struct {
+    VDAgentConnection *self;
+    GError            *err;
+} ErrorData;
+
+static gboolean report_error_cb(gpointer user_data)
+{
+    ErrorData *data = user_data;
+    VDAgentConnectionPrivate *priv =
+        vdagent_connection_get_instance_private(data->self);
+
+    /* the connection may have been destroyed in the meantime */
+    if (g_cancellable_is_cancelled(priv->cancellable)) {
+        g_clear_error(&data->err);
+    } else {
+        priv->error_cb(data->self, data->err);
+    }
+    g_object_unref(data->self);
+    g_free(data);
+    return G_SOURCE_REMOVE;
+}
+
+void vdagent_connection_report_error(VDAgentConnection *self,
+                                     GError            *err)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    ErrorData *data;
+
+    if (!priv->use_io_thread) {
+        priv->error_cb(self, err);
+        return;
+    }
+
+    /* the connection gets destroyed from the main context later,
+     * stop handling the incoming data meanwhile */
+    if (!needs_marshalling(priv)) {
+        priv->read_failed = TRUE;
+    }
+
+    data = g_new(ErrorData, 1);
+    data->self = g_object_ref(self);
+    data->err = err;
+    g_main_context_invoke(priv->main_context, report_error_cb, data);
+}
+
+static gboolean notify_writable_cb(gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (priv->writable_cb && !g_cancellable_is_cancelled(priv->cancellable)) {
+        priv->writable_cb(self, priv->writable_cb_data);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void notify_writable(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (priv->io_thread == NULL) {
+        if (priv->writable_cb) {
+            priv->writable_cb(self, priv->writable_cb_data);
+        }
+        return;
+    }
+
+    g_main_context_invoke_full(priv->main_context, G_PRIORITY_DEFAULT,
+                               notify_writable_cb, g_object_ref(self),
+                               g_object_unref);
+}
+
+void vdagent_connection_set_open_backoff(VDAgentConnection *self,
+                                         guint              initial_delay,
+                                         guint              max_delay)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->open_retry_initial = MAX(initial_delay, 1);
+    priv->open_retry_max = MAX(max_delay, priv->open_retry_initial);
+}
+
+gint64 vdagent_connection_get_open_time(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    return priv->open_time;
+}
+
+void vdagent_connection_set_read_buffer_size(VDAgentConnection *self,
+                                             gsize              size)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(priv->read_buf == NULL);
+    priv->read_buf_size = size;
+}
+
+gpointer vdagent_connection_buffer_alloc(VDAgentConnection *self,
+                                        gsize              size)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    PoolBuffer *buf;
+    gsize size_class;
+
+    size_class = size <= POOL_CLASS_SIZE(0) ?
+        0 : g_bit_storage(size - 1) - POOL_MIN_SHIFT;
+
+    /* the stats are read from any thread, the pool itself is only
+     * used from the I/O context */
+    if (size_class < POOL_N_CLASSES && priv->pool[size_class]) {
+        buf = priv->pool[size_class];
+        priv->pool[size_class] = buf->next;
+        g_mutex_lock(&priv->stats_lock);
+        priv->pool_stats.retained -= POOL_CLASS_SIZE(size_class);
+        priv->pool_stats.hits++;
+        g_mutex_unlock(&priv->stats_lock);
+    } else if (size_class < POOL_N_CLASSES) {
+        buf = g_malloc(sizeof(PoolBuffer) + POOL_CLASS_SIZE(size_class));
+        buf->size_class = size_class;
+        g_mutex_lock(&priv->stats_lock);
+        priv->pool_stats.misses++;
+        g_mutex_unlock(&priv->stats_lock);
+    } else {
+        buf = g_malloc(sizeof(PoolBuffer) + size);
+        buf->size_class = POOL_N_CLASSES;
+        g_mutex_lock(&priv->stats_lock);
+        priv->pool_stats.oversized++;
+        g_mutex_unlock(&priv->stats_lock);
+    }
+
+    return buf + 1;
+}
+
+void vdagent_connection_buffer_free(VDAgentConnection *self,
+                                    gpointer           data)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    PoolBuffer *buf;
+
+    if (data == NULL) {
+        return;
+    }
 
-    read_next_message(self);
+    buf = (PoolBuffer *)data - 1;
+    if (buf->size_class >= POOL_N_CLASSES ||
+        priv->pool_stats.retained + POOL_CLASS_SIZE(buf->size_class) >
+        priv->pool_max_retained) {
+        g_free(buf);
+        return;
+    }
+
+    buf->next = priv->pool[buf->size_class];
+    priv->pool[buf->size_class] = buf;
+    g_mutex_lock(&priv->stats_lock);
+    priv->pool_stats.retained += POOL_CLASS_SIZE(buf->size_class);
+    g_mutex_unlock(&priv->stats_lock);
+}
+
+void vdagent_connection_set_buffer_pool_limit(VDAgentConnection *self,
+                                              gsize              max_retained)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->pool_max_retained = max_retained;
+    pool_trim(self, max_retained);
+}
+
+void vdagent_connection_get_buffer_pool_stats(VDAgentConnection      *self,
+                                              VDAgentBufferPoolStats *stats)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_mutex_lock(&priv->stats_lock);
+    *stats = priv->pool_stats;
+    g_mutex_unlock(&priv->stats_lock);
 }
 
 void vdagent_connection_destroy(gpointer p)
@@ -138,6 +599,26 @@ void vdagent_connection_destroy(gpointer p)
     VDAgentConnection *self = VDAGENT_CONNECTION(p);
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
     g_cancellable_cancel(priv->cancellable);
+    if (priv->io_thread) {
+        g_return_if_fail(g_thread_self() != priv->io_thread);
+
+        g_main_loop_quit(priv->io_loop);
+        g_thread_join(priv->io_thread);
+        priv->io_thread = NULL;
+
+        /* let the cancelled operations release their references */
+        g_main_context_push_thread_default(priv->context);
+        while (g_main_context_iteration(priv->context, FALSE));
+        g_main_context_pop_thread_default(priv->context);
+    }
+#ifdef HAVE_LIBURING
+    /* the kernel must be done with the buffers before they're freed */
+    g_clear_pointer(&priv->uring, vdagent_uring_free);
+#endif
+    if (priv->open_retry_source) {
+        g_source_destroy(priv->open_retry_source);
+        g_clear_pointer(&priv->open_retry_source, g_source_unref);
+    }
     g_io_stream_close(priv->io_stream, NULL, NULL);
     g_object_unref(self);
 }
@@ -163,145 +644,940 @@ PidUid vdagent_connection_get_peer_pid_uid(VDAgentConnection *self,
     return pid_uid;
 }
 
+/* Gathers as many queued messages as the write budget allows
+ * into @vectors, recording the lane of each one in @lanes.
+ * A message partially written by the previous write is always
+ * completed first, then the lanes are drained in order of priority.
+ * The fragments of a message are gathered back to back, if the next
+ * one hasn't been queued yet gathering stops there.
+ *
+ * Returns the number of vectors. */
+static gsize gather_write(VDAgentConnection *self,
+                          GOutputVector     *vectors,
+                          guint             *lanes)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GList *next[VDAGENT_WRITE_N_PRIORITIES];
+    gsize n_vectors = 0, n_bytes = 0, size, offset = priv->bytes_written;
+    gboolean in_frame = priv->bytes_written > 0 || priv->frame_open;
+    guint lane = priv->write_lane;
+    WriteEntry *entry;
+    const guint8 *data;
+    guint i;
+
+    for (i = 0; i < VDAGENT_WRITE_N_PRIORITIES; i++) {
+        next[i] = g_queue_peek_head_link(&priv->write_queues[i]);
+    }
+
+    while (n_vectors < priv->max_write_vectors && n_bytes < priv->max_write_bytes) {
+        if (!in_frame) {
+            for (lane = 0; lane < VDAGENT_WRITE_N_PRIORITIES && !next[lane]; lane++);
+            if (lane == VDAGENT_WRITE_N_PRIORITIES) {
+                break;
+            }
+        } else if (next[lane] == NULL) {
+            /* the rest of the message hasn't been queued yet */
+            break;
+        }
+
+        entry = next[lane]->data;
+        next[lane] = next[lane]->next;
+        data = g_bytes_get_data(entry->bytes, &size);
+        vectors[n_vectors].buffer = data + offset;
+        vectors[n_vectors].size = size - offset;
+        lanes[n_vectors] = lane;
+        n_bytes += size - offset;
+        n_vectors++;
+        offset = 0;
+        in_frame = entry->more;
+    }
+    return n_vectors;
+}
+
+/* TRUE if gather_write() has anything to pick up */
+static gboolean write_ready(VDAgentConnectionPrivate *priv)
+{
+    if (priv->bytes_written > 0 || priv->frame_open) {
+        return !g_queue_is_empty(&priv->write_queues[priv->write_lane]);
+    }
+    return priv->n_queued > 0;
+}
+
+static guint latency_bucket(gint64 usec)
+{
+    return MIN(usec > 0 ? g_bit_storage(usec) : 0,
+               VDAGENT_CONNECTION_LATENCY_BUCKETS - 1);
+}
+
+static void count_write_stall(VDAgentConnectionPrivate *priv)
+{
+    g_mutex_lock(&priv->stats_lock);
+    priv->stats.write_stalls++;
+    g_mutex_unlock(&priv->stats_lock);
+}
+
+/* Releases the messages that have been written completely,
+ * returns TRUE if there's still data that can be written */
+static gboolean complete_write(VDAgentConnection   *self,
+                               const GOutputVector *vectors,
+                               const guint         *lanes,
+                               gsize                n_vectors,
+                               gsize                written)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    gint64 now = g_get_monotonic_time();
+    WriteEntry *entry;
+    gsize i;
+
+    g_mutex_lock(&priv->stats_lock);
+    priv->stats.bytes_out += written;
+
+    /* every vector is the head of its lane by the time it's reached */
+    priv->queued_bytes -= written;
+    for (i = 0; i < n_vectors; i++) {
+        if (written < vectors[i].size) {
+            priv->bytes_written += written;
+            priv->write_lane = lanes[i];
+            break;
+        }
+        written -= vectors[i].size;
+        priv->bytes_written = 0;
+        entry = g_queue_pop_head(&priv->write_queues[lanes[i]]);
+        priv->frame_open = entry->more;
+        priv->write_lane = lanes[i];
+        priv->stats.write_latency[latency_bucket(now - entry->queue_time)]++;
+        priv->stats.messages_out++;
+        write_entry_free(entry);
+        priv->n_queued--;
+    }
+    priv->stats.queue_depth = priv->n_queued;
+    priv->stats.queued_bytes = priv->queued_bytes;
+    g_mutex_unlock(&priv->stats_lock);
+
+    if (VDAGENT_CONNECTION_GET_CLASS(self)->fill_write_queue) {
+        priv->filling = TRUE;
+        VDAGENT_CONNECTION_GET_CLASS(self)->fill_write_queue(self);
+        priv->filling = FALSE;
+    }
+
+    /* the callback may queue new messages, they're picked up
+     * by the write in progress */
+    if (priv->write_blocked &&
+        priv->queued_bytes + priv->write_backlog <= priv->low_watermark) {
+        g_atomic_int_set(&priv->write_blocked, FALSE);
+        notify_writable(self);
+    }
+
+    return write_ready(priv);
+}
+
 /* Performs single write operation,
  * returns TRUE if there's still data to be written, otherwise FALSE. */
 static gboolean do_write(VDAgentConnection *self, gboolean block)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GOutputVector vectors[WRITE_MAX_VECTORS];
+    guint lanes[WRITE_MAX_VECTORS];
     GOutputStream *out;
-    GBytes *msg;
-    gssize res;
+    gsize n_vectors, written = 0;
     GError *err = NULL;
 
-    msg = g_queue_peek_head(priv->write_queue);
-    out = g_io_stream_get_output_stream(priv->io_stream);
-
-    if (!msg) {
+    if (!write_ready(priv)) {
         return FALSE;
     }
 
-    res = g_pollable_stream_write(out,
-        g_bytes_get_data(msg, NULL) + priv->bytes_written,
-        g_bytes_get_size(msg) - priv->bytes_written,
-        block, priv->cancellable, &err);
+    n_vectors = gather_write(self, vectors, lanes);
+    out = g_io_stream_get_output_stream(priv->io_stream);
+
+    if (block) {
+        g_output_stream_writev(out, vectors, n_vectors, &written,
+                               priv->cancellable, &err);
+    } else if (g_pollable_output_stream_writev_nonblocking(
+                   G_POLLABLE_OUTPUT_STREAM(out), vectors, n_vectors,
+                   &written, priv->cancellable, &err) ==
+               G_POLLABLE_RETURN_WOULD_BLOCK) {
+        count_write_stall(priv);
+        return TRUE;
+    }
 
     if (err) {
         if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
             g_error_free(err);
+            count_write_stall(priv);
             return TRUE;
         } else if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
             g_error_free(err);
             return FALSE;
         } else {
-            priv->error_cb(self, err);
+            vdagent_connection_report_error(self, err);
             return FALSE;
         }
     }
 
-    priv->bytes_written += res;
+    return complete_write(self, vectors, lanes, n_vectors, written);
+}
 
-    if (priv->bytes_written == g_bytes_get_size(msg)) {
-        g_bytes_unref(g_queue_pop_head(priv->write_queue));
-        priv->bytes_written = 0;
+#ifdef HAVE_LIBURING
+/* Submits the queued messages unless a write is already in flight,
+ * the next one is started once it completes */
+static void uring_start_write(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (!write_ready(priv) || vdagent_uring_write_pending(priv->uring)) {
+        return;
+    }
+    priv->uring_n_vectors = gather_write(self, priv->uring_vectors, priv->uring_lanes);
+    vdagent_uring_writev(priv->uring, priv->uring_vectors, priv->uring_n_vectors);
+}
+
+static void uring_write_cb(gssize res, gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (g_cancellable_is_cancelled(priv->cancellable)) {
+        return;
+    }
+    if (res == -EAGAIN) {
+        count_write_stall(priv);
+        return;
+    }
+    if (res < 0) {
+        vdagent_connection_report_error(self,
+            g_error_new_literal(G_IO_ERROR, g_io_error_from_errno(-res),
+                                g_strerror(-res)));
+        return;
     }
 
-    return !g_queue_is_empty(priv->write_queue);
+    /* the writable callback may destroy the connection */
+    g_object_ref(self);
+    complete_write(self, priv->uring_vectors, priv->uring_lanes,
+                   priv->uring_n_vectors, res);
+    if (priv->uring && !g_cancellable_is_cancelled(priv->cancellable)) {
+        uring_start_write(self);
+    }
+    g_object_unref(self);
 }
+#endif
 
 static gboolean out_stream_ready_cb(GObject *pollable_stream,
                                     gpointer user_data)
 {
-    return do_write(user_data, FALSE);
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (do_write(self, FALSE)) {
+        return G_SOURCE_CONTINUE;
+    }
+    priv->writing = FALSE;
+    return G_SOURCE_REMOVE;
 }
 
 void vdagent_connection_write(VDAgentConnection *self,
                               gpointer           data,
                               gsize              size)
+{
+    vdagent_connection_write_with_priority(self, data, size,
+                                           VDAGENT_WRITE_PRIORITY_BULK);
+}
+
+void vdagent_connection_write_with_priority(VDAgentConnection   *self,
+                                            gpointer             data,
+                                            gsize                size,
+                                            VDAgentWritePriority priority)
+{
+    vdagent_connection_write_bytes(self, g_bytes_new_take(data, size), priority);
+}
+
+typedef struct {
+    VDAgentConnection   *self;
+    GBytes              *bytes;
+    VDAgentWritePriority priority;
+    gboolean             last;
+} WriteData;
+
+static gboolean write_in_io_thread_cb(gpointer user_data)
+{
+    WriteData *write = user_data;
+
+    vdagent_connection_write_fragment(write->self, write->bytes,
+                                      write->priority, write->last);
+    g_object_unref(write->self);
+    g_free(write);
+    return G_SOURCE_REMOVE;
+}
+
+void vdagent_connection_write_bytes(VDAgentConnection   *self,
+                                    GBytes              *bytes,
+                                    VDAgentWritePriority priority)
+{
+    vdagent_connection_write_fragment(self, bytes, priority, TRUE);
+}
+
+void vdagent_connection_write_fragment(VDAgentConnection   *self,
+                                       GBytes              *bytes,
+                                       VDAgentWritePriority priority,
+                                       gboolean             last)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
     GPollableOutputStream *out;
     GSource *source;
+    WriteData *write;
+    WriteEntry *entry;
+
+    g_return_if_fail(priority < VDAGENT_WRITE_N_PRIORITIES);
+
+    if (needs_marshalling(priv)) {
+        write = g_new(WriteData, 1);
+        write->self = g_object_ref(self);
+        write->bytes = bytes;
+        write->priority = priority;
+        write->last = last;
+        g_main_context_invoke(priv->context, write_in_io_thread_cb, write);
+        return;
+    }
+
+    entry = g_new(WriteEntry, 1);
+    entry->bytes = bytes;
+    entry->queue_time = g_get_monotonic_time();
+    entry->more = !last;
+    g_queue_push_tail(&priv->write_queues[priority], entry);
+    priv->n_queued++;
+    priv->queued_bytes += g_bytes_get_size(bytes);
+
+    g_mutex_lock(&priv->stats_lock);
+    priv->stats.queue_depth = priv->n_queued;
+    priv->stats.peak_queue_depth = MAX(priv->stats.peak_queue_depth, priv->n_queued);
+    priv->stats.queued_bytes = priv->queued_bytes;
+    priv->stats.peak_queued_bytes = MAX(priv->stats.peak_queued_bytes, priv->queued_bytes);
+    g_mutex_unlock(&priv->stats_lock);
+    if (priv->queued_bytes + priv->write_backlog > priv->high_watermark) {
+        g_atomic_int_set(&priv->write_blocked, TRUE);
+    }
+
+    /* the write in progress picks the message up */
+    if (priv->filling) {
+        return;
+    }
 
-    g_queue_push_tail(priv->write_queue, g_bytes_new_take(data, size));
+#ifdef HAVE_LIBURING
+    if (priv->uring) {
+        uring_start_write(self);
+        return;
+    }
+#endif
 
-    if (g_queue_get_length(priv->write_queue) == 1) {
+    if (!priv->writing) {
         out = G_POLLABLE_OUTPUT_STREAM(g_io_stream_get_output_stream(priv->io_stream));
 
         source = g_pollable_output_stream_create_source(out, priv->cancellable);
         g_source_set_callback(source, (GSourceFunc) out_stream_ready_cb,
             g_object_ref(self), g_object_unref);
-        g_source_attach(source, NULL);
+        g_source_attach(source, priv->context);
         g_source_unref(source);
+        priv->writing = TRUE;
+    }
+}
+
+void vdagent_connection_set_write_budget(VDAgentConnection *self,
+                                         guint              max_vectors,
+                                         gsize              max_bytes)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->max_write_vectors = CLAMP(max_vectors, 1, WRITE_MAX_VECTORS);
+    priv->max_write_bytes = MAX(max_bytes, 1);
+}
+
+void vdagent_connection_set_write_watermarks(VDAgentConnection *self,
+                                             gsize              high,
+                                             gsize              low)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(low <= high);
+
+    priv->high_watermark = high;
+    priv->low_watermark = low;
+    if (priv->queued_bytes + priv->write_backlog > high) {
+        g_atomic_int_set(&priv->write_blocked, TRUE);
+    } else if (priv->write_blocked &&
+               priv->queued_bytes + priv->write_backlog <= low) {
+        /* raised above what's queued, nothing would unblock it otherwise */
+        g_atomic_int_set(&priv->write_blocked, FALSE);
+        notify_writable(self);
+    }
+}
+
+void vdagent_connection_set_writable_cb(VDAgentConnection    *self,
+                                        VDAgentConnWritableCb writable_cb,
+                                        gpointer              user_data)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->writable_cb = writable_cb;
+    priv->writable_cb_data = user_data;
+}
+
+gboolean vdagent_connection_is_writable(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    return !g_atomic_int_get(&priv->write_blocked);
+}
+
+gsize vdagent_connection_get_queued_bytes(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    return priv->queued_bytes;
+}
+
+void vdagent_connection_set_write_backlog(VDAgentConnection *self,
+                                          gsize              bytes)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(!needs_marshalling(priv));
+
+    priv->write_backlog = bytes;
+    if (priv->queued_bytes + priv->write_backlog > priv->high_watermark) {
+        g_atomic_int_set(&priv->write_blocked, TRUE);
     }
 }
 
+void vdagent_connection_get_stats(VDAgentConnection      *self,
+                                  VDAgentConnectionStats *stats)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_mutex_lock(&priv->stats_lock);
+    *stats = priv->stats;
+    g_mutex_unlock(&priv->stats_lock);
+}
+
+typedef struct {
+    VDAgentConnection *self;
+    GMutex             lock;
+    GCond              cond;
+    gboolean           done;
+} FlushData;
+
+static gboolean flush_in_io_thread_cb(gpointer user_data)
+{
+    FlushData *flush = user_data;
+
+    vdagent_connection_flush(flush->self);
+
+    g_mutex_lock(&flush->lock);
+    flush->done = TRUE;
+    g_cond_signal(&flush->cond);
+    g_mutex_unlock(&flush->lock);
+    return G_SOURCE_REMOVE;
+}
+
 void vdagent_connection_flush(VDAgentConnection *self)
 {
-    while (do_write(self, TRUE));
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    FlushData flush = { self };
+
+    if (!needs_marshalling(priv)) {
+#ifdef HAVE_LIBURING
+        if (priv->uring) {
+            /* a successful write starts the next one right away */
+            uring_start_write(self);
+            while (priv->uring && vdagent_uring_write_pending(priv->uring)) {
+                vdagent_uring_wait_write(priv->uring);
+            }
+            return;
+        }
+#endif
+        while (do_write(self, TRUE));
+        return;
+    }
+
+    /* messages written from this thread are queued in the I/O thread
+     * before this runs there, wait for them to be written */
+    g_mutex_init(&flush.lock);
+    g_cond_init(&flush.cond);
+    g_main_context_invoke(priv->context, flush_in_io_thread_cb, &flush);
+
+    g_mutex_lock(&flush.lock);
+    while (!flush.done) {
+        g_cond_wait(&flush.cond, &flush.lock);
+    }
+    g_mutex_unlock(&flush.lock);
+    g_mutex_clear(&flush.lock);
+    g_cond_clear(&flush.cond);
 }
 
-static void message_read_cb(GObject      *source_object,
-                            GAsyncResult *res,
-                            gpointer      user_data)
+/* Passes the message as it was read to the read tap */
+static void tap_message(VDAgentConnection *self, gpointer data)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GOutputVector vectors[1 + VDAGENT_CONNECTION_MAX_BODY_VECTORS];
+    guint i, n_vectors = 1;
+
+    vectors[0].buffer = priv->raw_header_buf;
+    vectors[0].size = priv->header_size;
+    if (priv->data_size > 0 && priv->n_body_vectors > 0) {
+        for (i = 0; i < priv->n_body_vectors; i++) {
+            vectors[n_vectors].buffer = priv->body_vectors[i].buffer;
+            vectors[n_vectors].size = priv->body_vectors[i].size;
+            n_vectors++;
+        }
+    } else if (priv->data_size > 0) {
+        vectors[n_vectors].buffer = data;
+        vectors[n_vectors].size = priv->data_size;
+        n_vectors++;
+    }
+    priv->read_tap(self, vectors, n_vectors, priv->read_tap_data);
+}
+
+static void handle_message(VDAgentConnection *self, gpointer data)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->header_read = FALSE;
+
+    g_mutex_lock(&priv->stats_lock);
+    priv->stats.messages_in++;
+    priv->stats.bytes_in += priv->header_size + priv->data_size;
+    g_mutex_unlock(&priv->stats_lock);
+
+    if (priv->read_tap) {
+        tap_message(self, data);
+    }
+
+    VDAGENT_CONNECTION_GET_CLASS(self)->handle_message(
+        self, priv->header_buf, priv->data_size > 0 ? data : NULL);
+}
+
+static void body_read_cb(GObject      *source_object,
+                         GAsyncResult *res,
+                         gpointer      user_data);
+
+/* Advances the body vectors by @size bytes,
+ * copying them from @data unless it's NULL */
+static void scatter_body(VDAgentConnectionPrivate *priv,
+                         const guint8             *data,
+                         gsize                     size)
+{
+    GInputVector *vector;
+    gsize n;
+
+    while (size > 0) {
+        g_return_if_fail(priv->body_vector < priv->n_body_vectors);
+
+        vector = &priv->body_vectors[priv->body_vector];
+        n = MIN(size, vector->size - priv->body_vector_pos);
+        if (data) {
+            memcpy((guint8 *)vector->buffer + priv->body_vector_pos, data, n);
+            data += n;
+        }
+        size -= n;
+        priv->body_vector_pos += n;
+        if (priv->body_vector_pos == vector->size) {
+            priv->body_vector++;
+            priv->body_vector_pos = 0;
+        }
+    }
+}
+
+/* Reads the rest of a large message body into data_buf,
+ * or straight into the current body vector */
+static void read_body(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GInputStream *in;
+    guint8 *data;
+    gsize size;
+
+    if (priv->n_body_vectors > 0) {
+        GInputVector *vector = &priv->body_vectors[priv->body_vector];
+
+        data = (guint8 *)vector->buffer + priv->body_vector_pos;
+        size = vector->size - priv->body_vector_pos;
+    } else {
+        data = (guint8 *)priv->data_buf + priv->data_size - priv->body_bytes_pending;
+        size = priv->body_bytes_pending;
+    }
+
+#ifdef HAVE_LIBURING
+    if (priv->uring) {
+        vdagent_uring_read(priv->uring, data, size);
+        return;
+    }
+#endif
+
+    in = g_io_stream_get_input_stream(priv->io_stream);
+    g_input_stream_read_async(in, data, size,
+        G_PRIORITY_DEFAULT, priv->cancellable,
+        body_read_cb, g_object_ref(self));
+}
+
+/* Handles all complete messages in the receive buffer.
+ *
+ * Returns FALSE if no further block should be read,
+ * either because the connection was cancelled or paused or because
+ * the rest of a large message body is being read into data_buf. */
+static gboolean parse_messages(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    VDAgentConnectionClass *klass = VDAGENT_CONNECTION_GET_CLASS(self);
+    guint8 *data;
+    gsize avail;
+
+    while (!g_cancellable_is_cancelled(priv->cancellable) && !priv->read_failed &&
+           !priv->read_paused && !priv->read_throttled) {
+        avail = priv->read_end - priv->read_start;
+
+        if (!priv->header_read) {
+            if (avail < priv->header_size) {
+                break;
+            }
+            memcpy(priv->header_buf, priv->read_buf + priv->read_start,
+                   priv->header_size);
+            memcpy(priv->raw_header_buf, priv->header_buf, priv->header_size);
+            priv->read_start += priv->header_size;
+            priv->header_read = TRUE;
+            priv->data_size = klass->handle_header(self, priv->header_buf);
+            priv->n_body_vectors = 0;
+            priv->body_vector = 0;
+            priv->body_vector_pos = 0;
+            if (priv->data_size > 0 && klass->get_body_vectors) {
+                priv->n_body_vectors = klass->get_body_vectors(self,
+                    priv->header_buf, priv->data_size, priv->body_vectors);
+            }
+            continue;
+        }
+
+        if (priv->data_size > priv->read_buf_size) {
+            /* the body doesn't fit into the receive buffer,
+             * read the rest of it straight into its destination */
+            if (priv->n_body_vectors > 0) {
+                scatter_body(priv, priv->read_buf + priv->read_start, avail);
+            } else {
+                priv->data_buf = vdagent_connection_buffer_alloc(self, priv->data_size);
+                memcpy(priv->data_buf, priv->read_buf + priv->read_start, avail);
+            }
+            priv->read_start = priv->read_end = 0;
+            priv->body_bytes_pending = priv->data_size - avail;
+            read_body(self);
+            return FALSE;
+        }
+
+        if (avail < priv->data_size) {
+            break;
+        }
+
+        data = priv->read_buf + priv->read_start;
+        priv->read_start += priv->data_size;
+        if (priv->n_body_vectors > 0) {
+            scatter_body(priv, data, priv->data_size);
+            handle_message(self, NULL);
+        } else if (priv->data_size > 0 && (gsize)data % BODY_ALIGNMENT != 0) {
+            data = memcpy(vdagent_connection_buffer_alloc(self, priv->data_size),
+                          data, priv->data_size);
+            handle_message(self, data);
+            vdagent_connection_buffer_free(self, data);
+        } else {
+            handle_message(self, data);
+        }
+    }
+
+    /* move the incomplete message to the beginning of the buffer */
+    avail = priv->read_end - priv->read_start;
+    if (avail > 0 && priv->read_start > 0) {
+        memmove(priv->read_buf, priv->read_buf + priv->read_start, avail);
+    }
+    priv->read_start = 0;
+    priv->read_end = avail;
+
+    if (g_cancellable_is_cancelled(priv->cancellable) || priv->read_failed) {
+        return FALSE;
+    }
+    if (priv->read_paused || priv->read_throttled) {
+        priv->read_stalled = TRUE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Called when a part of a large message body has been read */
+static void handle_body_read(VDAgentConnection *self,
+                             gssize             bytes_read,
+                             GError            *err)
 {
-    VDAgentConnection *self = user_data;
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
-    GInputStream *in = G_INPUT_STREAM(source_object);
+
+    if (err) {
+        if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_error_free(err);
+        } else {
+            vdagent_connection_report_error(self, err);
+        }
+        return;
+    }
+
+    if (bytes_read == 0) {
+        vdagent_connection_report_error(self, NULL);
+        return;
+    }
+
+    priv->body_bytes_pending -= bytes_read;
+    if (priv->n_body_vectors > 0) {
+        scatter_body(priv, NULL, bytes_read);
+    }
+    if (priv->body_bytes_pending > 0) {
+        read_body(self);
+        return;
+    }
+
+    handle_message(self, priv->data_buf);
+    vdagent_connection_buffer_free(self, priv->data_buf);
+    priv->data_buf = NULL;
+
+    if (parse_messages(self)) {
+        read_next_block(self);
+    }
+}
+
+static void body_read_cb(GObject      *source_object,
+                         GAsyncResult *res,
+                         gpointer      user_data)
+{
+    VDAgentConnection *self = user_data;
     GError *err = NULL;
-    gsize bytes_read, data_size;
+    gssize bytes_read;
+
+    bytes_read = g_input_stream_read_finish(G_INPUT_STREAM(source_object),
+                                            res, &err);
+    handle_body_read(self, bytes_read, err);
+    g_object_unref(self);
+}
+
+static gboolean open_retry_cb(gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_clear_pointer(&priv->open_retry_source, g_source_unref);
+    read_next_block(self);
+    return G_SOURCE_REMOVE;
+}
+
+/* The remote side hasn't opened the connection yet, so reads return 0
+ * right away. The stream can't be polled for the remote side to show up
+ * either, a disconnected virtio port is reported as hung up.
+ * Retry from a timeout with an increasing delay instead. */
+static void retry_read_later(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (priv->open_retry_delay == 0) {
+        priv->open_retry_delay = priv->open_retry_initial;
+    } else {
+        priv->open_retry_delay = MIN(priv->open_retry_delay * 2,
+                                     priv->open_retry_max);
+    }
+
+    priv->open_retry_source = g_timeout_source_new(priv->open_retry_delay);
+    g_source_set_callback(priv->open_retry_source, open_retry_cb,
+                          g_object_ref(self), g_object_unref);
+    g_source_attach(priv->open_retry_source, priv->context);
+}
+
+static void handle_block_read(VDAgentConnection *self,
+                              gssize             bytes_read,
+                              GError            *err)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
 
-    g_input_stream_read_all_finish(in, res, &bytes_read, &err);
     if (err) {
         if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
             g_error_free(err);
         } else {
-            priv->error_cb(self, err);
+            vdagent_connection_report_error(self, err);
         }
-        goto unref;
+        return;
     }
 
     if (bytes_read == 0) {
         /* see virtio-port.c for the rationale behind this */
         if (priv->opening) {
-            g_usleep(10000);
-            read_next_message(self);
+            retry_read_later(self);
         } else {
-            priv->error_cb(self, NULL);
+            vdagent_connection_report_error(self, NULL);
         }
-        goto unref;
+        return;
+    }
+    if (priv->opening) {
+        priv->opening = FALSE;
+        priv->open_time = g_get_monotonic_time() - priv->open_start_time;
     }
-    priv->opening = FALSE;
 
-    if (!priv->data_buf) {
-        /* we've read the message header, now let's read its body */
-        data_size = VDAGENT_CONNECTION_GET_CLASS(self)->handle_header(
-            self, priv->header_buf);
+    priv->read_end += bytes_read;
+    if (parse_messages(self)) {
+        read_next_block(self);
+    }
+}
 
-        if (g_cancellable_is_cancelled(priv->cancellable)) {
-            goto unref;
-        }
+static void block_read_cb(GObject      *source_object,
+                          GAsyncResult *res,
+                          gpointer      user_data)
+{
+    VDAgentConnection *self = user_data;
+    GError *err = NULL;
+    gssize bytes_read;
 
-        if (data_size > 0) {
-            priv->data_buf = g_malloc(data_size);
-            g_input_stream_read_all_async(in,
-                priv->data_buf, data_size,
-                G_PRIORITY_DEFAULT, priv->cancellable,
-                message_read_cb, g_object_ref(self));
-            goto unref;
-        }
-    }
+    bytes_read = g_input_stream_read_finish(G_INPUT_STREAM(source_object),
+                                            res, &err);
+    handle_block_read(self, bytes_read, err);
+    g_object_unref(self);
+}
 
-    VDAGENT_CONNECTION_GET_CLASS(self)->handle_message(
-        self, priv->header_buf, priv->data_buf);
+#ifdef HAVE_LIBURING
+static void uring_read_cb(gssize res, gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GError *err = NULL;
 
-    g_clear_pointer(&priv->data_buf, g_free);
-    read_next_message(self);
+    if (g_cancellable_is_cancelled(priv->cancellable)) {
+        return;
+    }
+    if (res < 0) {
+        err = g_error_new_literal(G_IO_ERROR, g_io_error_from_errno(-res),
+                                  g_strerror(-res));
+    }
 
-unref:
+    /* the message handlers may destroy the connection */
+    g_object_ref(self);
+    if (priv->body_bytes_pending == 0) {
+        handle_block_read(self, res, err);
+    } else {
+        handle_body_read(self, res, err);
+    }
     g_object_unref(self);
 }
+#endif
+
+static gboolean resume_reading_cb(gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+
+    if (parse_messages(self)) {
+        read_next_block(self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void update_read_paused(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GSource *source;
+
+    if (priv->read_paused || priv->read_throttled || !priv->read_stalled) {
+        return;
+    }
+
+    /* this may be called from a message handler of either connection,
+     * so the buffered messages are handled from the main loop */
+    priv->read_stalled = FALSE;
+    source = g_idle_source_new();
+    g_source_set_callback(source, resume_reading_cb,
+                          g_object_ref(self), g_object_unref);
+    g_source_attach(source, priv->context);
+    g_source_unref(source);
+}
+
+static gboolean pause_reading_cb(gpointer user_data)
+{
+    vdagent_connection_set_read_paused(user_data, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean resume_paused_reading_cb(gpointer user_data)
+{
+    vdagent_connection_set_read_paused(user_data, FALSE);
+    return G_SOURCE_REMOVE;
+}
+
+void vdagent_connection_set_read_paused(VDAgentConnection *self,
+                                        gboolean           paused)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (needs_marshalling(priv)) {
+        vdagent_connection_invoke(self,
+            paused ? pause_reading_cb : resume_paused_reading_cb,
+            g_object_ref(self), g_object_unref);
+        return;
+    }
+
+    priv->read_paused = paused;
+    update_read_paused(self);
+}
+
+typedef struct {
+    VDAgentConnection *self;
+    VDAgentConnReadTap tap;
+    gpointer           user_data;
+    GDestroyNotify     notify;
+} ReadTapData;
+
+static gboolean set_read_tap_cb(gpointer user_data)
+{
+    ReadTapData *data = user_data;
+
+    vdagent_connection_set_read_tap(data->self, data->tap,
+                                    data->user_data, data->notify);
+    g_object_unref(data->self);
+    g_free(data);
+    return G_SOURCE_REMOVE;
+}
+
+void vdagent_connection_set_read_tap(VDAgentConnection *self,
+                                     VDAgentConnReadTap tap,
+                                     gpointer           user_data,
+                                     GDestroyNotify     notify)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    ReadTapData *data;
+
+    if (needs_marshalling(priv)) {
+        data = g_new(ReadTapData, 1);
+        data->self = g_object_ref(self);
+        data->tap = tap;
+        data->user_data = user_data;
+        data->notify = notify;
+        g_main_context_invoke(priv->context, set_read_tap_cb, data);
+        return;
+    }
+
+    if (priv->read_tap_notify) {
+        priv->read_tap_notify(priv->read_tap_data);
+    }
+    priv->read_tap = tap;
+    priv->read_tap_data = user_data;
+    priv->read_tap_notify = notify;
+}
 
-static void read_next_message(VDAgentConnection *self)
+void vdagent_connection_set_read_throttled(VDAgentConnection *self,
+                                           gboolean           throttled)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(!needs_marshalling(priv));
+
+    priv->read_throttled = throttled;
+    update_read_paused(self);
+}
+
+/* Reads as much data as is available and fits into the receive buffer */
+static void read_next_block(VDAgentConnection *self)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
     GInputStream *in;
@@ -310,10 +1586,19 @@ static void read_next_message(VDAgentConnection *self)
         return;
     }
 
+#ifdef HAVE_LIBURING
+    if (priv->uring) {
+        vdagent_uring_read(priv->uring, priv->read_buf + priv->read_end,
+                           priv->read_buf_size - priv->read_end);
+        return;
+    }
+#endif
+
     in = g_io_stream_get_input_stream(priv->io_stream);
 
-    g_input_stream_read_all_async(in,
-        priv->header_buf, priv->header_size,
+    g_input_stream_read_async(in,
+        priv->read_buf + priv->read_end,
+        priv->read_buf_size - priv->read_end,
         G_PRIORITY_DEFAULT, priv->cancellable,
-        message_read_cb, g_object_ref(self));
+        block_read_cb, g_object_ref(self));
 }
@@ -44,12 +44,39 @@ struct _VDAgentConnectionClass {
 
     /* Called when a full message has been read.
     *
-    * @header, @data must not be freed. */
+    * @header, @data must not be freed and are only valid
+    * until the handler returns.
+    *
+    * @data is NULL if the body was scattered into the buffers
+    * returned by get_body_vectors(). */
     void (*handle_message) (VDAgentConnection *self,
                             gpointer           header_buf,
                             gpointer           data_buf);
+
+    /* Optional, called after handle_header() returned a non-zero size.
+    *
+    * Handler may fill @vectors with up to VDAGENT_CONNECTION_MAX_BODY_VECTORS
+    * buffers of its own, whose sizes add up to @size, and return their
+    * number. The body is then stored in these buffers instead of being
+    * copied or read into one owned by the connection.
+    * The buffers must stay valid until handle_message() is called.
+    *
+    * Returning 0 keeps the default behaviour. */
+    guint (*get_body_vectors) (VDAgentConnection *self,
+                               gpointer           header_buf,
+                               gsize              size,
+                               GInputVector      *vectors);
+
+    /* Optional, invoked from the I/O context after every write.
+    *
+    * Subclasses holding back data of their own, see
+    * vdagent_connection_set_write_backlog(), queue more of it from here
+    * while vdagent_connection_get_queued_bytes() is low enough. */
+    void (*fill_write_queue) (VDAgentConnection *self);
 };
 
+#define VDAGENT_CONNECTION_MAX_BODY_VECTORS 4
+
 /* Invoked when an error occurs during read or write.
  *
  * If @err is NULL, the connection was closed by the remote side,
@@ -58,6 +85,11 @@ struct _VDAgentConnectionClass {
  * VDAgentConnection will not continue with the given I/O-op that failed. */
 typedef void (*VDAgentConnErrorCb)(VDAgentConnection *self, GError *err);
 
+/* Invoked once the write queue has drained down to the low watermark
+ * after it grew past the high watermark,
+ * see vdagent_connection_set_write_watermarks(). */
+typedef void (*VDAgentConnWritableCb)(VDAgentConnection *self, gpointer user_data);
+
 /* Open a file in @path for read and write.
  * Returns a new GIOStream to the given file or NULL when @err is set. */
 GIOStream *vdagent_file_open(const gchar *path, GError **err);
@@ -69,7 +101,8 @@ GIOStream *vdagent_socket_connect(const gchar *path, GError **err);
 /* Set up @self to use @io_stream and start reading from it.
  *
  * If @wait_on_opening is set to TRUE, EOF won't be treated as an error
- * until the first message is successfully read or written to the @io_stream. */
+ * until the first message is successfully read from the @io_stream,
+ * reading is retried with a backoff instead. */
 void vdagent_connection_setup(VDAgentConnection *self,
                               GIOStream         *io_stream,
                               gboolean           wait_on_opening,
@@ -77,11 +110,66 @@ void vdagent_connection_setup(VDAgentConnection *self,
                               VDAgentConnErrorCb error_cb);
 
 
+/* Run the I/O of @self in a dedicated thread with its own GMainContext.
+ *
+ * Must be called before vdagent_connection_setup(). handle_header and
+ * handle_message are then invoked from the I/O thread, while the error
+ * and writable callbacks are still invoked from the main context that
+ * was the thread-default one during setup.
+ * vdagent_connection_write(), vdagent_connection_flush() and
+ * vdagent_connection_set_read_paused() may be called from that context,
+ * the work is passed on to the I/O thread. */
+void vdagent_connection_use_io_thread(VDAgentConnection *self);
+
+/* Returns TRUE if the I/O of @self is submitted to io_uring, which
+ * requires building with --enable-io-uring and kernel support. */
+gboolean vdagent_connection_uses_io_uring(VDAgentConnection *self);
+
+/* Run @func in the context the I/O of @self happens in.
+ * It is called right away if that is the calling thread's context. */
+void vdagent_connection_invoke(VDAgentConnection *self,
+                               GSourceFunc        func,
+                               gpointer           data,
+                               GDestroyNotify     notify);
+
+/* For subclasses: report @err, or EOF if NULL, through the error
+ * callback of @self. Takes ownership of @err. */
+void vdagent_connection_report_error(VDAgentConnection *self,
+                                     GError            *err);
+
+/* Returns TRUE once vdagent_connection_destroy() was called on @self. */
+gboolean vdagent_connection_is_closed(VDAgentConnection *self);
+
+/* Set the backoff used to retry reading while waiting for the remote side
+ * to open the connection, see vdagent_connection_setup().
+ *
+ * The first retry happens after @initial_delay milliseconds, the delay
+ * is then doubled on every retry up to @max_delay.
+ * The defaults are 10 and 160 ms. */
+void vdagent_connection_set_open_backoff(VDAgentConnection *self,
+                                         guint              initial_delay,
+                                         guint              max_delay);
+
+/* Returns the time in microseconds it took the remote side to open
+ * the connection, or -1 if no data has been read yet.
+ * Connections set up without wait_on_opening return 0. */
+gint64 vdagent_connection_get_open_time(VDAgentConnection *self);
+
+/* Set the size of the buffer incoming data is read into.
+ *
+ * Every read takes as much data as is available and fits into the buffer,
+ * all the complete messages in it are then handled at once.
+ * Message bodies larger than the buffer are read separately.
+ *
+ * Must be called before vdagent_connection_setup(), defaults to 64 KiB. */
+void vdagent_connection_set_read_buffer_size(VDAgentConnection *self,
+                                             gsize              size);
+
 /* Cancel running I/O-operations, close the underlying FD and
  * unref the VDAgentConnection object. */
 void vdagent_connection_destroy(gpointer p);
 
-/* Append a message to the write queue.
+/* Append a message to the bulk lane of the write queue.
  *
  * VDAgentConnection takes ownership of @data
  * and frees it once the message is flushed. */
@@ -89,9 +177,171 @@ void vdagent_connection_write(VDAgentConnection *self,
                               gpointer           data,
                               gsize              size);
 
-/* Synchronously write all queued messages to the output stream. */
+typedef enum {
+    VDAGENT_WRITE_PRIORITY_INTERACTIVE,
+    VDAGENT_WRITE_PRIORITY_BULK,
+    VDAGENT_WRITE_N_PRIORITIES
+} VDAgentWritePriority;
+
+/* Like vdagent_connection_write(), but append the message to the lane
+ * of the given @priority.
+ *
+ * Messages in the same lane are written in order. Whenever a message
+ * has been written completely, the next one is taken from the highest
+ * priority lane that isn't empty, so small control messages don't wait
+ * for bulk transfers queued before them. */
+void vdagent_connection_write_with_priority(VDAgentConnection   *self,
+                                            gpointer             data,
+                                            gsize                size,
+                                            VDAgentWritePriority priority);
+
+/* Like vdagent_connection_write_with_priority(), but takes ownership
+ * of a reference to @bytes, so parts of a larger buffer can be queued
+ * without copying them. */
+void vdagent_connection_write_bytes(VDAgentConnection   *self,
+                                    GBytes              *bytes,
+                                    VDAgentWritePriority priority);
+
+/* Queue @bytes as a fragment of a message that is still being produced,
+ * the remaining fragments follow with the same @priority in later calls,
+ * the last one with @last set.
+ *
+ * Once the first fragment of a message has been written, nothing else
+ * is written until its last fragment has been, so the message stays
+ * contiguous on the wire while only part of it is held in memory. */
+void vdagent_connection_write_fragment(VDAgentConnection   *self,
+                                       GBytes              *bytes,
+                                       VDAgentWritePriority priority,
+                                       gboolean             last);
+
+/* Limit how much of the write queue is gathered into a single write.
+ *
+ * Every write passes at most @max_vectors queued messages (capped at 64)
+ * to the output stream and stops gathering once @max_bytes are reached.
+ * The defaults are 64 messages and 256 KiB. */
+void vdagent_connection_set_write_budget(VDAgentConnection *self,
+                                         guint              max_vectors,
+                                         gsize              max_bytes);
+
+/* Set the write queue watermarks in bytes.
+ *
+ * Writes are never refused, but once more than @high bytes are queued,
+ * vdagent_connection_is_writable() returns FALSE until the queue drains
+ * to @low bytes. Producers of bulk data should stop queueing messages
+ * meanwhile and resume from the writable callback, which is also invoked
+ * if new watermarks unblock @self.
+ * The defaults are 1 MiB and 256 KiB. */
+void vdagent_connection_set_write_watermarks(VDAgentConnection *self,
+                                             gsize              high,
+                                             gsize              low);
+
+/* Set the callback invoked when @self becomes writable again. */
+void vdagent_connection_set_writable_cb(VDAgentConnection    *self,
+                                        VDAgentConnWritableCb writable_cb,
+                                        gpointer              user_data);
+
+gboolean vdagent_connection_is_writable(VDAgentConnection *self);
+
+/* Returns the number of bytes in the write queue not written yet.
+ * With an I/O thread, this is only a snapshot. */
+gsize vdagent_connection_get_queued_bytes(VDAgentConnection *self);
+
+/* For subclasses: set the number of bytes held back by the subclass
+ * to be queued later from fill_write_queue(). They count towards the
+ * write watermarks like queued ones. Must be called from the I/O context. */
+void vdagent_connection_set_write_backlog(VDAgentConnection *self,
+                                          gsize              bytes);
+
+/* Stop or resume handling incoming messages.
+ *
+ * While paused, no more data is read from the stream, so the remote side
+ * is eventually blocked as well. This is meant for flow control,
+ * e.g. while the connection the messages are forwarded to isn't writable.
+ * Messages already read are handled from the main loop once resumed. */
+void vdagent_connection_set_read_paused(VDAgentConnection *self,
+                                        gboolean           paused);
+
+/* For subclasses: like vdagent_connection_set_read_paused(), but
+ * independent of it, so a subclass can stop reading while its own
+ * buffers are full. Must be called from the I/O context. */
+void vdagent_connection_set_read_throttled(VDAgentConnection *self,
+                                           gboolean           throttled);
+
+/* Invoked from the I/O context with every message read, before it is
+ * handled. @vectors holds the header as it was received followed by
+ * the body, they're only valid until the tap returns. */
+typedef void (*VDAgentConnReadTap)(VDAgentConnection   *self,
+                                   const GOutputVector *vectors,
+                                   guint                n_vectors,
+                                   gpointer             user_data);
+
+/* Set a tap that sees all incoming messages, e.g. to record the traffic.
+ * With an I/O thread, the tap is installed once the thread gets to it.
+ * @notify is invoked on @user_data when the tap is replaced
+ * or @self is finalized. */
+void vdagent_connection_set_read_tap(VDAgentConnection *self,
+                                     VDAgentConnReadTap tap,
+                                     gpointer           user_data,
+                                     GDestroyNotify     notify);
+
+/* Synchronously write all queued messages to the output stream.
+ * Stops early at a fragmented message whose next fragment hasn't been
+ * queued yet, see vdagent_connection_write_fragment(). */
 void vdagent_connection_flush(VDAgentConnection *self);
 
+/* Get a buffer of at least @size bytes from the connection's pool.
+ *
+ * Buffers are recycled in power-of-two size classes, so steady-state
+ * traffic doesn't need to allocate. The result is 8-byte aligned and
+ * must be released with vdagent_connection_buffer_free(). */
+gpointer vdagent_connection_buffer_alloc(VDAgentConnection *self,
+                                        gsize              size);
+
+/* Return @data to the pool it was allocated from,
+ * or free it if the pool already retains enough memory. */
+void vdagent_connection_buffer_free(VDAgentConnection *self,
+                                    gpointer           data);
+
+/* Limit the memory kept in the buffer pool, defaults to 4 MiB. */
+void vdagent_connection_set_buffer_pool_limit(VDAgentConnection *self,
+                                              gsize              max_retained);
+
+typedef struct VDAgentBufferPoolStats {
+    guint64 hits;      /* buffers reused from the pool */
+    guint64 misses;    /* buffers allocated because their class was empty */
+    guint64 oversized; /* buffers too large to be pooled */
+    gsize   retained;  /* bytes currently kept in the pool */
+} VDAgentBufferPoolStats;
+
+/* Get a snapshot of the buffer pool statistics of @self,
+ * may be called from any thread. */
+void vdagent_connection_get_buffer_pool_stats(VDAgentConnection      *self,
+                                              VDAgentBufferPoolStats *stats);
+
+/* Number of buckets of VDAgentConnectionStats.write_latency */
+#define VDAGENT_CONNECTION_LATENCY_BUCKETS 24
+
+typedef struct VDAgentConnectionStats {
+    guint64 messages_in;
+    guint64 bytes_in;          /* including the headers */
+    guint64 messages_out;
+    guint64 bytes_out;
+    guint   queue_depth;       /* messages currently queued for writing */
+    guint   peak_queue_depth;
+    gsize   queued_bytes;
+    gsize   peak_queued_bytes;
+    guint64 write_stalls;      /* writes that would have blocked */
+    /* Time from queueing a message until it has been written completely.
+     * Bucket 0 counts latencies below 1 us, bucket i those in
+     * [2^(i-1), 2^i) us, the last one also counts all longer ones. */
+    guint64 write_latency[VDAGENT_CONNECTION_LATENCY_BUCKETS];
+} VDAgentConnectionStats;
+
+/* Get a snapshot of the transport statistics of @self,
+ * may be called from any thread. */
+void vdagent_connection_get_stats(VDAgentConnection      *self,
+                                  VDAgentConnectionStats *stats);
+
 typedef struct PidUid {
     pid_t pid;
     uid_t uid;
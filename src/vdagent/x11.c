@@ -796,6 +796,35 @@ static void vdagent_x11_get_selection_free(struct vdagent_x11 *x11,
         XFree(data);
 }
 
+static void x11_free_data(gpointer data)
+{
+    XFree(data);
+}
+
+/* Like vdagent_x11_get_selection_free(), but hands the data over to the
+ * returned GBytes where possible instead of freeing it */
+static GBytes *vdagent_x11_get_selection_bytes(struct vdagent_x11 *x11,
+    unsigned char *data, int len, int incr)
+{
+    GBytes *bytes;
+
+    if (data == NULL || len <= 0) {
+        vdagent_x11_get_selection_free(x11, data, incr);
+        return NULL;
+    }
+    if (!incr) {
+        return g_bytes_new_with_free_func(data, len, x11_free_data, data);
+    }
+    /* the incr buffer is kept for the next transfer unless it's large */
+    if (x11->clipboard_data_space > 512 * 1024) {
+        bytes = g_bytes_new_with_free_func(data, len, free, data);
+        x11->clipboard_data = NULL;
+        x11->clipboard_data_space = 0;
+        return bytes;
+    }
+    return g_bytes_new(data, len);
+}
+
 static uint32_t vdagent_x11_target_to_type(struct vdagent_x11 *x11,
     uint8_t selection, Atom target)
 {
@@ -858,6 +887,7 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
     int len = 0;
     unsigned char *data = NULL;
     uint32_t type;
+    GBytes *bytes;
     uint8_t selection = -1;
     Atom clip = None;
 
@@ -908,9 +938,11 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
         len = 0;
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
-                data, len);
-    vdagent_x11_get_selection_free(x11, data, incr);
+    bytes = vdagent_x11_get_selection_bytes(x11, data, len, incr);
+    udscs_write_bytes(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
+                      bytes);
+    if (bytes)
+        g_bytes_unref(bytes);
 
     vdagent_x11_next_conversion_request(x11);
     vdagent_x11_handle_conversion_request(x11);
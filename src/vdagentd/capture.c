@@ -0,0 +1,243 @@
+/*  capture.c vdagentd traffic capture
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "capture.h"
+
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+
+/* Frames larger than this can't be valid */
+#define CAPTURE_MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+struct vdagentd_capture {
+    gint ref_count;
+    /* taps run in the I/O context of their connection,
+     * which may be a thread of its own */
+    GMutex lock;
+    FILE *file;
+    char *path;
+    gint64 start_time;
+};
+
+struct capture_tap {
+    struct vdagentd_capture *capture;
+    uint32_t source;
+    uint32_t stream;
+};
+
+static void capture_unref(struct vdagentd_capture *capture)
+{
+    if (!g_atomic_int_dec_and_test(&capture->ref_count)) {
+        return;
+    }
+    g_mutex_clear(&capture->lock);
+    g_free(capture->path);
+    g_free(capture);
+}
+
+struct vdagentd_capture *vdagentd_capture_open(const char *path, GError **err)
+{
+    struct vdagentd_capture *capture;
+    struct vdagentd_capture_header header = { VDAGENTD_CAPTURE_MAGIC };
+    FILE *file;
+    int fd, errsv;
+
+    /* the capture holds clipboard and file-xfer contents,
+     * only root may read it */
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || (file = fdopen(fd, "wb")) == NULL) {
+        errsv = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv),
+                    "%s: %s", path, g_strerror(errsv));
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    header.version = GUINT32_TO_LE(VDAGENTD_CAPTURE_VERSION);
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        errsv = errno;
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv),
+                    "%s: %s", path, g_strerror(errsv));
+        fclose(file);
+        return NULL;
+    }
+
+    capture = g_new0(struct vdagentd_capture, 1);
+    capture->ref_count = 1;
+    g_mutex_init(&capture->lock);
+    capture->file = file;
+    capture->path = g_strdup(path);
+    capture->start_time = g_get_monotonic_time();
+    return capture;
+}
+
+void vdagentd_capture_close(struct vdagentd_capture *capture)
+{
+    g_mutex_lock(&capture->lock);
+    if (capture->file && fclose(capture->file) != 0) {
+        syslog(LOG_ERR, "Error writing to %s: %m", capture->path);
+    }
+    capture->file = NULL;
+    g_mutex_unlock(&capture->lock);
+
+    capture_unref(capture);
+}
+
+static void capture_tap_free(gpointer user_data)
+{
+    struct capture_tap *tap = user_data;
+
+    capture_unref(tap->capture);
+    g_free(tap);
+}
+
+static void capture_read_tap(VDAgentConnection   *conn,
+                             const GOutputVector *vectors,
+                             guint                n_vectors,
+                             gpointer             user_data)
+{
+    struct capture_tap *tap = user_data;
+    struct vdagentd_capture *capture = tap->capture;
+    struct vdagentd_capture_record record = { 0 };
+    gsize size = 0;
+    gboolean ok;
+    guint i;
+
+    for (i = 0; i < n_vectors; i++) {
+        size += vectors[i].size;
+    }
+
+    g_mutex_lock(&capture->lock);
+    if (capture->file == NULL) {
+        g_mutex_unlock(&capture->lock);
+        return;
+    }
+
+    record.timestamp = GUINT64_TO_LE(g_get_monotonic_time() - capture->start_time);
+    record.source = GUINT32_TO_LE(tap->source);
+    record.stream = GUINT32_TO_LE(tap->stream);
+    record.size = GUINT32_TO_LE(size);
+
+    ok = fwrite(&record, sizeof(record), 1, capture->file) == 1;
+    for (i = 0; ok && i < n_vectors; i++) {
+        ok = fwrite(vectors[i].buffer, 1, vectors[i].size, capture->file) == vectors[i].size;
+    }
+    if (!ok) {
+        /* a truncated trace is still useful up to here */
+        syslog(LOG_ERR, "Error writing to %s: %m, capture stopped", capture->path);
+        fclose(capture->file);
+        capture->file = NULL;
+    }
+    g_mutex_unlock(&capture->lock);
+}
+
+void vdagentd_capture_connection(struct vdagentd_capture *capture,
+                                 VDAgentConnection *conn,
+                                 uint32_t source,
+                                 uint32_t stream)
+{
+    struct capture_tap *tap = g_new(struct capture_tap, 1);
+
+    g_atomic_int_inc(&capture->ref_count);
+    tap->capture = capture;
+    tap->source = source;
+    tap->stream = stream;
+    vdagent_connection_set_read_tap(conn, capture_read_tap, tap, capture_tap_free);
+}
+
+static gboolean read_exactly(FILE *file, gpointer buf, gsize size,
+                             gboolean *eof, GError **err)
+{
+    gsize n = fread(buf, 1, size, file);
+
+    if (n == size) {
+        return TRUE;
+    }
+    if (ferror(file)) {
+        int errsv = errno;
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errsv),
+                    "%s", g_strerror(errsv));
+    } else if (n == 0 && eof) {
+        *eof = TRUE;
+    } else {
+        g_set_error_literal(err, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                            "truncated trace");
+    }
+    return FALSE;
+}
+
+gboolean vdagentd_capture_read_header(FILE *file, GError **err)
+{
+    struct vdagentd_capture_header header;
+
+    if (!read_exactly(file, &header, sizeof(header), NULL, err)) {
+        return FALSE;
+    }
+    if (memcmp(header.magic, VDAGENTD_CAPTURE_MAGIC, sizeof(header.magic)) != 0) {
+        g_set_error_literal(err, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                            "not a vdagentd trace");
+        return FALSE;
+    }
+    if (GUINT32_FROM_LE(header.version) != VDAGENTD_CAPTURE_VERSION) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                    "unsupported trace version %u", GUINT32_FROM_LE(header.version));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+uint8_t *vdagentd_capture_read_record(FILE *file,
+                                      struct vdagentd_capture_record *record,
+                                      GError **err)
+{
+    gboolean eof = FALSE;
+    uint8_t *data;
+
+    if (!read_exactly(file, record, sizeof(*record), &eof, err)) {
+        return NULL;
+    }
+    record->timestamp = GUINT64_FROM_LE(record->timestamp);
+    record->source = GUINT32_FROM_LE(record->source);
+    record->stream = GUINT32_FROM_LE(record->stream);
+    record->size = GUINT32_FROM_LE(record->size);
+
+    /* every frame has a header, so records are never empty */
+    if (record->size == 0 || record->size > CAPTURE_MAX_FRAME_SIZE) {
+        g_set_error(err, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                    "invalid record size %u", record->size);
+        return NULL;
+    }
+
+    data = g_malloc(record->size);
+    if (!read_exactly(file, data, record->size, NULL, err)) {
+        g_free(data);
+        return NULL;
+    }
+    return data;
+}
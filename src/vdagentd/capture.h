@@ -0,0 +1,79 @@
+/*  capture.h vdagentd traffic capture header
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_CAPTURE_H
+#define __VDAGENTD_CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <glib.h>
+
+#include "vdagent-connection.h"
+
+/* Trace files start with a struct vdagentd_capture_header, followed by
+ * one struct vdagentd_capture_record and its data for every frame read,
+ * all integers are little endian. */
+#define VDAGENTD_CAPTURE_MAGIC "VDTRACE\0"
+#define VDAGENTD_CAPTURE_VERSION 1
+
+struct vdagentd_capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+enum {
+    /* a VDIChunkHeader and the chunk read from the virtio port */
+    VDAGENTD_CAPTURE_VIRTIO = 1,
+    /* a struct udscs_message_header and the data read from an agent */
+    VDAGENTD_CAPTURE_UDSCS,
+};
+
+struct vdagentd_capture_record {
+    /* monotonic time in microseconds since the capture was started */
+    uint64_t timestamp;
+    uint32_t source;
+    /* tells apart the connections of the same source */
+    uint32_t stream;
+    /* of the frame following the record */
+    uint32_t size;
+    uint32_t reserved;
+};
+
+struct vdagentd_capture;
+
+struct vdagentd_capture *vdagentd_capture_open(const char *path, GError **err);
+
+/* Flushes and closes the trace file, frames read afterwards are dropped. */
+void vdagentd_capture_close(struct vdagentd_capture *capture);
+
+/* Record every frame @conn reads from now on. */
+void vdagentd_capture_connection(struct vdagentd_capture *capture,
+                                 VDAgentConnection *conn,
+                                 uint32_t source,
+                                 uint32_t stream);
+
+/* Checks the file header of a trace opened for reading. */
+gboolean vdagentd_capture_read_header(FILE *file, GError **err);
+
+/* Returns the data of the next record of @file, to be freed with g_free(),
+ * or NULL at the end of the file or if @err is set. */
+uint8_t *vdagentd_capture_read_record(FILE *file,
+                                      struct vdagentd_capture_record *record,
+                                      GError **err);
+
+#endif
@@ -0,0 +1,98 @@
+/*  latency.c vdagentd latency histograms
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <syslog.h>
+
+#include "latency.h"
+
+#define SUB_BUCKETS (1 << VDAGENTD_LATENCY_SUB_BITS)
+
+static guint bucket_index(guint64 usec)
+{
+    guint exp;
+
+    if (usec < SUB_BUCKETS) {
+        return usec;
+    }
+    usec = MIN(usec, (G_GUINT64_CONSTANT(1) << VDAGENTD_LATENCY_MAX_BITS) - 1);
+    /* position of the highest bit set, at least SUB_BITS */
+    exp = g_bit_storage(usec) - 1;
+    return ((exp - VDAGENTD_LATENCY_SUB_BITS + 1) << VDAGENTD_LATENCY_SUB_BITS) +
+           ((usec >> (exp - VDAGENTD_LATENCY_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* The largest value counted in bucket @index */
+static guint64 bucket_end(guint index)
+{
+    guint exp, sub;
+
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    exp = (index >> VDAGENTD_LATENCY_SUB_BITS) - 1 + VDAGENTD_LATENCY_SUB_BITS;
+    sub = index & (SUB_BUCKETS - 1);
+    return (((guint64)(SUB_BUCKETS + sub + 1)) << (exp - VDAGENTD_LATENCY_SUB_BITS)) - 1;
+}
+
+void vdagentd_latency_record(struct vdagentd_latency *latency, gint64 usec)
+{
+    usec = MAX(usec, 0);
+    latency->count++;
+    latency->sum += usec;
+    latency->max = MAX(latency->max, usec);
+    latency->buckets[bucket_index(usec)]++;
+}
+
+gint64 vdagentd_latency_percentile(const struct vdagentd_latency *latency,
+                                   gdouble percentile)
+{
+    guint64 rank, seen = 0;
+    guint i;
+
+    if (latency->count == 0) {
+        return 0;
+    }
+    rank = MAX(1, (guint64)(latency->count * percentile / 100.0 + 0.5));
+    for (i = 0; i < VDAGENTD_LATENCY_BUCKETS; i++) {
+        seen += latency->buckets[i];
+        if (seen >= rank) {
+            return MIN(bucket_end(i), (guint64)latency->max);
+        }
+    }
+    return latency->max;
+}
+
+void vdagentd_latency_log(const struct vdagentd_latency *latency,
+                          int priority, const char *name)
+{
+    if (latency->count == 0) {
+        syslog(priority, "%s: no samples", name);
+        return;
+    }
+    syslog(priority, "%s: %" G_GUINT64_FORMAT " samples, mean %" G_GUINT64_FORMAT
+           " us, p50 %" G_GINT64_FORMAT " us, p90 %" G_GINT64_FORMAT
+           " us, p99 %" G_GINT64_FORMAT " us, p99.9 %" G_GINT64_FORMAT
+           " us, max %" G_GINT64_FORMAT " us",
+           name, latency->count, latency->sum / latency->count,
+           vdagentd_latency_percentile(latency, 50),
+           vdagentd_latency_percentile(latency, 90),
+           vdagentd_latency_percentile(latency, 99),
+           vdagentd_latency_percentile(latency, 99.9),
+           latency->max);
+}
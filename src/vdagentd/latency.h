@@ -0,0 +1,54 @@
+/*  latency.h vdagentd latency histograms header
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_LATENCY_H
+#define __VDAGENTD_LATENCY_H
+
+#include <glib.h>
+
+/* Latencies below 2^VDAGENTD_LATENCY_SUB_BITS us are counted exactly,
+ * every larger power of two is split into 2^VDAGENTD_LATENCY_SUB_BITS
+ * buckets, so a recorded value is known to within about 6%.
+ * Values of 2^VDAGENTD_LATENCY_MAX_BITS us (about 71 minutes) and more
+ * go to the last bucket. */
+#define VDAGENTD_LATENCY_SUB_BITS 4
+#define VDAGENTD_LATENCY_MAX_BITS 32
+#define VDAGENTD_LATENCY_BUCKETS \
+    ((VDAGENTD_LATENCY_MAX_BITS - VDAGENTD_LATENCY_SUB_BITS + 1) << \
+     VDAGENTD_LATENCY_SUB_BITS)
+
+struct vdagentd_latency {
+    guint64 count;
+    guint64 sum;
+    gint64 max;
+    guint64 buckets[VDAGENTD_LATENCY_BUCKETS];
+};
+
+/* Record a latency of @usec microseconds, negative ones count as 0. */
+void vdagentd_latency_record(struct vdagentd_latency *latency, gint64 usec);
+
+/* Returns the latency in microseconds that @percentile percent of the
+ * recorded ones don't exceed, rounded up to the end of its bucket,
+ * or 0 if nothing has been recorded. */
+gint64 vdagentd_latency_percentile(const struct vdagentd_latency *latency,
+                                   gdouble percentile);
+
+/* Log a summary of @latency prefixed with @name. */
+void vdagentd_latency_log(const struct vdagentd_latency *latency,
+                          int priority, const char *name);
+
+#endif
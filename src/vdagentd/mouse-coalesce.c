@@ -0,0 +1,34 @@
+/*  mouse-coalesce.c vdagentd mouse state coalescing
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include "mouse-coalesce.h"
+
+gboolean vdagentd_mouse_can_coalesce(const VDAgentMouseState *pending,
+                                     const VDAgentMouseState *next,
+                                     uint32_t last_buttons,
+                                     gint64 age, gint64 max_staleness)
+{
+    /* the pending state presses or releases something */
+    if (pending->buttons != last_buttons) {
+        return FALSE;
+    }
+    return next->buttons == pending->buttons &&
+           next->display_id == pending->display_id &&
+           age < max_staleness;
+}
@@ -0,0 +1,34 @@
+/*  mouse-coalesce.h vdagentd mouse state coalescing header
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_MOUSE_COALESCE_H
+#define __VDAGENTD_MOUSE_COALESCE_H
+
+#include <stdint.h>
+#include <glib.h>
+#include <spice/vd_agent.h>
+
+/* Returns TRUE if @next may replace @pending, a state not injected yet
+ * that was queued @age us ago, @last_buttons being the buttons of the
+ * last state injected. Only pointer motion on the same display younger
+ * than @max_staleness us is merged, button and wheel changes never are. */
+gboolean vdagentd_mouse_can_coalesce(const VDAgentMouseState *pending,
+                                     const VDAgentMouseState *next,
+                                     uint32_t last_buttons,
+                                     gint64 age, gint64 max_staleness);
+
+#endif
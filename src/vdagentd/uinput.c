@@ -22,6 +22,7 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,14 +33,27 @@
 #include <glib.h>
 #include "uinput.h"
 
+/* The tablet reports positions normalized to 0 - UINPUT_ABS_MAX, so its
+ * axis ranges don't depend on the resolution and the device is created
+ * once, instead of being recreated (and hotplugged again) on every
+ * resolution change. The fake device gets the positions in pixels. */
+#define UINPUT_ABS_MAX 32767
+
 struct vdagentd_uinput {
     const char *devname;
     int fd;
     int debug;
     int width;
     int height;
-    struct vdagentd_guest_xorg_resolution *screen_info;
-    int screen_count;
+    /* position of each display, indexed by VDAgentMouseState.display_id */
+    struct {
+        int x;
+        int y;
+        int valid;
+    } displays[256];
+    /* 32.32 fixed point factors scaling pixels to 0 - UINPUT_ABS_MAX */
+    guint64 scale_x;
+    guint64 scale_y;
     VDAgentMouseState last;
     int fake;
 };
@@ -75,22 +89,69 @@ void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp)
     g_clear_pointer(uinputp, g_free);
 }
 
+/* Rounded up, so scale() gives the same result as dividing */
+static guint64 scale_factor(int size)
+{
+    guint64 range = MAX(size - 1, 1);
+
+    return (((guint64)UINPUT_ABS_MAX << 32) + range - 1) / range;
+}
+
+static uint32_t scale(uint32_t pos, guint64 factor)
+{
+    return (pos * factor) >> 32;
+}
+
+static int uinput_setup_device(struct vdagentd_uinput *uinput)
+{
+    struct uinput_user_dev device = {
+        .name = "spice vdagent tablet",
+        .absmax  [ ABS_X ] = UINPUT_ABS_MAX,
+        .absmax  [ ABS_Y ] = UINPUT_ABS_MAX,
+    };
+    int rc;
+
+#ifdef UI_DEV_SETUP
+    struct uinput_setup setup = {
+        .name = "spice vdagent tablet",
+    };
+    struct uinput_abs_setup abs_setup = {
+        .absinfo.maximum = UINPUT_ABS_MAX,
+    };
+
+    if (ioctl(uinput->fd, UI_DEV_SETUP, &setup) == 0) {
+        abs_setup.code = ABS_X;
+        rc = ioctl(uinput->fd, UI_ABS_SETUP, &abs_setup);
+        if (rc == 0) {
+            abs_setup.code = ABS_Y;
+            rc = ioctl(uinput->fd, UI_ABS_SETUP, &abs_setup);
+        }
+        if (rc < 0) {
+            syslog(LOG_ERR, "setup %s: %m", uinput->devname);
+        }
+        return rc;
+    }
+    if (errno != EINVAL && errno != ENOTTY) {
+        syslog(LOG_ERR, "setup %s: %m", uinput->devname);
+        return -1;
+    }
+    /* kernels before 4.5 only know the legacy interface */
+#endif
+
+    rc = write(uinput->fd, &device, sizeof(device));
+    if (rc != sizeof(device)) {
+        syslog(LOG_ERR, "write %s: %m", uinput->devname);
+        return -1;
+    }
+    return 0;
+}
+
 void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         int width, int height,
         struct vdagentd_guest_xorg_resolution *screen_info,
         int screen_count)
 {
     struct vdagentd_uinput *uinput = *uinputp;
-    struct uinput_user_dev device = {
-        .name = "spice vdagent tablet",
-#ifdef WITH_STATIC_UINPUT
-        .absmax  [ ABS_X ] = 32767,
-        .absmax  [ ABS_Y ] = 32767,
-#else
-        .absmax  [ ABS_X ] = width - 1,
-        .absmax  [ ABS_Y ] = height - 1,
-#endif
-    };
     int i, rc;
 
     if (uinput->debug) {
@@ -100,21 +161,27 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         }
     }
 
-    uinput->screen_info  = screen_info;
-    uinput->screen_count = screen_count;
+    /* the first screen of a display wins, as the agent lists them in order */
+    memset(uinput->displays, 0, sizeof(uinput->displays));
+    for (i = screen_count - 1; i >= 0; i--) {
+        int id = screen_info[i].display_id;
 
-    if (uinput->width == width && uinput->height == height)
-        return;
+        if (id < 0 || id >= G_N_ELEMENTS(uinput->displays)) {
+            syslog(LOG_WARNING, "ignoring screen %d with display id %d", i, id);
+            continue;
+        }
+        uinput->displays[id].x = screen_info[i].x;
+        uinput->displays[id].y = screen_info[i].y;
+        uinput->displays[id].valid = 1;
+    }
 
     uinput->width  = width;
     uinput->height = height;
+    uinput->scale_x = scale_factor(width);
+    uinput->scale_y = scale_factor(height);
 
     if (uinput->fd != -1)
-#ifndef WITH_STATIC_UINPUT
-        close(uinput->fd);
-#else
         return;
-#endif
 
     uinput->fd = open(uinput->devname, uinput->fake ? O_WRONLY : O_RDWR);
     if (uinput->fd == -1) {
@@ -128,13 +195,6 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         return;
     }
 
-    rc = write(uinput->fd, &device, sizeof(device));
-    if (rc != sizeof(device)) {
-        syslog(LOG_ERR, "write %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-        return;
-    }
-
     /* buttons */
     ioctl(uinput->fd, UI_SET_EVBIT, EV_KEY);
     ioctl(uinput->fd, UI_SET_KEYBIT, BTN_LEFT);
@@ -152,6 +212,11 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     ioctl(uinput->fd, UI_SET_ABSBIT, ABS_X);
     ioctl(uinput->fd, UI_SET_ABSBIT, ABS_Y);
 
+    if (uinput_setup_device(uinput) < 0) {
+        vdagentd_uinput_destroy(uinputp);
+        return;
+    }
+
     rc = ioctl(uinput->fd, UI_DEV_CREATE);
     if (rc < 0) {
         syslog(LOG_ERR, "create %s: %m", uinput->devname);
@@ -159,34 +224,43 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     }
 }
 
-static void uinput_send_event(struct vdagentd_uinput **uinputp,
+/* The events of one mouse report: abs x and y, the buttons,
+ * the wheel and the syn */
+#define MAX_REPORT_EVENTS 10
+
+struct uinput_report {
+    struct input_event events[MAX_REPORT_EVENTS];
+    int count;
+};
+
+static void uinput_add_event(struct uinput_report *report,
     __u16 type, __u16 code, __s32 value)
 {
-    struct vdagentd_uinput *uinput = *uinputp;
-    struct input_event event = {
-        .type  = type,
-        .code  = code,
-        .value = value,
-    };
-    int rc;
+    struct input_event *event;
 
-    rc = write(uinput->fd, &event, sizeof(event));
-    if (rc != sizeof(event)) {
-        syslog(LOG_ERR, "write %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-    }
+    g_return_if_fail(report->count < MAX_REPORT_EVENTS);
+
+    event = &report->events[report->count++];
+    event->type  = type;
+    event->code  = code;
+    event->value = value;
 }
 
-static struct vdagentd_guest_xorg_resolution* lookup_screen_info(struct vdagentd_uinput *uinput, int display_id)
+/* Submit the whole report with a single write */
+static void uinput_send_report(struct vdagentd_uinput **uinputp,
+    struct uinput_report *report)
 {
-    int i;
-    for (i = 0; i < uinput->screen_count; i++) {
-        if (uinput->screen_info[i].display_id == display_id) {
-            return &uinput->screen_info[i];
-        }
+    struct vdagentd_uinput *uinput = *uinputp;
+    ssize_t size = report->count * sizeof(report->events[0]);
+    ssize_t rc;
+
+    do {
+        rc = write(uinput->fd, report->events, size);
+    } while (rc == -1 && errno == EINTR);
+    if (rc != size) {
+        syslog(LOG_ERR, "write %s: %m", uinput->devname);
+        vdagentd_uinput_destroy(uinputp);
     }
-    syslog(LOG_WARNING, "Unable to find output index for display id %d", display_id);
-    return NULL;
 }
 
 void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
@@ -209,37 +283,41 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         { .name = "up",     .mask =  VD_AGENT_UBUTTON_MASK, .btn = 1  },
         { .name = "down",   .mask =  VD_AGENT_DBUTTON_MASK, .btn = -1 },
     };
+    struct uinput_report report = { .count = 0 };
     int i, down;
 
-    if (*uinputp) {
-        struct vdagentd_guest_xorg_resolution *screen_info = lookup_screen_info(uinput, mouse->display_id);
-        if (screen_info == NULL) {
-            syslog(LOG_WARNING, "mouse event for unknown monitor %d",
-                   mouse->display_id);
-            return;
-        }
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
-                   mouse->x, mouse->y);
-        mouse->x += screen_info->x;
-        mouse->y += screen_info->y;
-#ifdef WITH_STATIC_UINPUT
-        mouse->x = mouse->x * 32767 / (uinput->width - 1);
-        mouse->y = mouse->y * 32767 / (uinput->height - 1);
-#endif
+    if (!*uinputp)
+        return;
+
+    if (!uinput->displays[mouse->display_id].valid) {
+        syslog(LOG_WARNING, "mouse event for unknown monitor %d",
+               mouse->display_id);
+        return;
+    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
+               mouse->x, mouse->y);
+    mouse->x += uinput->displays[mouse->display_id].x;
+    mouse->y += uinput->displays[mouse->display_id].y;
+    if (!uinput->fake) {
+        /* the last pixel maps to UINPUT_ABS_MAX, see scale_factor() */
+        mouse->x = scale(MIN(mouse->x, (uint32_t)MAX(uinput->width - 1, 0)),
+                         uinput->scale_x);
+        mouse->y = scale(MIN(mouse->y, (uint32_t)MAX(uinput->height - 1, 0)),
+                         uinput->scale_y);
     }
 
-    if (*uinputp && uinput->last.x != mouse->x) {
+    if (uinput->last.x != mouse->x) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-x %d", mouse->x);
-        uinput_send_event(uinputp, EV_ABS, ABS_X, mouse->x);
+        uinput_add_event(&report, EV_ABS, ABS_X, mouse->x);
     }
-    if (*uinputp && uinput->last.y != mouse->y) {
+    if (uinput->last.y != mouse->y) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-y %d", mouse->y);
-        uinput_send_event(uinputp, EV_ABS, ABS_Y, mouse->y);
+        uinput_add_event(&report, EV_ABS, ABS_Y, mouse->y);
     }
-    for (i = 0; i < sizeof(btns)/sizeof(btns[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(btns)/sizeof(btns[0]); i++) {
         if ((uinput->last.buttons & btns[i].mask) ==
                 (mouse->buttons & btns[i].mask))
             continue;
@@ -247,25 +325,24 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: btn-%s %s",
                     btns[i].name, down ? "down" : "up");
-        uinput_send_event(uinputp, EV_KEY, btns[i].btn, down);
+        uinput_add_event(&report, EV_KEY, btns[i].btn, down);
     }
-    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]); i++) {
         if ((uinput->last.buttons & wheel[i].mask) ==
                 (mouse->buttons & wheel[i].mask))
             continue;
         if (mouse->buttons & wheel[i].mask) {
             if (uinput->debug)
                 syslog(LOG_DEBUG, "mouse: wheel-%s", wheel[i].name);
-            uinput_send_event(uinputp, EV_REL, REL_WHEEL, wheel[i].btn);
+            uinput_add_event(&report, EV_REL, REL_WHEEL, wheel[i].btn);
         }
     }
 
-    if (*uinputp) {
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse: syn");
-        uinput_send_event(uinputp, EV_SYN, SYN_REPORT, 0);
-    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse: syn");
+    uinput_add_event(&report, EV_SYN, SYN_REPORT, 0);
 
+    uinput_send_report(uinputp, &report);
     if (*uinputp)
         uinput->last = *mouse;
 }
@@ -44,6 +44,9 @@
 #include "xorg-conf.h"
 #include "virtio-port.h"
 #include "session-info.h"
+#include "capture.h"
+#include "latency.h"
+#include "mouse-coalesce.h"
 
 #define DEFAULT_UINPUT_DEVICE "/dev/uinput"
 
@@ -55,12 +58,18 @@
 // descriptors for the transfers but the agents do.
 #define MAX_ACTIVE_TRANSFERS 128
 
+// Clipboard contents and file-xfer data at least this large are relayed
+// to the agents as they arrive instead of being assembled first.
+#define STREAM_MIN_SIZE (16 * 1024)
+
 struct agent_data {
     char *session;
     int width;
     int height;
     struct vdagentd_guest_xorg_resolution *screen_info;
     int screen_count;
+    // the virtio port is paused until this agent is writable again
+    bool blocks_virtio_port;
 };
 
 static const char pidfilename[] = "/run/spice-vdagentd/spice-vdagentd.pid";
@@ -69,23 +78,37 @@ static const char pidfilename[] = "/run/spice-vdagentd/spice-vdagentd.pid";
 static gchar *portdev = NULL;
 static gchar *vdagentd_socket = NULL;
 static gchar *uinput_device = NULL;
+static gchar *capture_file = NULL;
 static int debug = 0;
 static gboolean uinput_fake = FALSE;
 static gboolean only_once = FALSE;
+static gboolean virtio_io_thread = FALSE;
 static gboolean do_daemonize = TRUE;
 static gboolean want_session_info = TRUE;
+#ifndef __APPLE__
+static gint mouse_max_staleness = 10;
+#endif
 
 static struct udscs_server *server = NULL;
 static VirtioPort *virtio_port = NULL;
 static GHashTable *active_xfers = NULL;
 static struct session_info *session_info = NULL;
 static struct vdagentd_uinput *uinput = NULL;
+static struct vdagentd_capture *capture = NULL;
+static uint32_t capture_stream = 0;
 static VDAgentMonitorsConfig *mon_config = NULL;
 static uint32_t *capabilities = NULL;
 static int capabilities_size = 0;
 static const char *active_session = NULL;
 static unsigned int session_count = 0;
 static UdscsConnection *active_session_conn = NULL;
+// message being streamed from the client on each chunk port
+static struct {
+    UdscsConnection *conn; // agent it goes to, NULL if none
+    uint32_t type;
+    uint32_t xfer_id;      // VD_AGENT_FILE_XFER_DATA only
+    uint8_t selection;     // VD_AGENT_CLIPBOARD only
+} streams[VDP_END_PORT];
 static bool agent_owns_clipboard[256] = { false, };
 static int retval = 0;
 static bool client_connected = false;
@@ -204,6 +227,101 @@ void do_client_mouse(struct vdagentd_uinput **uinputp, VDAgentMouseState *mouse)
     }
 }
 
+/* Mouse states only moving the pointer replace the one still pending,
+ * which is injected once the messages already received have been handled,
+ * so a backlog of motion isn't replayed. A pending state changing the
+ * buttons or wheel is never replaced, nor one older than
+ * mouse_max_staleness ms. */
+static VDAgentMouseState mouse_pending;
+static gboolean mouse_is_pending = FALSE;
+static gint64 mouse_pending_time;
+static uint32_t mouse_last_buttons;
+static guint mouse_flush_id;
+static guint64 mouse_coalesced;
+
+/* From the mouse state being read from the virtio port to its events
+ * being written to uinput, split into the time spent waiting for the
+ * main context or in the pending state, and in do_client_mouse().
+ * States merged away aren't counted. */
+static gint64 mouse_pending_arrival;
+static struct vdagentd_latency mouse_latency_total;
+static struct vdagentd_latency mouse_latency_queue;
+static struct vdagentd_latency mouse_latency_processing;
+
+static void inject_client_mouse(VDAgentMouseState *mouse, gint64 arrival)
+{
+    gint64 start = g_get_monotonic_time();
+    gint64 end;
+
+    do_client_mouse(&uinput, mouse);
+
+    end = g_get_monotonic_time();
+    vdagentd_latency_record(&mouse_latency_queue, start - arrival);
+    vdagentd_latency_record(&mouse_latency_processing, end - start);
+    vdagentd_latency_record(&mouse_latency_total, end - arrival);
+}
+
+static void log_mouse_latency(void)
+{
+    vdagentd_latency_log(&mouse_latency_total, LOG_INFO, "mouse latency");
+    vdagentd_latency_log(&mouse_latency_queue, LOG_INFO, "  queued");
+    vdagentd_latency_log(&mouse_latency_processing, LOG_INFO, "  processing");
+    syslog(LOG_INFO, "mouse states coalesced: %" G_GUINT64_FORMAT,
+           mouse_coalesced);
+}
+
+static void mouse_flush(void)
+{
+    if (mouse_flush_id) {
+        g_source_remove(mouse_flush_id);
+        mouse_flush_id = 0;
+    }
+    if (!mouse_is_pending)
+        return;
+
+    mouse_is_pending = FALSE;
+    mouse_last_buttons = mouse_pending.buttons;
+    inject_client_mouse(&mouse_pending, mouse_pending_arrival);
+}
+
+static gboolean mouse_flush_cb(gpointer user_data)
+{
+    mouse_flush_id = 0;
+    mouse_flush();
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_client_mouse(VirtioPort *vport, VDAgentMouseState *mouse)
+{
+    gint64 arrival = vdagent_virtio_port_get_message_time(vport);
+    gint64 now;
+
+    if (mouse_max_staleness <= 0) {
+        inject_client_mouse(mouse, arrival);
+        return;
+    }
+
+    now = g_get_monotonic_time();
+    if (mouse_is_pending) {
+        if (vdagentd_mouse_can_coalesce(&mouse_pending, mouse, mouse_last_buttons,
+                                        now - mouse_pending_time,
+                                        mouse_max_staleness * G_TIME_SPAN_MILLISECOND)) {
+            mouse_pending = *mouse;
+            mouse_pending_arrival = arrival;
+            mouse_coalesced++;
+            return;
+        }
+        mouse_flush();
+    }
+
+    mouse_pending = *mouse;
+    mouse_pending_arrival = arrival;
+    mouse_is_pending = TRUE;
+    mouse_pending_time = now;
+    mouse_flush_id = g_idle_add_full(G_PRIORITY_DEFAULT, mouse_flush_cb,
+                                     NULL, NULL);
+}
+
 static void do_client_monitors(VirtioPort *vport, int port_nr,
     VDAgentMessage *message_header, VDAgentMonitorsConfig *new_monitors)
 {
@@ -372,6 +490,67 @@ static void send_file_xfer_status(VirtioPort *vport,
     g_free(status);
 }
 
+/* Flow control: while the connection data gets forwarded to isn't
+ * writable, stop reading from the one producing it */
+static int agent_set_read_paused(UdscsConnection *conn, void *paused)
+{
+    vdagent_connection_set_read_paused(VDAGENT_CONNECTION(conn),
+                                       GPOINTER_TO_INT(paused));
+    return 0;
+}
+
+static void resume_agents(void)
+{
+    udscs_server_for_all_clients(server, agent_set_read_paused,
+                                 GINT_TO_POINTER(FALSE));
+}
+
+/* Stop reading from @vport until @conn, which data from it was just
+ * forwarded to, is writable again */
+static void pause_virtio_port_for(VirtioPort *vport, UdscsConnection *conn)
+{
+    struct agent_data *agent_data;
+
+    if (vdagent_connection_is_writable(VDAGENT_CONNECTION(conn)))
+        return;
+    agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
+    if (agent_data)
+        agent_data->blocks_virtio_port = true;
+    vdagent_connection_set_read_paused(VDAGENT_CONNECTION(vport), TRUE);
+}
+
+static int agent_blocks_virtio_port(UdscsConnection *conn, void *priv)
+{
+    const struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
+
+    return agent_data && agent_data->blocks_virtio_port;
+}
+
+/* Resume the virtio port once none of the agents it was paused for
+ * is still above its high watermark */
+static void resume_virtio_port(void)
+{
+    if (!virtio_port)
+        return;
+    if (udscs_server_for_all_clients(server, agent_blocks_virtio_port, NULL))
+        return;
+    vdagent_connection_set_read_paused(VDAGENT_CONNECTION(virtio_port), FALSE);
+}
+
+static void virtio_port_writable_cb(VDAgentConnection *conn, gpointer user_data)
+{
+    resume_agents();
+}
+
+static void agent_writable_cb(VDAgentConnection *conn, gpointer user_data)
+{
+    struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
+
+    if (agent_data)
+        agent_data->blocks_virtio_port = false;
+    resume_virtio_port();
+}
+
 static void do_client_file_xfer(VirtioPort *vport,
                                 VDAgentMessage *message_header,
                                 uint8_t *data)
@@ -447,6 +626,7 @@ static void do_client_file_xfer(VirtioPort *vport,
         return;
     }
     udscs_write(conn, msg_type, 0, 0, data, message_header->size);
+    pause_virtio_port_for(vport, conn);
 
     // client told that transfer is ended, agents too stop the transfer
     // and release resources
@@ -617,7 +797,7 @@ static void virtio_port_read_complete(
 #ifndef __APPLE__
     case VD_AGENT_MOUSE_STATE:
         virtio_msg_uint32_from_le(data, message_header->size, 0);
-        do_client_mouse(&uinput, (VDAgentMouseState *)data);
+        queue_client_mouse(vport, (VDAgentMouseState *)data);
         break;
     case VD_AGENT_MONITORS_CONFIG:
         virtio_msg_uint32_from_le(data, message_header->size, 0);
@@ -644,7 +824,8 @@ static void virtio_port_read_complete(
         do_client_file_xfer(vport, message_header, data);
         break;
     case VD_AGENT_CLIENT_DISCONNECTED:
-        vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
+        /* the virtio port has dropped the partial message
+         * of the client port already */
         do_client_disconnect();
         break;
     case VD_AGENT_MAX_CLIPBOARD: {
@@ -673,6 +854,238 @@ static void virtio_port_read_complete(
     }
 }
 
+static void log_virtio_port_stats(void)
+{
+    VDAgentBufferPoolStats stats;
+    VDAgentConnectionStats conn_stats;
+    VirtioPortResyncStats resync_stats;
+
+    if (!debug || virtio_port == NULL)
+        return;
+
+    vdagent_connection_get_buffer_pool_stats(VDAGENT_CONNECTION(virtio_port),
+                                             &stats);
+    syslog(LOG_DEBUG, "virtio buffer pool: %" G_GUINT64_FORMAT " hits, %"
+           G_GUINT64_FORMAT " misses, %" G_GUINT64_FORMAT " oversized, %"
+           G_GSIZE_FORMAT " bytes retained",
+           stats.hits, stats.misses, stats.oversized, stats.retained);
+
+    vdagent_connection_get_stats(VDAGENT_CONNECTION(virtio_port), &conn_stats);
+    syslog(LOG_DEBUG, "virtio transport: in %" G_GUINT64_FORMAT " msgs/%"
+           G_GUINT64_FORMAT " bytes, out %" G_GUINT64_FORMAT " msgs/%"
+           G_GUINT64_FORMAT " bytes, peak queue %u msgs/%" G_GSIZE_FORMAT
+           " bytes, %" G_GUINT64_FORMAT " write stalls",
+           conn_stats.messages_in, conn_stats.bytes_in,
+           conn_stats.messages_out, conn_stats.bytes_out,
+           conn_stats.peak_queue_depth, conn_stats.peak_queued_bytes,
+           conn_stats.write_stalls);
+
+    vdagent_virtio_port_get_resync_stats(virtio_port, &resync_stats);
+    syslog(LOG_DEBUG, "virtio resyncs: %" G_GUINT64_FORMAT ", %"
+           G_GUINT64_FORMAT " partial msgs/%" G_GUINT64_FORMAT " bytes dropped",
+           resync_stats.resyncs, resync_stats.messages_dropped,
+           resync_stats.bytes_dropped);
+
+#ifndef __APPLE__
+    syslog(LOG_DEBUG, "mouse states coalesced: %" G_GUINT64_FORMAT,
+           mouse_coalesced);
+#endif
+}
+
+/* An agent receives one streamed message at a time */
+static bool stream_target_busy(UdscsConnection *conn)
+{
+    int i;
+
+    for (i = 0; i < VDP_END_PORT; i++) {
+        if (streams[i].conn == conn)
+            return true;
+    }
+    return false;
+}
+
+/* Starts relaying a streamed message from @port_nr, @data is its first
+ * fragment. Returns the size of the prefix of @data that has been handled,
+ * or -1 if the message should be dropped. */
+static int stream_start(int port_nr, VDAgentMessage *message_header,
+                        const uint8_t *data, uint32_t size)
+{
+    UdscsConnection *conn;
+
+    switch (message_header->type) {
+    case VD_AGENT_CLIPBOARD: {
+        uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+        uint32_t prefix_size = sizeof(VDAgentClipboard);
+        uint32_t data_type;
+
+        if (!active_session_conn) {
+            syslog(LOG_WARNING,
+                   "Could not find an agent connection belonging to the "
+                   "active session, ignoring client clipboard data");
+            return -1;
+        }
+        if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                    VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
+            selection = data[0];
+            prefix_size += 4;
+        }
+        if (size < prefix_size) {
+            syslog(LOG_WARNING, "clipboard data header split over chunks, dropping");
+            return -1;
+        }
+        memcpy(&data_type, data + prefix_size - sizeof(VDAgentClipboard),
+               sizeof(data_type));
+        if (stream_target_busy(active_session_conn)) {
+            syslog(LOG_WARNING, "agent busy with another streamed message, "
+                   "dropping client clipboard data");
+            return -1;
+        }
+
+        streams[port_nr].conn = active_session_conn;
+        streams[port_nr].type = message_header->type;
+        streams[port_nr].selection = selection;
+        udscs_write_start(active_session_conn, VDAGENTD_CLIPBOARD_DATA, selection,
+                          GUINT32_FROM_LE(data_type),
+                          message_header->size - prefix_size);
+        return prefix_size;
+    }
+    case VD_AGENT_FILE_XFER_DATA: {
+        VDAgentFileXferDataMessage msg;
+
+        if (size < sizeof(msg)) {
+            syslog(LOG_WARNING, "file-xfer data header split over chunks, dropping");
+            return -1;
+        }
+        memcpy(&msg, data, sizeof(msg));
+        msg.id = GUINT32_FROM_LE(msg.id);
+        msg.size = GUINT64_FROM_LE(msg.size);
+
+        conn = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(msg.id));
+        if (!conn) {
+            if (debug)
+                syslog(LOG_DEBUG, "Could not find file-xfer %u (cancelled?)", msg.id);
+            return -1;
+        }
+        if (stream_target_busy(conn)) {
+            syslog(LOG_WARNING, "agent busy with another streamed message, "
+                   "dropping data of file-xfer %u", msg.id);
+            return -1;
+        }
+        streams[port_nr].conn = conn;
+        streams[port_nr].type = message_header->type;
+        streams[port_nr].xfer_id = msg.id;
+        udscs_write_start(conn, VDAGENTD_FILE_XFER_DATA, 0, 0,
+                          message_header->size);
+        udscs_write_append(conn, (uint8_t *)&msg, sizeof(msg));
+        return sizeof(msg);
+    }
+    default:
+        g_return_val_if_reached(-1);
+    }
+}
+
+/* The rest of the message being streamed from @port_nr is lost, the agent
+ * still gets a complete message to keep in sync, followed by one telling it
+ * to discard the data: file transfers are cancelled and clipboard data is
+ * invalidated by releasing the selection it belongs to */
+static void stream_abort(VirtioPort *vport, int port_nr)
+{
+    UdscsConnection *conn = streams[port_nr].conn;
+
+    syslog(LOG_WARNING, "lost the rest of a message from the client");
+    streams[port_nr].conn = NULL;
+    udscs_write_abort(conn);
+    if (streams[port_nr].type == VD_AGENT_FILE_XFER_DATA) {
+        VDAgentFileXferStatusMessage status = {
+            .id = streams[port_nr].xfer_id,
+            .result = VD_AGENT_FILE_XFER_STATUS_CANCELLED,
+        };
+
+        /* as if the client cancelled it */
+        udscs_write(conn, VDAGENTD_FILE_XFER_STATUS, 0, 0,
+                    (uint8_t *)&status, sizeof(status));
+        send_file_xfer_status(vport,
+                              "Lost data of file-xfer %u, cancelling it",
+                              status.id, VD_AGENT_FILE_XFER_STATUS_ERROR,
+                              NULL, 0);
+        g_hash_table_remove(active_xfers, GUINT_TO_POINTER(status.id));
+    } else {
+        /* as if the client released it, so the truncated data
+         * doesn't stay in the guest's clipboard */
+        udscs_write(conn, VDAGENTD_CLIPBOARD_RELEASE,
+                    streams[port_nr].selection, 0, NULL, 0);
+    }
+}
+
+static void stream_abort_all(VirtioPort *vport)
+{
+    int i;
+
+    for (i = 0; i < VDP_END_PORT; i++) {
+        if (streams[i].conn)
+            stream_abort(vport, i);
+    }
+}
+
+static gboolean virtio_port_read_fragment(
+        VirtioPort *vport,
+        int port_nr,
+        VDAgentMessage *message_header,
+        uint32_t offset,
+        const uint8_t *data,
+        uint32_t size)
+{
+    gboolean last = offset + size == message_header->size;
+
+    UdscsConnection *conn;
+
+    if (data == NULL) {
+        if (streams[port_nr].conn)
+            stream_abort(vport, port_nr);
+        return FALSE;
+    }
+
+    if (offset == 0) {
+        int prefix_size;
+
+        /* the previous message was never finished */
+        if (streams[port_nr].conn)
+            stream_abort(vport, port_nr);
+        if (!vdagent_message_check_size(message_header))
+            return FALSE;
+        prefix_size = stream_start(port_nr, message_header, data, size);
+        if (prefix_size < 0)
+            return FALSE;
+        data += prefix_size;
+        size -= prefix_size;
+    } else if (!streams[port_nr].conn) {
+        // the agent went away in the middle of the message
+        return FALSE;
+    }
+
+    conn = streams[port_nr].conn;
+    if (size)
+        udscs_write_append(conn, data, size);
+    pause_virtio_port_for(vport, conn);
+    if (last)
+        streams[port_nr].conn = NULL;
+    return TRUE;
+}
+
+static void virtio_port_setup(VirtioPort *vport)
+{
+    vdagent_connection_set_writable_cb(VDAGENT_CONNECTION(vport),
+                                       virtio_port_writable_cb, NULL);
+    vdagent_virtio_port_stream_messages(vport, VD_AGENT_CLIPBOARD,
+                                        STREAM_MIN_SIZE, virtio_port_read_fragment);
+    vdagent_virtio_port_stream_messages(vport, VD_AGENT_FILE_XFER_DATA,
+                                        STREAM_MIN_SIZE, virtio_port_read_fragment);
+    if (capture) {
+        vdagentd_capture_connection(capture, VDAGENT_CONNECTION(vport),
+                                    VDAGENTD_CAPTURE_VIRTIO, 0);
+    }
+}
+
 static void virtio_port_error_cb(VDAgentConnection *conn, GError *err)
 {
     bool old_client_connected = client_connected;
@@ -680,22 +1093,29 @@ static void virtio_port_error_cb(VDAgentConnection *conn, GError *err)
                      err ? err->message : "");
     g_clear_error(&err);
 
+    stream_abort_all(NULL);
+    log_virtio_port_stats();
     vdagent_connection_destroy(virtio_port);
-    virtio_port = vdagent_virtio_port_create(portdev,
-                                             virtio_port_read_complete,
-                                             virtio_port_error_cb);
+    resume_agents();
+    virtio_port = vdagent_virtio_port_create_full(portdev,
+                                                  virtio_port_read_complete,
+                                                  virtio_port_error_cb,
+                                                  virtio_io_thread);
     if (virtio_port == NULL) {
         syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
         vdagentd_quit(1);
         return;
     }
+    virtio_port_setup(virtio_port);
     do_client_disconnect();
     client_connected = old_client_connected;
 }
 
 static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
-    uint32_t data_type, uint8_t *data, uint32_t data_size)
+    uint32_t data_type, GBytes *data)
 {
+    VirtioPortMessage *msg;
+    uint32_t data_size = data ? g_bytes_get_size(data) : 0;
     uint32_t size = data_size;
 
     if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
@@ -711,29 +1131,31 @@ static void virtio_write_clipboard(uint8_t selection, uint32_t msg_type,
         size += 4;
     }
 
-    vdagent_virtio_port_write_start(virtio_port, VDP_CLIENT_PORT, msg_type,
-                                    0, size);
+    msg = vdagent_virtio_port_message_start(virtio_port, VDP_CLIENT_PORT,
+                                            msg_type, 0, size);
+    vdagent_virtio_port_message_set_selection(msg, selection);
 
     if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                 VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
         uint8_t sel[4] = { selection, 0, 0, 0 };
-        vdagent_virtio_port_write_append(virtio_port, sel, 4);
+        vdagent_virtio_port_message_append(msg, sel, 4);
     }
     if (data_type != -1) {
         data_type = GUINT32_TO_LE(data_type);
-        vdagent_virtio_port_write_append(virtio_port, (uint8_t*)&data_type, 4);
+        vdagent_virtio_port_message_append(msg, (uint8_t*)&data_type, 4);
     }
 
-    if (msg_type == VD_AGENT_CLIPBOARD_GRAB) {
-        if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                    VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)) {
-            uint32_t serial = GUINT32_TO_LE(clipboard_serial[selection]);
-            clipboard_serial[selection]++;
-            vdagent_virtio_port_write_append(virtio_port, (uint8_t*)&serial, sizeof(serial));
-        }
-        virtio_msg_uint32_to_le(data, data_size, 0);
+    if (msg_type == VD_AGENT_CLIPBOARD_GRAB &&
+        VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)) {
+        uint32_t serial = GUINT32_TO_LE(clipboard_serial[selection]);
+        clipboard_serial[selection]++;
+        vdagent_virtio_port_message_append(msg, (uint8_t*)&serial, sizeof(serial));
     }
-    vdagent_virtio_port_write_append(virtio_port, data, data_size);
+    /* the payload is passed on by reference */
+    if (data)
+        vdagent_virtio_port_message_append_bytes(msg, data);
+    vdagent_virtio_port_message_commit(msg);
 }
 
 /* vdagentd <-> vdagent communication handling */
@@ -742,6 +1164,7 @@ static void do_agent_clipboard(UdscsConnection *conn,
 {
     uint8_t selection = header->arg1;
     uint32_t msg_type = 0, data_type = -1, size = header->size;
+    GBytes *bytes;
 
     if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                  VD_AGENT_CAP_CLIPBOARD_BY_DEMAND))
@@ -786,7 +1209,7 @@ static void do_agent_clipboard(UdscsConnection *conn,
         if (max_clipboard != -1 && size > max_clipboard) {
             syslog(LOG_WARNING, "clipboard is too large (%d > %d), discarding",
                    size, max_clipboard);
-            virtio_write_clipboard(selection, msg_type, data_type, NULL, 0);
+            virtio_write_clipboard(selection, msg_type, data_type, NULL);
             return;
         }
         break;
@@ -807,7 +1230,15 @@ static void do_agent_clipboard(UdscsConnection *conn,
         return;
     }
 
-    virtio_write_clipboard(selection, msg_type, data_type, data, header->size);
+    if (msg_type == VD_AGENT_CLIPBOARD_GRAB)
+        virtio_msg_uint32_to_le(data, header->size, 0);
+    bytes = header->size ? udscs_get_message_bytes(conn) : NULL;
+    virtio_write_clipboard(selection, msg_type, data_type, bytes);
+    if (bytes)
+        g_bytes_unref(bytes);
+    if (!vdagent_connection_is_writable(VDAGENT_CONNECTION(virtio_port))) {
+        vdagent_connection_set_read_paused(VDAGENT_CONNECTION(conn), TRUE);
+    }
 
     return;
 
@@ -833,6 +1264,9 @@ static void check_xorg_resolution(void)
         agent_data = g_object_get_data(G_OBJECT(active_session_conn), "agent_data");
 
 #ifndef __APPLE__
+    /* with the geometry it was sent for */
+    mouse_flush();
+
     if (agent_data && agent_data->screen_info) {
         if (!uinput)
             uinput = vdagentd_uinput_create(uinput_device,
@@ -859,17 +1293,21 @@ static void check_xorg_resolution(void)
 
         if (!virtio_port) {
             syslog(LOG_INFO, "opening vdagent virtio channel");
-            virtio_port = vdagent_virtio_port_create(portdev,
-                                                     virtio_port_read_complete,
-                                                     virtio_port_error_cb);
+            virtio_port = vdagent_virtio_port_create_full(portdev,
+                                                          virtio_port_read_complete,
+                                                          virtio_port_error_cb,
+                                                          virtio_io_thread);
             if (!virtio_port) {
                 syslog(LOG_CRIT, "Fatal error opening vdagent virtio channel");
                 vdagentd_quit(1);
                 return;
             }
+            virtio_port_setup(virtio_port);
             send_capabilities(virtio_port, 1);
         }
     } else {
+        /* the tablet isn't rebuilt for resolution changes anyway, a static
+         * one is kept so X-servers without hotplug support keep seeing it */
 #ifndef WITH_STATIC_UINPUT
 #ifndef __APPLE__
         vdagentd_uinput_destroy(&uinput);
@@ -881,8 +1319,11 @@ static void check_xorg_resolution(void)
                 vdagentd_quit(0);
                 return;
             }
+            stream_abort_all(virtio_port);
             vdagent_connection_flush(VDAGENT_CONNECTION(virtio_port));
+            log_virtio_port_stats();
             g_clear_pointer(&virtio_port, vdagent_connection_destroy);
+            resume_agents();
             syslog(LOG_INFO, "closed vdagent virtio channel");
         }
     }
@@ -908,6 +1349,8 @@ static void release_clipboards(void)
 {
     uint8_t sel;
 
+    if (virtio_port)
+        vdagent_virtio_port_begin_batch(virtio_port);
     for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; ++sel) {
         if (agent_owns_clipboard[sel] && virtio_port) {
             vdagent_virtio_port_write(virtio_port, VDP_CLIENT_PORT,
@@ -915,6 +1358,8 @@ static void release_clipboards(void)
         }
         agent_owns_clipboard[sel] = false;
     }
+    if (virtio_port)
+        vdagent_virtio_port_end_batch(virtio_port);
 }
 
 static void update_active_session_connection(UdscsConnection *new_conn)
@@ -1064,6 +1509,12 @@ static void agent_connect(UdscsConnection *conn)
 
     g_object_set_data_full(G_OBJECT(conn), "agent_data", agent_data,
                            (GDestroyNotify) agent_data_destroy);
+    vdagent_connection_set_writable_cb(VDAGENT_CONNECTION(conn),
+                                       agent_writable_cb, NULL);
+    if (capture) {
+        vdagentd_capture_connection(capture, VDAGENT_CONNECTION(conn),
+                                    VDAGENTD_CAPTURE_UDSCS, ++capture_stream);
+    }
     udscs_write(conn, VDAGENTD_VERSION, 0, 0,
                 (uint8_t *)VERSION, strlen(VERSION) + 1);
     update_active_session_connection(conn);
@@ -1076,13 +1527,26 @@ static void agent_connect(UdscsConnection *conn)
 
 static void agent_disconnect(VDAgentConnection *conn, GError *err)
 {
+    int i;
+
+    /* cancel its file transfers with one write */
+    if (virtio_port)
+        vdagent_virtio_port_begin_batch(virtio_port);
     g_hash_table_foreach_remove(active_xfers, remove_active_xfers, conn);
+    if (virtio_port)
+        vdagent_virtio_port_end_batch(virtio_port);
+    for (i = 0; i < VDP_END_PORT; i++) {
+        if (streams[i].conn == UDSCS_CONNECTION(conn))
+            streams[i].conn = NULL;
+    }
 
     if (err) {
         syslog(LOG_ERR, "%s", err->message);
         g_error_free(err);
     }
     udscs_server_destroy_connection(server, UDSCS_CONNECTION(conn));
+    /* the virtio port may have been paused for a transfer to this agent */
+    resume_virtio_port();
 
     update_active_session_connection(NULL);
 }
@@ -1239,6 +1703,15 @@ static gboolean signal_handler(gpointer user_data)
     return G_SOURCE_REMOVE;
 }
 
+static gboolean dump_stats_cb(gpointer user_data)
+{
+#ifndef __APPLE__
+    log_mouse_latency();
+#endif
+    log_virtio_port_stats();
+    return G_SOURCE_CONTINUE;
+}
+
 static gboolean parse_debug_level_cb(const gchar *option_name,
                                      const gchar *value,
                                      gpointer     data,
@@ -1277,6 +1750,21 @@ static GOptionEntry cmd_entries[] = {
       G_OPTION_ARG_NONE, &only_once,
       "Only handle one virtio serial session", NULL },
 
+    { "virtio-io-thread", 't', 0,
+      G_OPTION_ARG_NONE, &virtio_io_thread,
+      "Handle virtio serial I/O in a separate thread", NULL },
+
+    { "capture-file", 'c', 0,
+      G_OPTION_ARG_FILENAME, &capture_file,
+      "Record the traffic read from the virtio port and the agents", NULL },
+
+#ifndef __APPLE__
+    { "mouse-max-staleness", 0, 0,
+      G_OPTION_ARG_INT, &mouse_max_staleness,
+      "Coalesce pointer motion for at most this many ms (10), 0 disables it",
+      "MS" },
+#endif
+
 #if defined(HAVE_CONSOLE_KIT) || defined (HAVE_LIBSYSTEMD_LOGIN)
     { "disable-session-integration", 'X', G_OPTION_FLAG_REVERSE,
       G_OPTION_ARG_NONE, &want_session_info,
@@ -1319,6 +1807,16 @@ int main(int argc, char *argv[])
 
     openlog("spice-vdagentd", do_daemonize ? 0 : LOG_PERROR, LOG_USER);
 
+    if (capture_file) {
+        capture = vdagentd_capture_open(capture_file, &err);
+        if (capture == NULL) {
+            syslog(LOG_CRIT, "Fatal could not open the capture file: %s",
+                   err->message);
+            g_error_free(err);
+            return 1;
+        }
+    }
+
     /* Setup communication with vdagent process(es) */
     server = udscs_server_new(agent_connect, agent_read_complete,
                               agent_disconnect, debug);
@@ -1364,6 +1862,7 @@ int main(int argc, char *argv[])
     g_unix_signal_add(SIGINT, signal_handler, NULL);
     g_unix_signal_add(SIGHUP, signal_handler, NULL);
     g_unix_signal_add(SIGTERM, signal_handler, NULL);
+    g_unix_signal_add(SIGUSR1, dump_stats_cb, NULL);
 
     if (want_session_info)
         session_info = session_info_create(debug);
@@ -1386,6 +1885,7 @@ int main(int argc, char *argv[])
     release_clipboards();
 
 #ifndef __APPLE__
+    mouse_flush();
     vdagentd_uinput_destroy(&uinput);
 #endif
     if (si_watch_id > 0) {
@@ -1400,6 +1900,7 @@ int main(int argc, char *argv[])
 
     /* allow the VDAgentConnection(s) to finalize properly */
     g_main_context_iteration(NULL, FALSE);
+    g_clear_pointer(&capture, vdagentd_capture_close);
 
     g_main_loop_unref(loop);
 
@@ -1416,6 +1917,7 @@ int main(int argc, char *argv[])
     g_free(portdev);
     g_free(vdagentd_socket);
     g_free(uinput_device);
+    g_free(capture_file);
 
     return retval;
 }
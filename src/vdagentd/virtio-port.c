@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <gio/gio.h>
 #include <glib-unix.h>
 
@@ -30,10 +32,88 @@
 #include "virtio-port.h"
 
 
-struct vdagent_virtio_port_buf {
-    uint8_t *buf;
-    size_t size;
-    size_t write_pos;
+/* Outgoing messages are split into chunks with at most this much payload,
+ * so messages on different ports can be interleaved */
+#define CHUNK_MAX_DATA_SIZE VD_AGENT_MAX_DATA_SIZE
+#define CHUNK_SIZE (sizeof(VDIChunkHeader) + CHUNK_MAX_DATA_SIZE)
+
+/* Chunks are passed on to the connection while less than this is queued
+ * there, the rest waits in the per-port queues */
+#define WRITE_WINDOW (16 * CHUNK_SIZE)
+
+/* Pieces of the payload at least this large are passed to the connection
+ * by reference, smaller ones are copied together with the chunk header */
+#define SEGMENT_REF_MIN_SIZE 256
+
+/* The copied pieces of consecutive chunks are packed into one buffer
+ * of up to about this size before being passed to the connection */
+#define WRITE_PACK_SIZE (16 * 1024)
+
+/* Messages with at most this much data are assembled in the port data
+ * itself, and copied into the ring slot with an I/O thread */
+#define INLINE_DATA_SIZE 64
+
+/* Larger messages are assembled in a per-port arena keeping its size
+ * between messages, up to the arena limit. Every ARENA_DECAY_INTERVAL
+ * messages the arena shrinks to the largest message it held in that
+ * time if that is less than half of it. */
+#define ARENA_DEFAULT_LIMIT (64 * 1024)
+#define ARENA_DECAY_INTERVAL 256
+
+/* A message being built, see vdagent_virtio_port_message_start() */
+struct _VirtioPortMessage {
+    /* not a reference, queued messages are freed with the port */
+    VirtioPort *vport;
+    uint32_t port_nr;
+    uint32_t type;
+    VDAgentWritePriority priority;
+    /* clipboard selection, -1 if unknown,
+     * see vdagent_virtio_port_message_set_selection() */
+    gint selection;
+    /* GBytes holding the VDAgentMessage header and data,
+     * without the chunk headers */
+    GQueue segments;
+    size_t payload_size;
+    size_t payload_pos;
+    /* copied data appended after the last segment */
+    GByteArray *tail;
+};
+
+/* Messages waiting to be written to a chunk port.
+ * Chunks of different messages on the same port must not be interleaved,
+ * so a message is written completely before the next one is started. */
+struct vdagent_virtio_port_out_port {
+    /* complete messages for each VDAgentWritePriority */
+    GQueue messages[VDAGENT_WRITE_N_PRIORITIES];
+    VirtioPortMessage *current;
+    /* payload of current written so far, and how much of
+     * the head of its segments that is */
+    size_t current_pos;
+    size_t segment_pos;
+};
+
+/* With an I/O thread, completed messages are passed to the main context
+ * through a single-producer single-consumer ring of this many slots */
+#define MESSAGE_RING_SIZE 256
+/* Reading stops while fewer slots are free: a chunk queues at most three
+ * entries, the end of a stream dropped by a resync, the message the chunk
+ * starts and, if that's VD_AGENT_CLIENT_DISCONNECTED, the end of the stream
+ * of the client port it resets */
+#define MESSAGE_RING_RESERVE 3
+
+struct vdagent_virtio_port_message {
+    int port_nr;
+    VDAgentMessage header;
+    /* owned by the I/O thread, freed when the slot gets reused */
+    uint8_t *data;
+    /* a fragment of a streamed message, see deliver_fragment() */
+    gboolean fragment;
+    uint32_t offset;
+    uint32_t size;
+    /* when the message was completed */
+    gint64 time;
+    /* data points here for small messages */
+    uint8_t inline_data[INLINE_DATA_SIZE];
 };
 
 /* Data to keep track of the assembling of vdagent messages per chunk port,
@@ -42,7 +122,18 @@ struct vdagent_virtio_port_chunk_port_data {
     int message_header_read;
     int message_data_pos;
     VDAgentMessage message_header;
+    /* points to inline_data, arena or a buffer from the connection's pool,
+     * see port_data_alloc() */
     uint8_t *message_data;
+    /* the data is passed on as it arrives instead of being assembled */
+    gboolean streaming;
+
+    uint8_t inline_data[INLINE_DATA_SIZE];
+    uint8_t *arena;
+    gsize arena_size;
+    /* largest message assembled since the arena last decayed */
+    gsize arena_peak;
+    guint arena_messages;
 };
 
 struct _VirtioPort {
@@ -51,11 +142,53 @@ struct _VirtioPort {
     /* Per chunk port data */
     struct vdagent_virtio_port_chunk_port_data port_data[VDP_END_PORT];
 
-    struct vdagent_virtio_port_buf write_buf;
+    /* message built by vdagent_virtio_port_write_start() */
+    VirtioPortMessage *write_msg;
+
+    /* messages committed since vdagent_virtio_port_begin_batch() */
+    GQueue *batch;
+    guint batch_depth;
+
+    /* Outgoing chunk scheduling, owned by the I/O context */
+    struct vdagent_virtio_port_out_port out_ports[VDP_END_PORT];
+    guint next_out_port;
+    gsize write_backlog;
+    GByteArray *write_pack;
+
+    gboolean opened;
+
+    /* completion time of the message passed to the read callback */
+    gint64 message_time;
+
+    /* I/O thread mode: ring_head is only advanced by the I/O thread,
+     * ring_tail only by the main context, both accessed atomically */
+    struct vdagent_virtio_port_message *ring;
+    gint ring_head;
+    gint ring_tail;
+    /* the I/O thread stopped reading because the ring was full */
+    gint ring_full;
+    /* a byte was written to wakeup_fds[1] and hasn't been handled yet */
+    gint wakeup_pending;
+    gint wakeup_fds[2];
+    guint wakeup_watch;
+
+    /* Minimum data size of streamed messages for each message type,
+     * 0 if the type isn't streamed, read from the I/O context */
+    gint stream_min_size[VD_AGENT_END_MESSAGE];
+    /* the rest of the message streamed on the port is discarded,
+     * main context only */
+    gboolean stream_dropped[VDP_END_PORT];
+
+    /* see vdagent_virtio_port_set_arena_limit(), read from the I/O context */
+    gint arena_limit;
+
+    /* updated from the I/O context */
+    GMutex stats_lock;
+    VirtioPortResyncStats resync_stats;
 
     /* Callbacks */
     vdagent_virtio_port_read_callback read_callback;
-    VDAgentConnErrorCb error_cb;
+    vdagent_virtio_port_fragment_callback fragment_callback;
 };
 
 G_DEFINE_TYPE(VirtioPort, virtio_port, VDAGENT_TYPE_CONNECTION)
@@ -74,37 +207,171 @@ static gsize conn_handle_header(VDAgentConnection *conn,
     header->size = GUINT32_FROM_LE(header->size);
     header->port = GUINT32_FROM_LE(header->port);
 
+    if (!self->opened) {
+        self->opened = TRUE;
+        syslog(LOG_INFO, "vdagent virtio channel opened by the host after %"
+               G_GINT64_FORMAT " ms", vdagent_connection_get_open_time(conn) / 1000);
+    }
+
     if (header->size > VD_AGENT_MAX_DATA_SIZE) {
         err = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
                           "chunk size %u too large", header->size);
-        self->error_cb(conn, err);
+        vdagent_connection_report_error(conn, err);
         return 0;
     }
+    /* chunks for unknown ports are skipped by vdagent_virtio_port_do_chunk(),
+     * only a chunk size out of range leaves no way to find the next chunk */
+    return header->size;
+}
+
+/* Chunks continuing a message whose header has been read already
+ * are stored straight into the message buffer of their port */
+static guint conn_get_body_vectors(VDAgentConnection *conn,
+                                   gpointer           header_buf,
+                                   gsize              size,
+                                   GInputVector      *vectors)
+{
+    VirtioPort *self = VIRTIO_PORT(conn);
+    VDIChunkHeader *header = header_buf;
+    struct vdagent_virtio_port_chunk_port_data *port;
+
     if (header->port >= VDP_END_PORT) {
-        err = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
-                          "chunk port %u out of range", header->port);
-        self->error_cb(conn, err);
+        return 0;
+    }
+    port = &self->port_data[header->port];
+    if (port->message_header_read < sizeof(port->message_header) ||
+        port->streaming ||
+        size > port->message_header.size - port->message_data_pos) {
+        /* vdagent_virtio_port_do_chunk() handles these */
         return 0;
     }
 
-    return header->size;
+    vectors[0].buffer = port->message_data + port->message_data_pos;
+    vectors[0].size = size;
+    return 1;
 }
 
+/* Storage for the @size bytes of data of the message
+ * whose header has just been read on @port */
+static uint8_t *port_data_alloc(VirtioPort *vport,
+                                struct vdagent_virtio_port_chunk_port_data *port,
+                                gsize size)
+{
+    gsize limit;
+
+    if (size <= INLINE_DATA_SIZE) {
+        return port->inline_data;
+    }
+    /* the ring takes ownership of the data */
+    if (vport->ring) {
+        return vdagent_connection_buffer_alloc(VDAGENT_CONNECTION(vport), size);
+    }
+
+    limit = (guint)g_atomic_int_get(&vport->arena_limit);
+    if (size > limit) {
+        return vdagent_connection_buffer_alloc(VDAGENT_CONNECTION(vport), size);
+    }
+    port->arena_peak = MAX(port->arena_peak, size);
+    if (size > port->arena_size) {
+        /* the arena holds no data between messages, no need to copy */
+        g_free(port->arena);
+        port->arena_size = MIN(MAX(size, 2 * port->arena_size), limit);
+        port->arena = g_malloc(port->arena_size);
+    }
+    return port->arena;
+}
+
+static void port_data_free(VirtioPort *vport,
+                           struct vdagent_virtio_port_chunk_port_data *port,
+                           uint8_t *data)
+{
+    if (data != port->inline_data && data != port->arena) {
+        vdagent_connection_buffer_free(VDAGENT_CONNECTION(vport), data);
+    }
+}
+
+/* Called after every message assembled on @port */
+static void port_arena_decay(VirtioPort *vport,
+                             struct vdagent_virtio_port_chunk_port_data *port)
+{
+    gsize size;
+
+    if (++port->arena_messages < ARENA_DECAY_INTERVAL) {
+        return;
+    }
+    size = MIN(port->arena_peak, (guint)g_atomic_int_get(&vport->arena_limit));
+    if (size <= port->arena_size / 2) {
+        g_free(port->arena);
+        port->arena_size = size > INLINE_DATA_SIZE ? size : 0;
+        port->arena = port->arena_size ? g_malloc(port->arena_size) : NULL;
+    }
+    port->arena_peak = 0;
+    port->arena_messages = 0;
+}
+
+/* Get ready for the next message on @port */
+static void port_message_done(struct vdagent_virtio_port_chunk_port_data *port)
+{
+    port->message_header_read = 0;
+    port->message_data_pos = 0;
+    port->message_data = NULL;
+    port->streaming = FALSE;
+}
+
+static void virtio_port_fill_write_queue(VDAgentConnection *conn);
+static void message_free(VirtioPortMessage *msg);
+
 static void virtio_port_init(VirtioPort *self)
 {
+    guint i, j;
+
+    self->wakeup_fds[0] = self->wakeup_fds[1] = -1;
+    self->arena_limit = ARENA_DEFAULT_LIMIT;
+    g_mutex_init(&self->stats_lock);
+    for (i = 0; i < VDP_END_PORT; i++) {
+        for (j = 0; j < VDAGENT_WRITE_N_PRIORITIES; j++) {
+            g_queue_init(&self->out_ports[i].messages[j]);
+        }
+    }
 }
 
 static void virtio_port_finalize(GObject *obj)
 {
     VirtioPort *self = VIRTIO_PORT(obj);
-    guint i;
+    guint i, j;
 
-    g_free(self->write_buf.buf);
+    g_clear_pointer(&self->write_msg, message_free);
+    if (self->batch) {
+        g_queue_free_full(self->batch, (GDestroyNotify)message_free);
+    }
+    if (self->write_pack) {
+        g_byte_array_unref(self->write_pack);
+    }
 
     for (i = 0; i < VDP_END_PORT; i++) {
-        g_free(self->port_data[i].message_data);
+        port_data_free(self, &self->port_data[i], self->port_data[i].message_data);
+        g_free(self->port_data[i].arena);
+        for (j = 0; j < VDAGENT_WRITE_N_PRIORITIES; j++) {
+            g_queue_clear_full(&self->out_ports[i].messages[j],
+                               (GDestroyNotify)message_free);
+        }
+        g_clear_pointer(&self->out_ports[i].current, message_free);
     }
 
+    if (self->ring) {
+        g_source_remove(self->wakeup_watch);
+        close(self->wakeup_fds[0]);
+        close(self->wakeup_fds[1]);
+        for (i = 0; i < MESSAGE_RING_SIZE; i++) {
+            if (self->ring[i].data != self->ring[i].inline_data) {
+                vdagent_connection_buffer_free(VDAGENT_CONNECTION(self),
+                                               self->ring[i].data);
+            }
+        }
+        g_free(self->ring);
+    }
+    g_mutex_clear(&self->stats_lock);
+
     G_OBJECT_CLASS(virtio_port_parent_class)->finalize(obj);
 }
 
@@ -117,11 +384,160 @@ static void virtio_port_class_init(VirtioPortClass *klass)
 
     conn_class->handle_header = conn_handle_header;
     conn_class->handle_message = vdagent_virtio_port_do_chunk;
+    conn_class->get_body_vectors = conn_get_body_vectors;
+    conn_class->fill_write_queue = virtio_port_fill_write_queue;
+}
+
+static guint ring_free_slots(VirtioPort *vport)
+{
+    return MESSAGE_RING_SIZE - ((guint)g_atomic_int_get(&vport->ring_head) -
+                                (guint)g_atomic_int_get(&vport->ring_tail));
+}
+
+/* Runs in the I/O thread, stops reading while the next chunk may not
+ * find room in the ring, wakeup_cb() resumes it */
+static void ring_throttle(VirtioPort *vport)
+{
+    VDAgentConnection *conn = VDAGENT_CONNECTION(vport);
+
+    if (ring_free_slots(vport) >= MESSAGE_RING_RESERVE) {
+        return;
+    }
+    vdagent_connection_set_read_throttled(conn, TRUE);
+    g_atomic_int_set(&vport->ring_full, TRUE);
+    /* the main context may have emptied slots before seeing ring_full */
+    if (ring_free_slots(vport) >= MESSAGE_RING_RESERVE &&
+        g_atomic_int_compare_and_exchange(&vport->ring_full, TRUE, FALSE)) {
+        vdagent_connection_set_read_throttled(conn, FALSE);
+    }
+}
+
+static gboolean resume_reading_cb(gpointer user_data)
+{
+    VirtioPort *vport = user_data;
+
+    /* a single slot may have been emptied so far */
+    if (ring_free_slots(vport) < MESSAGE_RING_RESERVE) {
+        ring_throttle(vport);
+    } else {
+        vdagent_connection_set_read_throttled(VDAGENT_CONNECTION(vport), FALSE);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+/* Runs in the main context, @data is NULL if the rest of the message
+ * has been lost */
+static void deliver_fragment(VirtioPort *vport, int port_nr,
+                             VDAgentMessage *header, uint32_t offset,
+                             const uint8_t *data, uint32_t size)
+{
+    if (offset == 0) {
+        vport->stream_dropped[port_nr] = FALSE;
+    }
+    if (vport->stream_dropped[port_nr] || vport->fragment_callback == NULL) {
+        return;
+    }
+    if (!vport->fragment_callback(vport, port_nr, header, offset, data, size)) {
+        vport->stream_dropped[port_nr] = TRUE;
+    }
+}
+
+/* Runs in the main context, delivers the messages queued in the ring */
+static gboolean wakeup_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    VirtioPort *vport = user_data;
+    VDAgentConnection *conn = VDAGENT_CONNECTION(vport);
+    struct vdagent_virtio_port_message *msg;
+    guint tail = g_atomic_int_get(&vport->ring_tail);
+    char buf[16];
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+    /* cleared before checking the ring, so a message queued
+     * after the check will write another byte */
+    g_atomic_int_set(&vport->wakeup_pending, FALSE);
+
+    g_object_ref(vport);
+    while (!vdagent_connection_is_closed(conn) &&
+           tail != (guint)g_atomic_int_get(&vport->ring_head)) {
+        msg = &vport->ring[tail % MESSAGE_RING_SIZE];
+        if (msg->fragment) {
+            deliver_fragment(vport, msg->port_nr, &msg->header,
+                             msg->offset, msg->data, msg->size);
+        } else if (vport->read_callback) {
+            vport->message_time = msg->time;
+            vport->read_callback(vport, msg->port_nr, &msg->header, msg->data);
+        }
+        g_atomic_int_set(&vport->ring_tail, ++tail);
+
+        if (g_atomic_int_compare_and_exchange(&vport->ring_full, TRUE, FALSE)) {
+            vdagent_connection_invoke(conn, resume_reading_cb,
+                                      g_object_ref(vport), g_object_unref);
+        }
+    }
+    g_object_unref(vport);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* Runs in the I/O thread, takes ownership of @data unless it is the inline
+ * buffer of the port, @size is only used for fragments */
+static void queue_message(VirtioPort *vport, int port_nr,
+                          VDAgentMessage *header, uint8_t *data,
+                          gboolean fragment, uint32_t offset, uint32_t size)
+{
+    VDAgentConnection *conn = VDAGENT_CONNECTION(vport);
+    guint head = g_atomic_int_get(&vport->ring_head);
+    struct vdagent_virtio_port_message *msg = &vport->ring[head % MESSAGE_RING_SIZE];
+
+    /* can't happen as long as MESSAGE_RING_RESERVE is right,
+     * overwriting the slot would free data still in use */
+    if (ring_free_slots(vport) == 0) {
+        syslog(LOG_ERR, "vdagent virtio port %d: message ring full, "
+               "dropping a message", port_nr);
+        if (data && data != vport->port_data[port_nr].inline_data) {
+            vdagent_connection_buffer_free(conn, data);
+        }
+        return;
+    }
+
+    /* the slot has been consumed already, reading stops before the ring
+     * is full, see ring_throttle() */
+    if (msg->data != msg->inline_data) {
+        vdagent_connection_buffer_free(conn, msg->data);
+    }
+    if (data && data == vport->port_data[port_nr].inline_data) {
+        memcpy(msg->inline_data, data, header->size);
+        data = msg->inline_data;
+    }
+    msg->port_nr = port_nr;
+    msg->header = *header;
+    msg->data = data;
+    msg->fragment = fragment;
+    msg->offset = offset;
+    msg->size = size;
+    msg->time = g_get_monotonic_time();
+    g_atomic_int_set(&vport->ring_head, ++head);
+    ring_throttle(vport);
+
+    if (g_atomic_int_compare_and_exchange(&vport->wakeup_pending, FALSE, TRUE)) {
+        if (write(vport->wakeup_fds[1], "", 1) != 1) {
+            syslog(LOG_ERR, "%s: failed to wake up the main context", __func__);
+        }
+    }
 }
 
 VirtioPort *vdagent_virtio_port_create(const char *portname,
     vdagent_virtio_port_read_callback read_callback,
     VDAgentConnErrorCb error_cb)
+{
+    return vdagent_virtio_port_create_full(portname, read_callback,
+                                           error_cb, FALSE);
+}
+
+VirtioPort *vdagent_virtio_port_create_full(const char *portname,
+    vdagent_virtio_port_read_callback read_callback,
+    VDAgentConnErrorCb error_cb,
+    gboolean io_thread)
 {
     VirtioPort *vport;
     GIOStream *io_stream;
@@ -140,6 +556,26 @@ VirtioPort *vdagent_virtio_port_create(const char *portname,
     }
 
     vport = g_object_new(VIRTIO_TYPE_PORT, NULL);
+    vport->read_callback = read_callback;
+
+    if (io_thread) {
+        if (!g_unix_open_pipe(vport->wakeup_fds, FD_CLOEXEC, &err) ||
+            !g_unix_set_fd_nonblocking(vport->wakeup_fds[0], TRUE, &err)) {
+            syslog(LOG_ERR, "%s: %s, not using an I/O thread",
+                   __func__, err->message);
+            g_clear_error(&err);
+            if (vport->wakeup_fds[0] != -1) {
+                close(vport->wakeup_fds[0]);
+                close(vport->wakeup_fds[1]);
+            }
+        } else {
+            vport->ring = g_new0(struct vdagent_virtio_port_message,
+                                 MESSAGE_RING_SIZE);
+            vport->wakeup_watch = g_unix_fd_add(vport->wakeup_fds[0], G_IO_IN,
+                                                wakeup_cb, vport);
+            vdagent_connection_use_io_thread(VDAGENT_CONNECTION(vport));
+        }
+    }
 
     /* When calling vdagent_connection_new(),
      * @wait_on_opening MUST be set to TRUE:
@@ -167,69 +603,394 @@ VirtioPort *vdagent_virtio_port_create(const char *portname,
                              sizeof(VDIChunkHeader),
                              error_cb);
 
-    vport->read_callback = read_callback;
-    vport->error_cb = error_cb;
-
     return vport;
 }
 
-void vdagent_virtio_port_write_start(
+/* Clipboard contents and file transfers go to the bulk lane,
+ * replies, capabilities, grabs etc. shouldn't wait behind them.
+ * File-xfer status messages stay ordered with the data, grabs and
+ * releases do so only if needed, see schedule_priority(). */
+static VDAgentWritePriority message_priority(uint32_t message_type)
+{
+    switch (message_type) {
+    case VD_AGENT_CLIPBOARD:
+    case VD_AGENT_FILE_XFER_STATUS:
+    case VD_AGENT_FILE_XFER_DATA:
+        return VDAGENT_WRITE_PRIORITY_BULK;
+    default:
+        return VDAGENT_WRITE_PRIORITY_INTERACTIVE;
+    }
+}
+
+/* Size of @msg on the wire, including the chunk headers */
+static size_t message_wire_size(VirtioPortMessage *msg)
+{
+    size_t n_chunks = (msg->payload_size + CHUNK_MAX_DATA_SIZE - 1) / CHUNK_MAX_DATA_SIZE;
+
+    return n_chunks * sizeof(VDIChunkHeader) + msg->payload_size;
+}
+
+static GByteArray *get_write_pack(VirtioPort *vport)
+{
+    if (vport->write_pack == NULL) {
+        vport->write_pack = g_byte_array_sized_new(WRITE_PACK_SIZE);
+    }
+    return vport->write_pack;
+}
+
+static gsize write_pack_size(VirtioPort *vport)
+{
+    return vport->write_pack ? vport->write_pack->len : 0;
+}
+
+/* Pass the copied data packed so far to the connection */
+static void flush_write_pack(VirtioPort *vport)
+{
+    if (write_pack_size(vport) == 0) {
+        return;
+    }
+    vdagent_connection_write_bytes(VDAGENT_CONNECTION(vport),
+        g_byte_array_free_to_bytes(g_steal_pointer(&vport->write_pack)),
+        VDAGENT_WRITE_PRIORITY_BULK);
+}
+
+/* Queue the next chunk of @port_nr to the connection, starting the next
+ * message if needed, interactive ones first.
+ * Returns FALSE if there's nothing to write to @port_nr. */
+static gboolean queue_next_chunk(VirtioPort *vport, guint port_nr)
+{
+    struct vdagent_virtio_port_out_port *out = &vport->out_ports[port_nr];
+    VirtioPortMessage *msg;
+    VDIChunkHeader chunk_header;
+    GBytes *segment;
+    const uint8_t *data;
+    gsize size, chunk_size, left, n;
+
+    if (out->current == NULL) {
+        out->current = g_queue_pop_head(
+            &out->messages[VDAGENT_WRITE_PRIORITY_INTERACTIVE]);
+        if (out->current == NULL) {
+            out->current = g_queue_pop_head(
+                &out->messages[VDAGENT_WRITE_PRIORITY_BULK]);
+        }
+        if (out->current == NULL) {
+            return FALSE;
+        }
+        out->current_pos = 0;
+        out->segment_pos = 0;
+    }
+    msg = out->current;
+
+    chunk_size = MIN(CHUNK_MAX_DATA_SIZE, msg->payload_size - out->current_pos);
+    chunk_header.port = GUINT32_TO_LE(port_nr);
+    chunk_header.size = GUINT32_TO_LE(chunk_size);
+    g_byte_array_append(get_write_pack(vport), (const guint8 *)&chunk_header,
+                        sizeof(chunk_header));
+
+    /* the order of the chunks is decided here, so all of their parts
+     * go to one lane and stay contiguous */
+    for (left = chunk_size; left > 0; left -= n) {
+        segment = g_queue_peek_head(&msg->segments);
+        data = g_bytes_get_data(segment, &size);
+        n = MIN(left, size - out->segment_pos);
+
+        if (n >= SEGMENT_REF_MIN_SIZE) {
+            flush_write_pack(vport);
+            vdagent_connection_write_bytes(VDAGENT_CONNECTION(vport),
+                g_bytes_new_from_bytes(segment, out->segment_pos, n),
+                VDAGENT_WRITE_PRIORITY_BULK);
+        } else {
+            g_byte_array_append(get_write_pack(vport), data + out->segment_pos, n);
+        }
+
+        out->segment_pos += n;
+        if (out->segment_pos == size) {
+            g_bytes_unref(g_queue_pop_head(&msg->segments));
+            out->segment_pos = 0;
+        }
+    }
+    if (write_pack_size(vport) >= WRITE_PACK_SIZE) {
+        flush_write_pack(vport);
+    }
+
+    vport->write_backlog -= sizeof(chunk_header) + chunk_size;
+    out->current_pos += chunk_size;
+    if (out->current_pos == msg->payload_size) {
+        g_clear_pointer(&out->current, message_free);
+    }
+    return TRUE;
+}
+
+/* Keeps about WRITE_WINDOW bytes queued in the connection, taking one chunk
+ * from each port in turn, so a large message doesn't hold up the others
+ * for longer than it takes to write the window. */
+static void virtio_port_fill_write_queue(VDAgentConnection *conn)
+{
+    VirtioPort *vport = VIRTIO_PORT(conn);
+    guint i, port_nr = vport->next_out_port;
+
+    while (vport->write_backlog > 0 &&
+           vdagent_connection_get_queued_bytes(conn) +
+           write_pack_size(vport) < WRITE_WINDOW) {
+        for (i = 0; i < VDP_END_PORT; i++) {
+            port_nr = (vport->next_out_port + i) % VDP_END_PORT;
+            if (queue_next_chunk(vport, port_nr)) {
+                break;
+            }
+        }
+        vport->next_out_port = (port_nr + 1) % VDP_END_PORT;
+    }
+    flush_write_pack(vport);
+    vdagent_connection_set_write_backlog(conn, vport->write_backlog);
+}
+
+static void message_free(VirtioPortMessage *msg)
+{
+    g_queue_clear_full(&msg->segments, (GDestroyNotify)g_bytes_unref);
+    if (msg->tail) {
+        g_byte_array_unref(msg->tail);
+    }
+    g_free(msg);
+}
+
+typedef struct {
+    VirtioPort *vport;
+    GQueue *messages;
+} ScheduleData;
+
+/* A grab or release must not overtake clipboard data of its selection
+ * queued before it, it waits in the bulk lane then. Messages whose
+ * selection is unknown are assumed to be about any selection. */
+static VDAgentWritePriority schedule_priority(struct vdagent_virtio_port_out_port *out,
+                                              VirtioPortMessage *msg)
+{
+    GList *l;
+
+    if (msg->type != VD_AGENT_CLIPBOARD_GRAB &&
+        msg->type != VD_AGENT_CLIPBOARD_RELEASE) {
+        return msg->priority;
+    }
+    for (l = out->messages[VDAGENT_WRITE_PRIORITY_BULK].head; l; l = l->next) {
+        VirtioPortMessage *queued = l->data;
+
+        if (queued->type == VD_AGENT_CLIPBOARD &&
+            (msg->selection < 0 || queued->selection < 0 ||
+             queued->selection == msg->selection)) {
+            return VDAGENT_WRITE_PRIORITY_BULK;
+        }
+    }
+    return msg->priority;
+}
+
+/* Runs in the I/O context, queues the committed messages */
+static gboolean schedule_messages_cb(gpointer user_data)
+{
+    ScheduleData *schedule = user_data;
+    VirtioPort *vport = schedule->vport;
+    VirtioPortMessage *msg;
+
+    /* the messages are dropped with the port */
+    if (vdagent_connection_is_closed(VDAGENT_CONNECTION(vport))) {
+        return G_SOURCE_REMOVE;
+    }
+    while ((msg = g_queue_pop_head(schedule->messages))) {
+        struct vdagent_virtio_port_out_port *out = &vport->out_ports[msg->port_nr];
+
+        vport->write_backlog += message_wire_size(msg);
+        g_queue_push_tail(&out->messages[schedule_priority(out, msg)], msg);
+    }
+    virtio_port_fill_write_queue(VDAGENT_CONNECTION(vport));
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_data_free(gpointer user_data)
+{
+    ScheduleData *schedule = user_data;
+
+    g_queue_free_full(schedule->messages, (GDestroyNotify)message_free);
+    g_object_unref(schedule->vport);
+    g_free(schedule);
+}
+
+/* The port is only referenced while @messages are on their way
+ * to the I/O context, once queued they are freed with it */
+static void schedule_messages(VirtioPort *vport, GQueue *messages)
+{
+    ScheduleData *schedule = g_new(ScheduleData, 1);
+
+    schedule->vport = g_object_ref(vport);
+    schedule->messages = messages;
+    vdagent_connection_invoke(VDAGENT_CONNECTION(vport), schedule_messages_cb,
+                              schedule, schedule_data_free);
+}
+
+/* Turn the data copied into @msg so far into a segment */
+static void message_flush_tail(VirtioPortMessage *msg)
+{
+    if (msg->tail && msg->tail->len > 0) {
+        g_queue_push_tail(&msg->segments, g_byte_array_free_to_bytes(msg->tail));
+        msg->tail = NULL;
+    }
+}
+
+VirtioPortMessage *vdagent_virtio_port_message_start(
         VirtioPort *vport,
         uint32_t port_nr,
         uint32_t message_type,
         uint32_t message_opaque,
         uint32_t data_size)
 {
-    struct vdagent_virtio_port_buf *new_wbuf;
-    VDIChunkHeader *chunk_header;
-    VDAgentMessage *message_header;
+    VirtioPortMessage *msg;
+    VDAgentMessage message_header;
+
+    g_return_val_if_fail(port_nr < VDP_END_PORT, NULL);
+
+    msg = g_new0(VirtioPortMessage, 1);
+    msg->vport = vport;
+    msg->port_nr = port_nr;
+    msg->type = message_type;
+    msg->priority = message_priority(message_type);
+    msg->selection = -1;
+    msg->payload_size = sizeof(message_header) + data_size;
+    g_queue_init(&msg->segments);
+
+    message_header.protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL);
+    message_header.type = GUINT32_TO_LE(message_type);
+    message_header.opaque = GUINT64_TO_LE(message_opaque);
+    message_header.size = GUINT32_TO_LE(data_size);
+    vdagent_virtio_port_message_append(msg, (const uint8_t *)&message_header,
+                                       sizeof(message_header));
+    return msg;
+}
+
+int vdagent_virtio_port_message_append(VirtioPortMessage *msg,
+                                       const uint8_t *data, uint32_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    if (msg->payload_size - msg->payload_pos < size) {
+        syslog(LOG_ERR, "can't append to full message");
+        return -1;
+    }
+
+    if (msg->tail == NULL) {
+        msg->tail = g_byte_array_sized_new(MIN(msg->payload_size - msg->payload_pos,
+                                               CHUNK_SIZE));
+    }
+    g_byte_array_append(msg->tail, data, size);
+    msg->payload_pos += size;
+    return 0;
+}
+
+int vdagent_virtio_port_message_append_bytes(VirtioPortMessage *msg,
+                                             GBytes *bytes)
+{
+    gsize size = g_bytes_get_size(bytes);
+
+    if (size == 0) {
+        return 0;
+    }
+    if (msg->payload_size - msg->payload_pos < size) {
+        syslog(LOG_ERR, "can't append to full message");
+        return -1;
+    }
+
+    message_flush_tail(msg);
+    g_queue_push_tail(&msg->segments, g_bytes_ref(bytes));
+    msg->payload_pos += size;
+    return 0;
+}
+
+void vdagent_virtio_port_message_set_selection(VirtioPortMessage *msg,
+                                               uint8_t selection)
+{
+    msg->selection = selection;
+}
+
+int vdagent_virtio_port_message_commit(VirtioPortMessage *msg)
+{
+    VirtioPort *vport = msg->vport;
+    GQueue *messages;
+
+    if (msg->payload_pos != msg->payload_size) {
+        syslog(LOG_ERR, "can't commit incomplete message, discarding it");
+        message_free(msg);
+        return -1;
+    }
+    message_flush_tail(msg);
+
+    if (vport->batch) {
+        g_queue_push_tail(vport->batch, msg);
+        return 0;
+    }
+    messages = g_queue_new();
+    g_queue_push_tail(messages, msg);
+    schedule_messages(vport, messages);
+    return 0;
+}
+
+void vdagent_virtio_port_begin_batch(VirtioPort *vport)
+{
+    if (vport->batch_depth++ == 0) {
+        vport->batch = g_queue_new();
+    }
+}
+
+void vdagent_virtio_port_end_batch(VirtioPort *vport)
+{
+    GQueue *messages;
 
-    g_return_if_fail(vport->write_buf.buf == NULL);
+    g_return_if_fail(vport->batch_depth > 0);
 
-    new_wbuf = &vport->write_buf;
-    new_wbuf->write_pos = 0;
-    new_wbuf->size = sizeof(*chunk_header) + sizeof(*message_header) + data_size;
-    new_wbuf->buf = g_malloc(new_wbuf->size);
+    if (--vport->batch_depth > 0) {
+        return;
+    }
+    messages = g_steal_pointer(&vport->batch);
+    if (g_queue_is_empty(messages)) {
+        g_queue_free(messages);
+        return;
+    }
+    schedule_messages(vport, messages);
+}
 
-    chunk_header = (VDIChunkHeader *) (new_wbuf->buf + new_wbuf->write_pos);
-    chunk_header->port = GUINT32_TO_LE(port_nr);
-    chunk_header->size = GUINT32_TO_LE(sizeof(*message_header) + data_size);
-    new_wbuf->write_pos += sizeof(*chunk_header);
+void vdagent_virtio_port_write_start(
+        VirtioPort *vport,
+        uint32_t port_nr,
+        uint32_t message_type,
+        uint32_t message_opaque,
+        uint32_t data_size)
+{
+    g_return_if_fail(vport->write_msg == NULL);
 
-    message_header = (VDAgentMessage *) (new_wbuf->buf + new_wbuf->write_pos);
-    message_header->protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL);
-    message_header->type = GUINT32_TO_LE(message_type);
-    message_header->opaque = GUINT64_TO_LE(message_opaque);
-    message_header->size = GUINT32_TO_LE(data_size);
-    new_wbuf->write_pos += sizeof(*message_header);
+    vport->write_msg = vdagent_virtio_port_message_start(vport, port_nr,
+        message_type, message_opaque, data_size);
+    if (vport->write_msg && data_size == 0) {
+        vdagent_virtio_port_message_commit(g_steal_pointer(&vport->write_msg));
+    }
 }
 
 int vdagent_virtio_port_write_append(VirtioPort *vport,
                                      const uint8_t *data, uint32_t size)
 {
-    struct vdagent_virtio_port_buf *wbuf;
+    VirtioPortMessage *msg = vport->write_msg;
 
     if (size == 0) {
         return 0;
     }
 
-    wbuf = &vport->write_buf;
-    if (!wbuf->buf) {
+    if (!msg) {
         syslog(LOG_ERR, "can't append without a buffer");
         return -1;
     }
 
-    if (wbuf->size - wbuf->write_pos < size) {
-        syslog(LOG_ERR, "can't append to full buffer");
+    if (vdagent_virtio_port_message_append(msg, data, size) < 0) {
         return -1;
     }
 
-    memcpy(wbuf->buf + wbuf->write_pos, data, size);
-    wbuf->write_pos += size;
-
-    if (wbuf->write_pos == wbuf->size) {
-        vdagent_connection_write(VDAGENT_CONNECTION(vport), wbuf->buf, wbuf->size);
-        wbuf->buf = NULL;
+    if (msg->payload_pos == msg->payload_size) {
+        vport->write_msg = NULL;
+        vdagent_virtio_port_message_commit(msg);
     }
     return 0;
 }
@@ -247,23 +1008,108 @@ void vdagent_virtio_port_write(
     vdagent_virtio_port_write_append(vport, data, data_size);
 }
 
-void vdagent_virtio_port_reset(VirtioPort *vport, int port)
+/* Runs in the I/O context, passes on @size bytes of a streamed message,
+ * or with @data NULL, tells the rest of it has been lost */
+static void stream_fragment(VirtioPort *vport, int port_nr,
+                            struct vdagent_virtio_port_chunk_port_data *port,
+                            const uint8_t *data, uint32_t size)
 {
-    if (port >= VDP_END_PORT) {
-        syslog(LOG_ERR, "vdagent_virtio_port_reset port out of range");
+    uint8_t *copy;
+
+    if (vport->ring == NULL) {
+        deliver_fragment(vport, port_nr, &port->message_header,
+                         port->message_data_pos, data, size);
         return;
     }
-    g_free(vport->port_data[port].message_data);
-    memset(&vport->port_data[port], 0, sizeof(vport->port_data[0]));
+
+    /* the chunk is only valid until this returns */
+    copy = NULL;
+    if (data) {
+        copy = vdagent_connection_buffer_alloc(VDAGENT_CONNECTION(vport), size);
+        memcpy(copy, data, size);
+    }
+    queue_message(vport, port_nr, &port->message_header, copy,
+                  TRUE, port->message_data_pos, size);
 }
 
-static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
-                                         gpointer header_data,
-                                         gpointer chunk_data)
+/* Runs in the I/O context between chunks, so no body read is pending
+ * into the message data of @port_nr when it gets freed */
+static void reset_port(VirtioPort *vport, int port_nr)
+{
+    struct vdagent_virtio_port_chunk_port_data *port = &vport->port_data[port_nr];
+
+    if (port->streaming && port->message_data_pos > 0) {
+        stream_fragment(vport, port_nr, port, NULL, 0);
+    }
+    /* the arena is kept for the next messages */
+    port_data_free(vport, port, port->message_data);
+    port_message_done(port);
+}
+
+gint64 vdagent_virtio_port_get_message_time(VirtioPort *vport)
+{
+    return vport->message_time;
+}
+
+void vdagent_virtio_port_set_arena_limit(VirtioPort *vport, gsize limit)
+{
+    g_atomic_int_set(&vport->arena_limit, MIN(limit, G_MAXINT));
+}
+
+void vdagent_virtio_port_stream_messages(VirtioPort *vport,
+    uint32_t message_type,
+    uint32_t min_size,
+    vdagent_virtio_port_fragment_callback fragment_callback)
+{
+    g_return_if_fail(message_type < VD_AGENT_END_MESSAGE);
+
+    vport->fragment_callback = fragment_callback;
+    g_atomic_int_set(&vport->stream_min_size[message_type], min_size);
+}
+
+void vdagent_virtio_port_get_resync_stats(VirtioPort            *vport,
+                                          VirtioPortResyncStats *stats)
+{
+    g_mutex_lock(&vport->stats_lock);
+    *stats = vport->resync_stats;
+    g_mutex_unlock(&vport->stats_lock);
+}
+
+/* Runs in the I/O context, drops the partial message on @port after a
+ * framing error, leaving the other ports and the connection alone */
+static void port_resync(VirtioPort *vport, int port_nr,
+                        struct vdagent_virtio_port_chunk_port_data *port,
+                        const char *reason, uint32_t chunk_size)
+{
+    gboolean partial = port->message_header_read > 0;
+
+    if (port->streaming && port->message_data_pos > 0) {
+        /* the consumer got part of it already, let it know
+         * the rest isn't coming */
+        stream_fragment(vport, port_nr, port, NULL, 0);
+    }
+    port_data_free(vport, port, port->message_data);
+
+    g_mutex_lock(&vport->stats_lock);
+    vport->resync_stats.resyncs++;
+    if (partial) {
+        vport->resync_stats.messages_dropped++;
+    }
+    vport->resync_stats.bytes_dropped += port->message_header_read +
+                                         port->message_data_pos + chunk_size;
+    g_mutex_unlock(&vport->stats_lock);
+
+    syslog(LOG_WARNING, "vdagent virtio port %d: %s, resyncing", port_nr, reason);
+    port_message_done(port);
+}
+
+/* Parses a chunk, @resynced is TRUE if the partial message the chunk was
+ * supposed to continue has just been dropped, the chunk is then parsed as
+ * the start of a new message */
+static void do_chunk(VirtioPort *vport, VDIChunkHeader *chunk_header,
+                     uint8_t *chunk_data, gboolean resynced)
 {
     int avail, read, pos = 0;
-    VirtioPort *vport = VIRTIO_PORT(conn);
-    VDIChunkHeader *chunk_header = header_data;
     struct vdagent_virtio_port_chunk_port_data *port =
         &vport->port_data[chunk_header->port];
 
@@ -282,8 +1128,23 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
             port->message_header.opaque = GUINT64_FROM_LE(port->message_header.opaque);
             port->message_header.size = GUINT32_FROM_LE(port->message_header.size);
 
-            if (port->message_header.size) {
-                port->message_data = g_malloc(port->message_header.size);
+            if (port->message_header.protocol != VD_AGENT_PROTOCOL) {
+                /* not a message header, the rest of the chunk is
+                 * no use either */
+                port_resync(vport, chunk_header->port, port,
+                            "bad message header", chunk_header->size - read);
+                return;
+            }
+
+            if (port->message_header.type < VD_AGENT_END_MESSAGE) {
+                guint min_size = (guint)g_atomic_int_get(
+                    &vport->stream_min_size[port->message_header.type]);
+                port->streaming = min_size > 0 &&
+                                  port->message_header.size >= min_size;
+            }
+            if (port->message_header.size && !port->streaming) {
+                port->message_data =
+                    port_data_alloc(vport, port, port->message_header.size);
             }
         }
         pos = read;
@@ -294,29 +1155,81 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
         avail = chunk_header->size - pos;
 
         if (avail > read) {
-            GError *err = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
-                                      "chunk larger than message, lost sync?");
-            vport->error_cb(VDAGENT_CONNECTION(vport), err);
+            if (resynced || pos > 0) {
+                /* a new message can't be continued in another chunk */
+                port_resync(vport, chunk_header->port, port,
+                            "chunk larger than message", chunk_header->size);
+                return;
+            }
+            /* most likely the host gave up on the previous message and
+             * this chunk starts the next one */
+            port_resync(vport, chunk_header->port, port,
+                        "chunk larger than message", 0);
+            do_chunk(vport, chunk_header, chunk_data, TRUE);
             return;
         }
 
         if (avail < read)
             read = avail;
 
-        if (read) {
-            memcpy(port->message_data + port->message_data_pos,
-                   chunk_data + pos, read);
+        if (read && port->streaming) {
+            /* conn_get_body_vectors() doesn't handle streamed messages,
+             * so @chunk_data is always set */
+            stream_fragment(vport, chunk_header->port, port,
+                            chunk_data + pos, read);
+            port->message_data_pos += read;
+        } else if (read) {
+            /* without @chunk_data, conn_get_body_vectors() placed
+             * the chunk into message_data already */
+            if (chunk_data) {
+                memcpy(port->message_data + port->message_data_pos,
+                       chunk_data + pos, read);
+            }
             port->message_data_pos += read;
         }
 
         if (port->message_data_pos == port->message_header.size) {
-            if (vport->read_callback) {
-                vport->read_callback(vport, chunk_header->port,
-                                     &port->message_header, port->message_data);
+            if (chunk_header->port == VDP_SERVER_PORT &&
+                port->message_header.type == VD_AGENT_CLIENT_DISCONNECTED) {
+                /* the rest of the partial message of the old client won't
+                 * come, and the chunks of the next one follow this chunk */
+                reset_port(vport, VDP_CLIENT_PORT);
+            }
+            if (port->streaming) {
+                /* the last fragment has been passed on already */
+            } else if (vport->ring) {
+                queue_message(vport, chunk_header->port,
+                              &port->message_header, port->message_data,
+                              FALSE, 0, 0);
+            } else {
+                if (vport->read_callback) {
+                    vport->message_time = g_get_monotonic_time();
+                    vport->read_callback(vport, chunk_header->port,
+                                         &port->message_header, port->message_data);
+                }
+                port_data_free(vport, port, port->message_data);
             }
-            port->message_header_read = 0;
-            port->message_data_pos = 0;
-            g_clear_pointer(&port->message_data, g_free);
+            port_message_done(port);
+            port_arena_decay(vport, port);
         }
     }
 }
+
+static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
+                                         gpointer header_data,
+                                         gpointer chunk_data)
+{
+    VirtioPort *vport = VIRTIO_PORT(conn);
+    VDIChunkHeader *chunk_header = header_data;
+
+    if (chunk_header->port >= VDP_END_PORT) {
+        g_mutex_lock(&vport->stats_lock);
+        vport->resync_stats.resyncs++;
+        vport->resync_stats.bytes_dropped += chunk_header->size;
+        g_mutex_unlock(&vport->stats_lock);
+        syslog(LOG_WARNING, "vdagent virtio chunk port %u out of range, skipped",
+               chunk_header->port);
+        return;
+    }
+    do_chunk(vport, chunk_header, chunk_data, FALSE);
+}
@@ -40,12 +40,76 @@ typedef void (*vdagent_virtio_port_read_callback)(
     VDAgentMessage *message_header,
     uint8_t *data);
 
+/* Callbacks with this type will be called for every part of a streamed
+   message as it arrives, in order, offset being the position of data
+   within the message data. Returning FALSE discards the rest of the
+   message. If the rest of the message is lost, because of a framing error
+   or because a VD_AGENT_CLIENT_DISCONNECTED message on the server port
+   dropped the partial message of the client port, the callback is called
+   a last time with data set to NULL. */
+typedef gboolean (*vdagent_virtio_port_fragment_callback)(
+    VirtioPort *vport,
+    int port_nr,
+    VDAgentMessage *message_header,
+    uint32_t offset,
+    const uint8_t *data,
+    uint32_t size);
+
 /* Create a vdagent virtio port object for port portname */
 VirtioPort *vdagent_virtio_port_create(const char *portname,
     vdagent_virtio_port_read_callback read_callback,
     VDAgentConnErrorCb error_cb);
 
-/* Queue a message for delivery, either bit by bit, or all at once */
+/* Like vdagent_virtio_port_create(), but if @io_thread is TRUE, reading,
+ * chunk reassembly and writing happen in a dedicated thread.
+ * The callbacks are still invoked from the calling thread's main context. */
+VirtioPort *vdagent_virtio_port_create_full(const char *portname,
+    vdagent_virtio_port_read_callback read_callback,
+    VDAgentConnErrorCb error_cb,
+    gboolean io_thread);
+
+typedef struct _VirtioPortMessage VirtioPortMessage;
+
+/* Start building a message with @data_size bytes of data for @port_nr.
+ *
+ * Any number of messages may be built at the same time, they are queued
+ * for delivery in the order they're committed. */
+VirtioPortMessage *vdagent_virtio_port_message_start(
+        VirtioPort *vport,
+        uint32_t port_nr,
+        uint32_t message_type,
+        uint32_t message_opaque,
+        uint32_t data_size);
+
+/* Append a copy of @data to @msg. */
+int vdagent_virtio_port_message_append(
+        VirtioPortMessage *msg,
+        const uint8_t *data,
+        uint32_t size);
+
+/* Append @bytes to @msg without copying, a reference is kept until
+ * the data has been written. */
+int vdagent_virtio_port_message_append_bytes(
+        VirtioPortMessage *msg,
+        GBytes *bytes);
+
+/* Set the clipboard selection @msg, a clipboard message, is about.
+ * Grabs and releases are written before queued bulk data, except for
+ * clipboard data of their selection, or of any if it isn't set. */
+void vdagent_virtio_port_message_set_selection(
+        VirtioPortMessage *msg,
+        uint8_t selection);
+
+/* Queue @msg for delivery, @msg must not be used afterwards.
+ * If less than its data_size was appended, @msg is discarded
+ * and -1 is returned. */
+int vdagent_virtio_port_message_commit(VirtioPortMessage *msg);
+
+/* Queue a message for delivery, either bit by bit, or all at once.
+ *
+ * Messages are split into chunks of at most VD_AGENT_MAX_DATA_SIZE bytes.
+ * The chunks of messages on different ports are written in turns, and
+ * on each port interactive messages go before queued bulk ones. */
 void vdagent_virtio_port_write_start(
         VirtioPort *vport,
         uint32_t port_nr,
@@ -66,7 +130,45 @@ void vdagent_virtio_port_write(
         const uint8_t *data,
         uint32_t data_size);
 
-void vdagent_virtio_port_reset(VirtioPort *vport, int port);
+/* Messages committed between these calls are queued together when the
+ * outermost batch ends, and their chunks are packed into as few writes
+ * as possible. Batches may be nested. */
+void vdagent_virtio_port_begin_batch(VirtioPort *vport);
+void vdagent_virtio_port_end_batch(VirtioPort *vport);
+
+/* Framing errors that leave the next chunk header to be found, such as a
+ * chunk larger than the rest of its message, only drop the partial message
+ * of the affected port instead of failing the whole connection. */
+typedef struct {
+    guint64 resyncs;          /* framing errors recovered from */
+    guint64 messages_dropped; /* partial messages discarded */
+    guint64 bytes_dropped;    /* of those messages and of skipped chunks */
+} VirtioPortResyncStats;
+
+void vdagent_virtio_port_get_resync_stats(VirtioPort            *vport,
+                                          VirtioPortResyncStats *stats);
+
+/* Returns the monotonic time at which the last chunk of the message being
+ * passed to the read callback was read, may be called from that callback.
+ * With an I/O thread, this is earlier than the callback by the time the
+ * message waited to be delivered to the main context. */
+gint64 vdagent_virtio_port_get_message_time(VirtioPort *vport);
+
+/* Incoming messages with up to @limit bytes of data are assembled in a
+ * buffer kept per port, which grows up to @limit and shrinks again when
+ * it was mostly unused for a while. Larger messages get a buffer of
+ * their own. Defaults to 64 KiB. */
+void vdagent_virtio_port_set_arena_limit(VirtioPort *vport, gsize limit);
+
+/* Pass messages of @message_type carrying at least @min_size bytes of data
+ * to @fragment_callback piece by piece as their chunks arrive, instead of
+ * assembling them and passing them to the read callback.
+ * A @min_size of 0 turns streaming of @message_type off again.
+ * All streamed types share the last @fragment_callback set. */
+void vdagent_virtio_port_stream_messages(VirtioPort *vport,
+    uint32_t message_type,
+    uint32_t min_size,
+    vdagent_virtio_port_fragment_callback fragment_callback);
 
 G_END_DECLS
 
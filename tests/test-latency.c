@@ -0,0 +1,125 @@
+/*  test-latency.c  - test the vdagentd latency histograms
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <glib.h>
+
+#include "latency.h"
+
+#define LAST_BUCKET_END ((G_GUINT64_CONSTANT(1) << VDAGENTD_LATENCY_MAX_BITS) - 1)
+
+/* Returns the end of the bucket @usec is counted in */
+static gint64 bucket_end(gint64 usec)
+{
+    struct vdagentd_latency latency = { 0 };
+
+    /* with a larger value recorded, the median is the end of the bucket
+     * rather than the maximum */
+    vdagentd_latency_record(&latency, usec);
+    vdagentd_latency_record(&latency, G_MAXINT64);
+    return vdagentd_latency_percentile(&latency, 50);
+}
+
+static void check_bucket(gint64 usec)
+{
+    gint64 end = bucket_end(usec);
+
+    g_assert_cmpint(end, >=, usec);
+    /* within 1/2^SUB_BITS of the value */
+    g_assert_cmpint(end - usec, <, MAX(usec >> VDAGENTD_LATENCY_SUB_BITS, 1));
+    /* the end belongs to the bucket, the next value to the next one */
+    g_assert_cmpint(bucket_end(end), ==, end);
+    g_assert_cmpint(bucket_end(end + 1), >, end);
+}
+
+static void test_buckets(void)
+{
+    gint64 usec;
+    guint bit;
+
+    // values below 2^SUB_BITS are counted exactly
+    for (usec = 0; usec < (1 << VDAGENTD_LATENCY_SUB_BITS); usec++) {
+        g_assert_cmpint(bucket_end(usec), ==, usec);
+    }
+
+    // around every power of two
+    for (bit = VDAGENTD_LATENCY_SUB_BITS; bit < VDAGENTD_LATENCY_MAX_BITS; bit++) {
+        usec = G_GINT64_CONSTANT(1) << bit;
+        check_bucket(usec - 1);
+        check_bucket(usec);
+        check_bucket(usec + 1);
+    }
+
+    // and in between
+    for (usec = 1; usec < (G_GINT64_CONSTANT(1) << VDAGENTD_LATENCY_MAX_BITS) - 1;
+         usec += usec / 7 + 1) {
+        check_bucket(usec);
+    }
+
+    // the last bucket takes everything larger
+    g_assert_cmpint(bucket_end(LAST_BUCKET_END), ==, LAST_BUCKET_END);
+    g_assert_cmpint(bucket_end(LAST_BUCKET_END + 1), ==, LAST_BUCKET_END);
+    g_assert_cmpint(bucket_end(G_GINT64_CONSTANT(1) << 40), ==, LAST_BUCKET_END);
+}
+
+static void test_percentiles(void)
+{
+    struct vdagentd_latency latency = { 0 };
+    gint64 usec;
+
+    // nothing recorded
+    g_assert_cmpint(vdagentd_latency_percentile(&latency, 50), ==, 0);
+
+    // negative latencies count as 0
+    vdagentd_latency_record(&latency, -5);
+    g_assert_cmpuint(latency.count, ==, 1);
+    g_assert_cmpint(latency.max, ==, 0);
+    g_assert_cmpint(vdagentd_latency_percentile(&latency, 100), ==, 0);
+
+    // 1 to 10000 us
+    latency = (struct vdagentd_latency) { 0 };
+    for (usec = 1; usec <= 10000; usec++) {
+        vdagentd_latency_record(&latency, usec);
+    }
+    g_assert_cmpuint(latency.count, ==, 10000);
+    g_assert_cmpuint(latency.sum / latency.count, ==, 5000);
+    g_assert_cmpint(latency.max, ==, 10000);
+    g_assert_cmpint(vdagentd_latency_percentile(&latency, 50), ==,
+                     MIN(bucket_end(5000), 10000));
+    g_assert_cmpint(vdagentd_latency_percentile(&latency, 90), ==,
+                     MIN(bucket_end(9000), 10000));
+    g_assert_cmpint(vdagentd_latency_percentile(&latency, 99), ==,
+                     MIN(bucket_end(9900), 10000));
+    g_assert_cmpint(vdagentd_latency_percentile(&latency, 0), ==, 1);
+    // not beyond the largest value recorded
+    g_assert_cmpint(vdagentd_latency_percentile(&latency, 99.99), ==, 10000);
+    g_assert_cmpint(vdagentd_latency_percentile(&latency, 100), ==, 10000);
+}
+
+int main(int argc, char *argv[])
+{
+    // bucket boundaries and resolution
+    test_buckets();
+
+    // percentiles of recorded latencies
+    test_percentiles();
+
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*  test-mouse-coalesce.c  - test merging of client mouse states
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <glib.h>
+
+#include "mouse-coalesce.h"
+
+#define MAX_STALENESS (10 * G_TIME_SPAN_MILLISECOND)
+
+static gboolean can_coalesce(uint32_t last_buttons,
+                             uint32_t pending_buttons, uint8_t pending_display,
+                             uint32_t next_buttons, uint8_t next_display,
+                             gint64 age)
+{
+    VDAgentMouseState pending = {
+        .x = 10, .y = 20,
+        .buttons = pending_buttons,
+        .display_id = pending_display,
+    };
+    VDAgentMouseState next = {
+        .x = 30, .y = 40,
+        .buttons = next_buttons,
+        .display_id = next_display,
+    };
+
+    return vdagentd_mouse_can_coalesce(&pending, &next, last_buttons,
+                                       age, MAX_STALENESS);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint32_t left = VD_AGENT_LBUTTON_MASK;
+    const uint32_t up = VD_AGENT_UBUTTON_MASK;
+
+    // motion replaces motion, with or without a button held
+    g_assert_true(can_coalesce(0, 0, 0, 0, 0, 0));
+    g_assert_true(can_coalesce(left, left, 0, left, 0, 0));
+    g_assert_true(can_coalesce(0, 0, 3, 0, 3, MAX_STALENESS - 1));
+
+    // a press or release, wheel included, is never merged away
+    g_assert_false(can_coalesce(0, left, 0, left, 0, 0));
+    g_assert_false(can_coalesce(left, 0, 0, 0, 0, 0));
+    g_assert_false(can_coalesce(0, up, 0, up, 0, 0));
+
+    // nor replaced by a state changing the buttons
+    g_assert_false(can_coalesce(0, 0, 0, left, 0, 0));
+    g_assert_false(can_coalesce(left, left, 0, 0, 0, 0));
+    g_assert_false(can_coalesce(0, 0, 0, up, 0, 0));
+
+    // motion on another display
+    g_assert_false(can_coalesce(0, 0, 0, 0, 1, 0));
+
+    // the pending state is too old
+    g_assert_false(can_coalesce(0, 0, 0, 0, 0, MAX_STALENESS));
+    g_assert_false(can_coalesce(0, 0, 0, 0, 0, G_MAXINT64));
+
+    return 0;
+}
@@ -0,0 +1,366 @@
+/*  test-udscs.c  - test udscs message passing
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "udscs.h"
+#include "vdagentd-proto.h"
+
+#define N_CLIENTS 3
+
+/* Larger than the socket buffers, so the writes are still pending
+ * when the call returns */
+#define LARGE_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    UdscsConnection *conn;
+    /* the server side of the connection */
+    UdscsConnection *server_conn;
+    /* arg1 of the messages received, in order */
+    GArray *received;
+    /* and their types */
+    GArray *types;
+    gboolean closed;
+} TestClient;
+
+static TestClient clients[N_CLIENTS];
+static UdscsConnection *accepted;
+static gchar *socket_dir;
+static gchar *socket_path;
+
+static TestClient *find_client(UdscsConnection *conn)
+{
+    guint i;
+
+    for (i = 0; i < N_CLIENTS; i++) {
+        if (clients[i].conn == conn) {
+            return &clients[i];
+        }
+    }
+    g_assert_not_reached();
+}
+
+static gboolean bytes_freed;
+
+/* Message data is filled with the low byte of arg1 */
+static uint8_t *make_data(uint32_t arg1, gsize size)
+{
+    uint8_t *data = g_malloc(size);
+
+    memset(data, arg1 & 0xff, size);
+    return data;
+}
+
+static void client_read_cb(UdscsConnection *conn,
+                           struct udscs_message_header *header,
+                           uint8_t *data)
+{
+    TestClient *client = find_client(conn);
+    uint32_t i;
+
+    switch (header->type) {
+    case VDAGENTD_CLIPBOARD_DATA:
+    case VDAGENTD_FILE_XFER_DATA:
+        g_assert_cmpuint(header->arg2, ==, header->size);
+        for (i = 0; i < header->size; i++) {
+            g_assert_cmpuint(data[i], ==, header->arg1 & 0xff);
+        }
+        break;
+    case VDAGENTD_CLIPBOARD_GRAB:
+    case VDAGENTD_CLIPBOARD_RELEASE:
+        g_assert_cmpuint(header->size, ==, 0);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    g_array_append_val(client->received, header->arg1);
+    g_array_append_val(client->types, header->type);
+}
+
+static void client_error_cb(VDAgentConnection *conn, GError *err)
+{
+    /* the server closed the connection */
+    g_assert_null(err);
+    find_client(UDSCS_CONNECTION(conn))->closed = TRUE;
+}
+
+static void server_connect_cb(UdscsConnection *conn)
+{
+    accepted = conn;
+}
+
+static void server_read_cb(UdscsConnection *conn,
+                           struct udscs_message_header *header,
+                           uint8_t *data)
+{
+    g_assert_not_reached();
+}
+
+static void server_error_cb(VDAgentConnection *conn, GError *err)
+{
+    g_assert_not_reached();
+}
+
+static gboolean even_clients(UdscsConnection *conn, void *priv)
+{
+    guint i;
+
+    g_assert_cmpstr(priv, ==, "priv");
+    for (i = 0; i < N_CLIENTS; i += 2) {
+        if (clients[i].server_conn == conn) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Send @size bytes with @arg1 to the clients even_clients() matches */
+static void write_matching(struct udscs_server *server, uint32_t arg1, gsize size)
+{
+    uint8_t *data = make_data(arg1, size);
+
+    udscs_server_write_matching(server, even_clients, "priv",
+                                VDAGENTD_CLIPBOARD_DATA, arg1, size, data, size);
+    /* the message has been copied */
+    memset(data, 0xff, size);
+    g_free(data);
+}
+
+static void wait_received(TestClient *client, guint n_messages)
+{
+    while (client->received->len < n_messages && !client->closed) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_cmpuint(client->received->len, ==, n_messages);
+}
+
+/* Start a server with N_CLIENTS clients connected */
+static struct udscs_server *test_server_new(void)
+{
+    struct udscs_server *server;
+    GError *err = NULL;
+    guint i;
+
+    socket_dir = g_dir_make_tmp("test-udscs-XXXXXX", NULL);
+    g_assert_nonnull(socket_dir);
+    socket_path = g_build_filename(socket_dir, "socket", NULL);
+
+    server = udscs_server_new(server_connect_cb, server_read_cb,
+                              server_error_cb, 0);
+    udscs_server_listen_to_address(server, socket_path, &err);
+    g_assert_no_error(err);
+    udscs_server_start(server);
+
+    for (i = 0; i < N_CLIENTS; i++) {
+        clients[i].received = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+        clients[i].types = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+        clients[i].closed = FALSE;
+        clients[i].conn = udscs_connect(socket_path, client_read_cb,
+                                        client_error_cb, 0, &err);
+        g_assert_no_error(err);
+        accepted = NULL;
+        while (accepted == NULL) {
+            g_main_context_iteration(NULL, TRUE);
+        }
+        clients[i].server_conn = accepted;
+    }
+    return server;
+}
+
+static void test_server_free(struct udscs_server *server)
+{
+    guint i;
+
+    udscs_destroy_server(server);
+    for (i = 0; i < N_CLIENTS; i++) {
+        vdagent_connection_destroy(clients[i].conn);
+        g_array_unref(clients[i].received);
+        g_array_unref(clients[i].types);
+    }
+    g_unlink(socket_path);
+    g_rmdir(socket_dir);
+    g_clear_pointer(&socket_path, g_free);
+    g_clear_pointer(&socket_dir, g_free);
+}
+
+/* A message written to the matching clients reaches them and only them,
+ * the copy they share lives until the last write is done */
+static void test_write_matching(void)
+{
+    struct udscs_server *server = test_server_new();
+    uint8_t *data;
+
+    write_matching(server, 1, 100);
+    write_matching(server, 2, LARGE_SIZE);
+    wait_received(&clients[0], 2);
+    wait_received(&clients[2], 2);
+    g_assert_cmpuint(g_array_index(clients[0].received, uint32_t, 0), ==, 1);
+    g_assert_cmpuint(g_array_index(clients[0].received, uint32_t, 1), ==, 2);
+
+    /* the first message client 1 gets is the one sent to everyone */
+    data = make_data(3, 100);
+    udscs_server_write_all(server, VDAGENTD_CLIPBOARD_DATA, 3, 100, data, 100);
+    g_free(data);
+    wait_received(&clients[1], 1);
+    g_assert_cmpuint(g_array_index(clients[1].received, uint32_t, 0), ==, 3);
+
+    /* the connection of client 0 goes away in the middle of the write,
+     * client 2 still gets the whole message */
+    write_matching(server, 4, LARGE_SIZE);
+    udscs_server_destroy_connection(server, clients[0].server_conn);
+    wait_received(&clients[2], 4);
+    g_assert_cmpuint(g_array_index(clients[2].received, uint32_t, 3), ==, 4);
+    while (!clients[0].closed) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    /* whether the message sent to everyone made it before is up to timing */
+    g_assert_cmpuint(clients[0].received->len, <=, 3);
+
+    test_server_free(server);
+}
+
+static void bytes_freed_cb(gpointer data)
+{
+    g_free(data);
+    bytes_freed = TRUE;
+}
+
+/* Payloads smaller than 1 KiB are copied, larger ones are referenced
+ * until they have been written */
+static void test_write_bytes(void)
+{
+    static const gsize sizes[] = { 0, 100, 1023, 1024, 64 * 1024, LARGE_SIZE };
+    struct udscs_server *server = test_server_new();
+    TestClient *client = &clients[1];
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+        GBytes *bytes = NULL;
+
+        bytes_freed = FALSE;
+        if (sizes[i] > 0) {
+            bytes = g_bytes_new_with_free_func(make_data(i, sizes[i]), sizes[i],
+                                               bytes_freed_cb, NULL);
+        }
+        udscs_write_bytes(client->server_conn, VDAGENTD_CLIPBOARD_DATA,
+                          i, sizes[i], bytes);
+        if (bytes == NULL) {
+            wait_received(client, i + 1);
+            continue;
+        }
+        g_bytes_unref(bytes);
+        g_assert_cmpint(bytes_freed, ==, sizes[i] < 1024);
+
+        wait_received(client, i + 1);
+        g_assert_cmpuint(g_array_index(client->received, uint32_t, i), ==, i);
+        while (!bytes_freed) {
+            g_main_context_iteration(NULL, TRUE);
+        }
+    }
+
+    test_server_free(server);
+}
+
+/* Write @size bytes of @type with @arg1 to @client */
+static void write_large(TestClient *client, uint32_t type, uint32_t arg1, gsize size)
+{
+    uint8_t *data = make_data(arg1, size);
+
+    udscs_write(client->server_conn, type, arg1, size, data, size);
+    g_free(data);
+}
+
+/* Position of the message of @type with @arg1 among those @client received */
+static guint received_index(TestClient *client, uint32_t type, uint32_t arg1)
+{
+    guint i;
+
+    for (i = 0; i < client->received->len; i++) {
+        if (g_array_index(client->types, uint32_t, i) == type &&
+            g_array_index(client->received, uint32_t, i) == arg1) {
+            return i;
+        }
+    }
+    g_assert_not_reached();
+}
+
+/* Grabs and releases overtake bulk data, but not the clipboard data
+ * of their own selection queued before them. Every case starts with
+ * a file transfer, as a message whose write has started, which io_uring
+ * does right away, isn't overtaken */
+static void test_clipboard_order(void)
+{
+    struct udscs_server *server = test_server_new();
+    TestClient *client = &clients[0];
+
+    /* a grab doesn't wait for a file transfer */
+    write_large(client, VDAGENTD_FILE_XFER_DATA, 1, LARGE_SIZE);
+    write_large(client, VDAGENTD_FILE_XFER_DATA, 2, LARGE_SIZE);
+    udscs_write(client->server_conn, VDAGENTD_CLIPBOARD_GRAB, 1, 0, NULL, 0);
+    wait_received(client, 3);
+    g_assert_cmpuint(received_index(client, VDAGENTD_CLIPBOARD_GRAB, 1), <,
+                     received_index(client, VDAGENTD_FILE_XFER_DATA, 2));
+
+    /* nor for the data of another selection */
+    write_large(client, VDAGENTD_FILE_XFER_DATA, 3, LARGE_SIZE);
+    write_large(client, VDAGENTD_CLIPBOARD_DATA, 1, LARGE_SIZE);
+    udscs_write(client->server_conn, VDAGENTD_CLIPBOARD_GRAB, 2, 0, NULL, 0);
+    wait_received(client, 6);
+    g_assert_cmpuint(received_index(client, VDAGENTD_CLIPBOARD_GRAB, 2), <,
+                     received_index(client, VDAGENTD_CLIPBOARD_DATA, 1));
+
+    /* a release of the selection follows its data */
+    write_large(client, VDAGENTD_FILE_XFER_DATA, 4, LARGE_SIZE);
+    write_large(client, VDAGENTD_CLIPBOARD_DATA, 3, LARGE_SIZE);
+    udscs_write(client->server_conn, VDAGENTD_CLIPBOARD_RELEASE, 3, 0, NULL, 0);
+    wait_received(client, 9);
+    g_assert_cmpuint(received_index(client, VDAGENTD_CLIPBOARD_DATA, 3), <,
+                     received_index(client, VDAGENTD_CLIPBOARD_RELEASE, 3));
+
+    /* once the data has been written, a grab of it goes first again */
+    write_large(client, VDAGENTD_FILE_XFER_DATA, 5, LARGE_SIZE);
+    write_large(client, VDAGENTD_FILE_XFER_DATA, 6, LARGE_SIZE);
+    udscs_write(client->server_conn, VDAGENTD_CLIPBOARD_GRAB, 3, 0, NULL, 0);
+    wait_received(client, 12);
+    g_assert_cmpuint(received_index(client, VDAGENTD_CLIPBOARD_GRAB, 3), <,
+                     received_index(client, VDAGENTD_FILE_XFER_DATA, 6));
+
+    test_server_free(server);
+}
+
+int main(int argc, char *argv[])
+{
+    // broadcast to a subset of the clients
+    test_write_matching();
+
+    // payloads queued by reference or copied
+    test_write_bytes();
+
+    // clipboard messages keep their order
+    test_clipboard_order();
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*  test-uinput.c  - test mouse event translation
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <spice/vd_agent.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "uinput.h"
+
+#define N_HEADS 64
+
+/* The fake device writes the events to a file, read back from here */
+static int events_fd = -1;
+
+/* Moves the pointer on @display_id, returns whether an EV_SYN was written,
+ * and the position reported in @abs_x and @abs_y */
+static gboolean move(struct vdagentd_uinput **uinput, uint8_t display_id,
+                     uint32_t x, uint32_t y, int *abs_x, int *abs_y)
+{
+    VDAgentMouseState mouse = { .x = x, .y = y, .display_id = display_id };
+    struct input_event event;
+    gboolean syn = FALSE;
+    ssize_t res;
+
+    vdagentd_uinput_do_mouse(uinput, &mouse);
+    g_assert_nonnull(*uinput);
+    while ((res = read(events_fd, &event, sizeof(event))) == sizeof(event)) {
+        g_assert_false(syn);
+        if (event.type == EV_ABS && event.code == ABS_X) {
+            *abs_x = event.value;
+        } else if (event.type == EV_ABS && event.code == ABS_Y) {
+            *abs_y = event.value;
+        } else {
+            g_assert_cmpint(event.type, ==, EV_SYN);
+            syn = TRUE;
+        }
+    }
+    g_assert_cmpint(res, ==, 0);
+    return syn;
+}
+
+/* Positions are offset by the origin of their display, the table covers
+ * every display id a mouse state can carry, and screens with an id
+ * outside of it are left out */
+static void test_display_table(void)
+{
+    struct vdagentd_guest_xorg_resolution screens[N_HEADS + 2];
+    struct vdagentd_uinput *uinput;
+    gchar *path;
+    int fd, i, x = -1, y = -1;
+
+    fd = g_file_open_tmp("test-uinput-XXXXXX", &path, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    events_fd = g_open(path, O_RDONLY, 0);
+    g_assert_cmpint(events_fd, >=, 0);
+
+    /* out of range, they must not end up as display 0 */
+    screens[0] = (struct vdagentd_guest_xorg_resolution) {
+        .width = 100, .height = 100, .x = 9999, .y = 9999, .display_id = 256,
+    };
+    screens[1] = screens[0];
+    screens[1].display_id = -1;
+    for (i = 0; i < N_HEADS; i++) {
+        screens[i + 2] = (struct vdagentd_guest_xorg_resolution) {
+            .width = 100, .height = 100,
+            .x = 100 * i, .y = i,
+            /* sparse ids, up to the largest one */
+            .display_id = i == N_HEADS - 1 ? 255 : 2 * i,
+        };
+    }
+
+    uinput = vdagentd_uinput_create(path, 100 * N_HEADS, 100,
+                                    screens, G_N_ELEMENTS(screens), 0, TRUE);
+    g_assert_nonnull(uinput);
+
+    for (i = 0; i < N_HEADS; i++) {
+        g_assert_true(move(&uinput, screens[i + 2].display_id, 10, 20, &x, &y));
+        g_assert_cmpint(x, ==, 100 * i + 10);
+        g_assert_cmpint(y, ==, i + 20);
+    }
+
+    // ids without a screen are ignored
+    g_assert_false(move(&uinput, 1, 30, 40, &x, &y));
+    g_assert_false(move(&uinput, 254, 30, 40, &x, &y));
+
+    // the table is rebuilt with the new geometry
+    screens[2].x = 500;
+    vdagentd_uinput_update_size(&uinput, 100 * N_HEADS, 100, screens + 2, 1);
+    g_assert_true(move(&uinput, 0, 10, 20, &x, &y));
+    g_assert_cmpint(x, ==, 510);
+    g_assert_false(move(&uinput, 2, 10, 20, &x, &y));
+
+    vdagentd_uinput_destroy(&uinput);
+    close(events_fd);
+    g_unlink(path);
+    g_free(path);
+}
+
+int main(int argc, char *argv[])
+{
+    // 64 heads with sparse display ids
+    test_display_table();
+
+    return 0;
+}
@@ -0,0 +1,819 @@
+/*  test-vdagent-connection.c  - test VDAgentConnection transport
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "vdagent-connection.h"
+
+/* Minimal framing for the tests: a 32 bit body size followed by the body */
+typedef struct {
+    guint32 size;
+} TestHeader;
+
+#define TEST_TYPE_CONNECTION test_connection_get_type()
+G_DECLARE_FINAL_TYPE(TestConnection, test_connection, TEST, CONNECTION, VDAgentConnection)
+
+struct _TestConnection {
+    VDAgentConnection parent_instance;
+    GByteArray *received;
+    gint n_messages;
+    /* bodies are split in two halves by get_body_vectors() */
+    gboolean scatter;
+    guint8 *scatter_buf;
+    /* messages held back and queued from fill_write_queue() */
+    guint fill_next;
+    guint fill_end;
+    gsize fill_backlog;
+};
+
+G_DEFINE_TYPE(TestConnection, test_connection, VDAGENT_TYPE_CONNECTION)
+
+static gsize test_handle_header(VDAgentConnection *conn, gpointer header_buf)
+{
+    return ((TestHeader *)header_buf)->size;
+}
+
+static void test_handle_message(VDAgentConnection *conn,
+                                gpointer header_buf, gpointer data)
+{
+    TestConnection *self = TEST_CONNECTION(conn);
+    TestHeader *header = header_buf;
+
+    if (self->scatter && header->size > 0) {
+        g_assert_null(data);
+        data = self->scatter_buf;
+    }
+    g_byte_array_append(self->received, data, header->size);
+    g_clear_pointer(&self->scatter_buf, g_free);
+    g_atomic_int_inc(&self->n_messages);
+}
+
+static guint test_get_body_vectors(VDAgentConnection *conn,
+                                   gpointer header_buf, gsize size,
+                                   GInputVector *vectors)
+{
+    TestConnection *self = TEST_CONNECTION(conn);
+
+    if (!self->scatter) {
+        return 0;
+    }
+    self->scatter_buf = g_malloc(size);
+    vectors[0].buffer = self->scatter_buf;
+    vectors[0].size = size / 2;
+    vectors[1].buffer = self->scatter_buf + size / 2;
+    vectors[1].size = size - size / 2;
+    return 2;
+}
+
+/* Message @i of the sequence written by queue_messages() */
+static GBytes *make_message(guint i)
+{
+    guint32 size = i % 37;
+    guint8 *buf = g_malloc(sizeof(TestHeader) + size);
+
+    memcpy(buf, &size, sizeof(size));
+    memset(buf + sizeof(TestHeader), i & 0xff, size);
+    return g_bytes_new_take(buf, sizeof(TestHeader) + size);
+}
+
+static void test_fill_write_queue(VDAgentConnection *conn)
+{
+    TestConnection *self = TEST_CONNECTION(conn);
+
+    while (self->fill_next < self->fill_end &&
+           vdagent_connection_get_queued_bytes(conn) < 100) {
+        GBytes *msg = make_message(self->fill_next++);
+
+        self->fill_backlog -= g_bytes_get_size(msg);
+        vdagent_connection_write_bytes(conn, msg, VDAGENT_WRITE_PRIORITY_BULK);
+    }
+    vdagent_connection_set_write_backlog(conn, self->fill_backlog);
+}
+
+static void test_connection_init(TestConnection *self)
+{
+    self->received = g_byte_array_new();
+}
+
+static void test_connection_finalize(GObject *obj)
+{
+    TestConnection *self = TEST_CONNECTION(obj);
+
+    g_byte_array_unref(self->received);
+    g_free(self->scatter_buf);
+    G_OBJECT_CLASS(test_connection_parent_class)->finalize(obj);
+}
+
+static void test_connection_class_init(TestConnectionClass *klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    VDAgentConnectionClass *conn_class = VDAGENT_CONNECTION_CLASS(klass);
+
+    gobject_class->finalize = test_connection_finalize;
+    conn_class->handle_header = test_handle_header;
+    conn_class->handle_message = test_handle_message;
+    conn_class->get_body_vectors = test_get_body_vectors;
+    conn_class->fill_write_queue = test_fill_write_queue;
+}
+
+static void test_error_cb(VDAgentConnection *conn, GError *err)
+{
+    if (err) {
+        g_printerr("connection error: %s\n", err->message);
+        g_error_free(err);
+    }
+    g_assert_not_reached();
+}
+
+static GIOStream *stream_from_fd(int fd)
+{
+    GSocketConnection *conn;
+    GSocket *socket;
+
+    socket = g_socket_new_from_fd(fd, NULL);
+    g_assert_nonnull(socket);
+    conn = g_socket_connection_factory_create_connection(socket);
+    g_object_unref(socket);
+    return G_IO_STREAM(conn);
+}
+
+static TestConnection *test_connection_new_full(int fd, gsize read_buf_size)
+{
+    TestConnection *conn = g_object_new(TEST_TYPE_CONNECTION, NULL);
+
+    if (read_buf_size) {
+        vdagent_connection_set_read_buffer_size(VDAGENT_CONNECTION(conn),
+                                                read_buf_size);
+    }
+    vdagent_connection_setup(VDAGENT_CONNECTION(conn), stream_from_fd(fd),
+                             FALSE, sizeof(TestHeader), test_error_cb);
+    return conn;
+}
+
+static TestConnection *test_connection_new(int fd)
+{
+    return test_connection_new_full(fd, 0);
+}
+
+/* Queue @n_messages messages of increasing size, return the total size */
+static gsize queue_messages(TestConnection *conn, guint n_messages)
+{
+    gsize total = 0;
+    guint i;
+
+    for (i = 0; i < n_messages; i++) {
+        GBytes *msg = make_message(i);
+
+        total += g_bytes_get_size(msg);
+        vdagent_connection_write_bytes(VDAGENT_CONNECTION(conn), msg,
+                                       VDAGENT_WRITE_PRIORITY_BULK);
+    }
+    return total;
+}
+
+/* Read @total bytes from @fd and check they match queue_messages() */
+static void check_messages(int fd, guint n_messages, gsize total)
+{
+    guint8 *buf = g_malloc(total), *p;
+    gsize pos = 0;
+    guint i;
+
+    while (pos < total) {
+        ssize_t res = read(fd, buf + pos, total - pos);
+        g_assert_cmpint(res, >, 0);
+        pos += res;
+    }
+
+    p = buf;
+    for (i = 0; i < n_messages; i++) {
+        guint32 size;
+        guint32 j;
+
+        memcpy(&size, p, sizeof(size));
+        g_assert_cmpuint(size, ==, i % 37);
+        p += sizeof(TestHeader);
+        for (j = 0; j < size; j++) {
+            g_assert_cmpuint(p[j], ==, i & 0xff);
+        }
+        p += size;
+    }
+    g_free(buf);
+}
+
+static void test_gather_write(guint max_vectors, gsize max_bytes)
+{
+    TestConnection *conn;
+    int fds[2];
+    gsize total;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new(fds[0]);
+    vdagent_connection_set_write_budget(VDAGENT_CONNECTION(conn),
+                                        max_vectors, max_bytes);
+
+    total = queue_messages(conn, 200);
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+    check_messages(fds[1], 200, total);
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+}
+
+static void write_message(TestConnection *conn, guint32 size, guint8 fill,
+                          VDAgentWritePriority priority)
+{
+    guint8 *buf = g_malloc(sizeof(TestHeader) + size);
+
+    memcpy(buf, &size, sizeof(size));
+    memset(buf + sizeof(TestHeader), fill, size);
+    vdagent_connection_write_with_priority(VDAGENT_CONNECTION(conn),
+                                           buf, sizeof(TestHeader) + size,
+                                           priority);
+}
+
+/* Interactive messages overtake bulk ones queued before them,
+ * the order within each lane is kept */
+static void test_priority_lanes(void)
+{
+    static const guint8 expected[] = { 'i', 'j', 'a', 'b', 'c' };
+    TestConnection *conn;
+    guint8 buf[sizeof(TestHeader) + 1000];
+    int fds[2];
+    guint i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new(fds[0]);
+
+    write_message(conn, 1000, 'a', VDAGENT_WRITE_PRIORITY_BULK);
+    write_message(conn, 1000, 'b', VDAGENT_WRITE_PRIORITY_BULK);
+    write_message(conn, 10, 'i', VDAGENT_WRITE_PRIORITY_INTERACTIVE);
+    write_message(conn, 1000, 'c', VDAGENT_WRITE_PRIORITY_BULK);
+    write_message(conn, 10, 'j', VDAGENT_WRITE_PRIORITY_INTERACTIVE);
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+
+    for (i = 0; i < G_N_ELEMENTS(expected); i++) {
+        guint32 size = expected[i] < 'i' ? 1000 : 10;
+        gsize pos = 0;
+
+        while (pos < sizeof(TestHeader) + size) {
+            ssize_t res = read(fds[1], buf + pos, sizeof(TestHeader) + size - pos);
+            g_assert_cmpint(res, >, 0);
+            pos += res;
+        }
+        g_assert_cmpuint(((TestHeader *)buf)->size, ==, size);
+        g_assert_cmpuint(buf[sizeof(TestHeader)], ==, expected[i]);
+        g_assert_cmpuint(buf[sizeof(TestHeader) + size - 1], ==, expected[i]);
+    }
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+}
+
+/* Once its first fragment has been written, a message isn't
+ * interrupted by messages of a higher priority */
+static void test_fragments(void)
+{
+    static const guint8 expected[] = { 'a', 'i' };
+    TestConnection *conn;
+    guint8 buf[sizeof(TestHeader) + 1000];
+    guint32 size = 1000;
+    int fds[2];
+    guint i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new(fds[0]);
+
+    memcpy(buf, &size, sizeof(size));
+    memset(buf + sizeof(TestHeader), 'a', size);
+    vdagent_connection_write_fragment(VDAGENT_CONNECTION(conn),
+                                      g_bytes_new(buf, sizeof(TestHeader) + 400),
+                                      VDAGENT_WRITE_PRIORITY_BULK, FALSE);
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+
+    write_message(conn, 10, 'i', VDAGENT_WRITE_PRIORITY_INTERACTIVE);
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+    vdagent_connection_write_fragment(VDAGENT_CONNECTION(conn),
+                                      g_bytes_new(buf + sizeof(TestHeader) + 400, 600),
+                                      VDAGENT_WRITE_PRIORITY_BULK, TRUE);
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+
+    for (i = 0; i < G_N_ELEMENTS(expected); i++) {
+        gsize pos = 0;
+
+        size = expected[i] == 'a' ? 1000 : 10;
+        while (pos < sizeof(TestHeader) + size) {
+            ssize_t res = read(fds[1], buf + pos, sizeof(TestHeader) + size - pos);
+            g_assert_cmpint(res, >, 0);
+            pos += res;
+        }
+        g_assert_cmpuint(((TestHeader *)buf)->size, ==, size);
+        g_assert_cmpuint(buf[sizeof(TestHeader)], ==, expected[i]);
+        g_assert_cmpuint(buf[sizeof(TestHeader) + size - 1], ==, expected[i]);
+    }
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+}
+
+/* Write @n_messages messages in one go from the remote side and
+ * check they all get handled */
+static void test_buffered_read(gsize read_buf_size, guint32 max_size,
+                               gboolean scatter)
+{
+    TestConnection *conn;
+    GByteArray *sent = g_byte_array_new();
+    GByteArray *bodies = g_byte_array_new();
+    int fds[2];
+    guint i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new_full(fds[0], read_buf_size);
+    conn->scatter = scatter;
+
+    for (i = 0; i < 100; i++) {
+        guint32 size = (i * 7) % max_size;
+        guint8 *body = g_malloc(size);
+
+        memset(body, i & 0xff, size);
+        g_byte_array_append(sent, (guint8 *)&size, sizeof(size));
+        g_byte_array_append(sent, body, size);
+        g_byte_array_append(bodies, body, size);
+        g_free(body);
+    }
+    g_assert_cmpint(write(fds[1], sent->data, sent->len), ==, sent->len);
+
+    while (conn->n_messages < 100) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    /* the received bodies are the sent stream without the headers */
+    g_assert_cmpuint(conn->received->len, ==, bodies->len);
+    g_assert_cmpint(memcmp(conn->received->data, bodies->data, bodies->len), ==, 0);
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+    g_byte_array_unref(sent);
+    g_byte_array_unref(bodies);
+}
+
+static void writable_cb(VDAgentConnection *conn, gpointer user_data)
+{
+    (*(guint *)user_data)++;
+}
+
+static void test_watermarks(void)
+{
+    TestConnection *conn;
+    VDAgentConnection *vconn;
+    guint n_writable = 0;
+    int fds[2];
+    gsize total;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new(fds[0]);
+    vconn = VDAGENT_CONNECTION(conn);
+    vdagent_connection_set_write_watermarks(vconn, 100, 50);
+    vdagent_connection_set_writable_cb(vconn, writable_cb, &n_writable);
+
+    total = queue_messages(conn, 30);
+    g_assert_cmpuint(total, >, 100);
+    g_assert_cmpuint(vdagent_connection_get_queued_bytes(vconn), ==, total);
+    g_assert_false(vdagent_connection_is_writable(vconn));
+
+    while (n_writable == 0) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_true(vdagent_connection_is_writable(vconn));
+    g_assert_cmpuint(vdagent_connection_get_queued_bytes(vconn), <=, 50);
+
+    vdagent_connection_flush(vconn);
+    check_messages(fds[1], 30, total);
+    g_assert_cmpuint(n_writable, ==, 1);
+
+    /* raising the watermarks above what's queued unblocks right away */
+    total = queue_messages(conn, 30);
+    g_assert_false(vdagent_connection_is_writable(vconn));
+    vdagent_connection_set_write_watermarks(vconn, 2 * total, total);
+    g_assert_true(vdagent_connection_is_writable(vconn));
+    g_assert_cmpuint(n_writable, ==, 2);
+
+    vdagent_connection_flush(vconn);
+    check_messages(fds[1], 30, total);
+    g_assert_cmpuint(n_writable, ==, 2);
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+}
+
+static gboolean set_flag_cb(gpointer user_data)
+{
+    *(gboolean *)user_data = TRUE;
+    return G_SOURCE_REMOVE;
+}
+
+static void test_read_paused(void)
+{
+    TestConnection *conn;
+    gboolean timeout = FALSE;
+    int fds[2];
+    guint32 i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new(fds[0]);
+    vdagent_connection_set_read_paused(VDAGENT_CONNECTION(conn), TRUE);
+
+    for (i = 0; i < 10; i++) {
+        g_assert_cmpint(write(fds[1], &i, sizeof(i)), ==, sizeof(i));
+        g_assert_cmpint(write(fds[1], "0123456789", i), ==, i);
+    }
+
+    g_timeout_add(100, set_flag_cb, &timeout);
+    while (!timeout) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_cmpuint(conn->n_messages, ==, 0);
+
+    vdagent_connection_set_read_paused(VDAGENT_CONNECTION(conn), FALSE);
+    while (conn->n_messages < 10) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_cmpuint(conn->received->len, ==, 45);
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+}
+
+/* Messages are read in the I/O thread,
+ * writes from the main thread are passed on to it */
+static void test_io_thread(void)
+{
+    static const guint8 zeros[100];
+    TestConnection *conn = g_object_new(TEST_TYPE_CONNECTION, NULL);
+    GByteArray *sent = g_byte_array_new();
+    int fds[2];
+    gsize total;
+    guint32 i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    vdagent_connection_use_io_thread(VDAGENT_CONNECTION(conn));
+    vdagent_connection_setup(VDAGENT_CONNECTION(conn), stream_from_fd(fds[0]),
+                             FALSE, sizeof(TestHeader), test_error_cb);
+
+    for (i = 0; i < 100; i++) {
+        g_byte_array_append(sent, (guint8 *)&i, sizeof(i));
+        g_byte_array_append(sent, zeros, i);
+    }
+    g_assert_cmpint(write(fds[1], sent->data, sent->len), ==, sent->len);
+    while (g_atomic_int_get(&conn->n_messages) < 100) {
+        g_usleep(1000);
+    }
+
+    total = queue_messages(conn, 200);
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+    check_messages(fds[1], 200, total);
+
+    /* joins the I/O thread */
+    g_object_ref(conn);
+    vdagent_connection_destroy(conn);
+    g_assert_cmpuint(conn->received->len, ==, sent->len - 100 * sizeof(TestHeader));
+    g_object_unref(conn);
+
+    close(fds[1]);
+    g_byte_array_unref(sent);
+}
+
+static void test_buffer_pool(void)
+{
+    VDAgentConnection *conn = g_object_new(TEST_TYPE_CONNECTION, NULL);
+    VDAgentBufferPoolStats stats;
+    gpointer buf, buf2;
+
+    buf = vdagent_connection_buffer_alloc(conn, 100);
+    g_assert_cmpuint((gsize)buf % 8, ==, 0);
+    memset(buf, 0, 100);
+    vdagent_connection_buffer_free(conn, buf);
+
+    /* same size class, the buffer gets reused */
+    buf2 = vdagent_connection_buffer_alloc(conn, 128);
+    g_assert_true(buf2 == buf);
+    vdagent_connection_buffer_free(conn, buf2);
+
+    vdagent_connection_get_buffer_pool_stats(conn, &stats);
+    g_assert_cmpuint(stats.hits, ==, 1);
+    g_assert_cmpuint(stats.misses, ==, 1);
+    g_assert_cmpuint(stats.retained, ==, 128);
+
+    /* too large to be pooled */
+    buf = vdagent_connection_buffer_alloc(conn, 4 * 1024 * 1024);
+    vdagent_connection_buffer_free(conn, buf);
+
+    /* nothing is retained over the limit */
+    vdagent_connection_set_buffer_pool_limit(conn, 100);
+    buf = vdagent_connection_buffer_alloc(conn, 100);
+    vdagent_connection_buffer_free(conn, buf);
+
+    vdagent_connection_get_buffer_pool_stats(conn, &stats);
+    g_assert_cmpuint(stats.oversized, ==, 1);
+    g_assert_cmpuint(stats.misses, ==, 2);
+    g_assert_cmpuint(stats.retained, ==, 0);
+
+    g_object_unref(conn);
+}
+
+static void test_stats(void)
+{
+    TestConnection *conn;
+    VDAgentConnectionStats stats;
+    guint32 size = 10;
+    guint8 msg[sizeof(TestHeader) + 10] = { 0 };
+    int fds[2];
+    gsize total;
+    guint64 n_latencies = 0;
+    guint i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new(fds[0]);
+
+    total = queue_messages(conn, 20);
+    vdagent_connection_get_stats(VDAGENT_CONNECTION(conn), &stats);
+    g_assert_cmpuint(stats.queue_depth, ==, 20);
+    g_assert_cmpuint(stats.queued_bytes, ==, total);
+
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+    check_messages(fds[1], 20, total);
+
+    memcpy(msg, &size, sizeof(size));
+    g_assert_cmpint(write(fds[1], msg, sizeof(msg)), ==, sizeof(msg));
+    while (conn->n_messages < 1) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    vdagent_connection_get_stats(VDAGENT_CONNECTION(conn), &stats);
+    g_assert_cmpuint(stats.messages_out, ==, 20);
+    g_assert_cmpuint(stats.bytes_out, ==, total);
+    g_assert_cmpuint(stats.queue_depth, ==, 0);
+    g_assert_cmpuint(stats.queued_bytes, ==, 0);
+    g_assert_cmpuint(stats.peak_queue_depth, ==, 20);
+    g_assert_cmpuint(stats.peak_queued_bytes, ==, total);
+    g_assert_cmpuint(stats.messages_in, ==, 1);
+    g_assert_cmpuint(stats.bytes_in, ==, sizeof(msg));
+    for (i = 0; i < VDAGENT_CONNECTION_LATENCY_BUCKETS; i++) {
+        n_latencies += stats.write_latency[i];
+    }
+    g_assert_cmpuint(n_latencies, ==, 20);
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+}
+
+/* Messages held back by the subclass count towards the watermarks
+ * and are written as the queue drains */
+static void test_write_backlog(void)
+{
+    TestConnection *conn;
+    GBytes *msg;
+    int fds[2];
+    gsize total;
+    guint i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new(fds[0]);
+    vdagent_connection_set_write_watermarks(VDAGENT_CONNECTION(conn), 1000, 500);
+
+    total = 0;
+    for (i = 1; i < 200; i++) {
+        msg = make_message(i);
+        total += g_bytes_get_size(msg);
+        g_bytes_unref(msg);
+    }
+    conn->fill_next = 1;
+    conn->fill_end = 200;
+    conn->fill_backlog = total;
+    vdagent_connection_set_write_backlog(VDAGENT_CONNECTION(conn), total);
+    g_assert_false(vdagent_connection_is_writable(VDAGENT_CONNECTION(conn)));
+
+    /* the first write starts filling */
+    msg = make_message(0);
+    total += g_bytes_get_size(msg);
+    vdagent_connection_write_bytes(VDAGENT_CONNECTION(conn), msg,
+                                   VDAGENT_WRITE_PRIORITY_BULK);
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+    check_messages(fds[1], 200, total);
+
+    g_assert_cmpuint(conn->fill_next, ==, 200);
+    g_assert_cmpuint(vdagent_connection_get_queued_bytes(VDAGENT_CONNECTION(conn)), ==, 0);
+    g_assert_true(vdagent_connection_is_writable(VDAGENT_CONNECTION(conn)));
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+}
+
+static void read_tap(VDAgentConnection *conn, const GOutputVector *vectors,
+                     guint n_vectors, gpointer user_data)
+{
+    GByteArray *tapped = user_data;
+    guint i;
+
+    for (i = 0; i < n_vectors; i++) {
+        g_byte_array_append(tapped, vectors[i].buffer, vectors[i].size);
+    }
+}
+
+/* The tap sees every frame read, header included, whether the body
+ * was read into the connection's buffer or into the subclass' */
+static void test_read_tap(gboolean scatter)
+{
+    TestConnection *conn;
+    GByteArray *tapped = g_byte_array_new();
+    GByteArray *sent = g_byte_array_new();
+    int fds[2];
+    guint i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new(fds[0]);
+    conn->scatter = scatter;
+    vdagent_connection_set_read_tap(VDAGENT_CONNECTION(conn), read_tap, tapped, NULL);
+
+    for (i = 0; i < 50; i++) {
+        GBytes *msg = make_message(i);
+
+        g_byte_array_append(sent, g_bytes_get_data(msg, NULL), g_bytes_get_size(msg));
+        g_bytes_unref(msg);
+    }
+    g_assert_cmpint(write(fds[1], sent->data, sent->len), ==, sent->len);
+    while (conn->n_messages < 50) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    g_assert_cmpuint(tapped->len, ==, sent->len);
+    g_assert_cmpint(memcmp(tapped->data, sent->data, sent->len), ==, 0);
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+    g_byte_array_unref(tapped);
+    g_byte_array_unref(sent);
+}
+
+static gint peer_closed;
+
+static void peer_closed_cb(VDAgentConnection *conn, GError *err)
+{
+    /* end of stream is reported without an error */
+    g_assert_null(err);
+    g_atomic_int_inc(&peer_closed);
+}
+
+/* Closing the other end reports the end of stream to error_cb,
+ * from the main context whether or not an I/O thread reads */
+static void test_peer_closed(gboolean io_thread)
+{
+    TestConnection *conn = g_object_new(TEST_TYPE_CONNECTION, NULL);
+    int fds[2];
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    if (io_thread) {
+        vdagent_connection_use_io_thread(VDAGENT_CONNECTION(conn));
+    }
+    vdagent_connection_setup(VDAGENT_CONNECTION(conn), stream_from_fd(fds[0]),
+                             FALSE, sizeof(TestHeader), peer_closed_cb);
+
+    peer_closed = 0;
+    close(fds[1]);
+    while (g_atomic_int_get(&peer_closed) == 0) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_cmpint(g_atomic_int_get(&peer_closed), ==, 1);
+
+    vdagent_connection_destroy(conn);
+}
+
+/* With --enable-io-uring, reads and both the asynchronous and the flushed
+ * writes go through io_uring, bodies larger than the receive buffer included */
+static void test_io_uring(void)
+{
+    TestConnection *conn;
+    GByteArray *sent = g_byte_array_new();
+    GByteArray *bodies = g_byte_array_new();
+    int fds[2];
+    gsize total;
+    guint i;
+
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), ==, 0);
+    conn = test_connection_new_full(fds[0], 64);
+    if (!vdagent_connection_uses_io_uring(VDAGENT_CONNECTION(conn))) {
+        g_printerr("io_uring not supported by the kernel, skipping\n");
+        vdagent_connection_destroy(conn);
+        close(fds[1]);
+        g_byte_array_unref(sent);
+        g_byte_array_unref(bodies);
+        return;
+    }
+
+    for (i = 0; i < 100; i++) {
+        guint32 size = (i * 7) % 1000;
+        guint8 *body = g_malloc(size);
+
+        memset(body, i & 0xff, size);
+        g_byte_array_append(sent, (guint8 *)&size, sizeof(size));
+        g_byte_array_append(sent, body, size);
+        g_byte_array_append(bodies, body, size);
+        g_free(body);
+    }
+    g_assert_cmpint(write(fds[1], sent->data, sent->len), ==, sent->len);
+    while (conn->n_messages < 100) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_cmpuint(conn->received->len, ==, bodies->len);
+    g_assert_cmpint(memcmp(conn->received->data, bodies->data, bodies->len), ==, 0);
+
+    /* written from the main loop as the completions come in */
+    total = queue_messages(conn, 200);
+    while (vdagent_connection_get_queued_bytes(VDAGENT_CONNECTION(conn)) > 0) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    check_messages(fds[1], 200, total);
+
+    total = queue_messages(conn, 200);
+    vdagent_connection_flush(VDAGENT_CONNECTION(conn));
+    check_messages(fds[1], 200, total);
+
+    vdagent_connection_destroy(conn);
+    close(fds[1]);
+    g_byte_array_unref(sent);
+    g_byte_array_unref(bodies);
+}
+
+int main(int argc, char *argv[])
+{
+    // default budget, every message gets gathered
+    test_gather_write(64, 256 * 1024);
+
+    // one message per write, same as without gathering
+    test_gather_write(1, 256 * 1024);
+
+    // byte budget smaller than most messages
+    test_gather_write(64, 8);
+
+    // many small messages handled from a single read
+    test_buffered_read(0, 64, FALSE);
+
+    // bodies larger than the receive buffer
+    test_buffered_read(64, 1000, FALSE);
+
+    // bodies stored into buffers provided by the subclass
+    test_buffered_read(0, 64, TRUE);
+    test_buffered_read(64, 1000, TRUE);
+
+    test_priority_lanes();
+
+    test_fragments();
+
+    test_buffer_pool();
+
+    test_watermarks();
+
+    test_read_paused();
+
+    test_io_thread();
+
+    test_stats();
+
+    test_write_backlog();
+
+    test_read_tap(FALSE);
+    test_read_tap(TRUE);
+
+    // end of stream, read from the main context and from an I/O thread
+    test_peer_closed(FALSE);
+    test_peer_closed(TRUE);
+
+#ifdef HAVE_LIBURING
+    test_io_uring();
+#endif
+
+    return 0;
+}
@@ -0,0 +1,447 @@
+/*  test-virtio-port.c  - test virtio port chunking and reassembly
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "virtio-port.h"
+
+/* Plays the host end of the port, connected by the port to a unix socket */
+typedef struct {
+    gchar *dir;
+    gchar *path;
+    int fd;
+    VirtioPort *vport;
+    /* messages passed to the read callback, as VDAgentMessage + data */
+    GPtrArray *received;
+} TestPort;
+
+static TestPort *test_port;
+
+static void test_read_cb(VirtioPort *vport, int port_nr,
+                         VDAgentMessage *message_header, uint8_t *data)
+{
+    GByteArray *msg = g_byte_array_new();
+
+    g_assert_true(vport == test_port->vport);
+    g_assert_cmpuint(message_header->protocol, ==, VD_AGENT_PROTOCOL);
+    g_byte_array_append(msg, (guint8 *)&port_nr, sizeof(port_nr));
+    g_byte_array_append(msg, (guint8 *)message_header, sizeof(*message_header));
+    g_byte_array_append(msg, data, message_header->size);
+    g_ptr_array_add(test_port->received, msg);
+}
+
+static void test_error_cb(VDAgentConnection *conn, GError *err)
+{
+    if (err) {
+        g_printerr("port error: %s\n", err->message);
+        g_error_free(err);
+    }
+    g_assert_not_reached();
+}
+
+static TestPort *test_port_new(gboolean io_thread)
+{
+    TestPort *port = g_new0(TestPort, 1);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int listen_fd;
+
+    port->dir = g_dir_make_tmp("test-virtio-port-XXXXXX", NULL);
+    g_assert_nonnull(port->dir);
+    port->path = g_build_filename(port->dir, "port", NULL);
+    g_strlcpy(addr.sun_path, port->path, sizeof(addr.sun_path));
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    g_assert_cmpint(listen_fd, >=, 0);
+    g_assert_cmpint(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+    g_assert_cmpint(listen(listen_fd, 1), ==, 0);
+
+    port->vport = vdagent_virtio_port_create_full(port->path, test_read_cb,
+                                                  test_error_cb, io_thread);
+    g_assert_nonnull(port->vport);
+    port->fd = accept(listen_fd, NULL, NULL);
+    g_assert_cmpint(port->fd, >=, 0);
+    close(listen_fd);
+
+    port->received = g_ptr_array_new_with_free_func((GDestroyNotify)g_byte_array_unref);
+    test_port = port;
+    return port;
+}
+
+static void test_port_free(TestPort *port)
+{
+    vdagent_connection_destroy(port->vport);
+    close(port->fd);
+    g_unlink(port->path);
+    g_rmdir(port->dir);
+    g_free(port->path);
+    g_free(port->dir);
+    g_ptr_array_unref(port->received);
+    g_free(port);
+    test_port = NULL;
+}
+
+/* Message data is a sequence of bytes starting at the low byte of @opaque */
+static GByteArray *make_message(uint32_t opaque, uint32_t size)
+{
+    GByteArray *msg = g_byte_array_sized_new(sizeof(VDAgentMessage) + size);
+    VDAgentMessage header = {
+        .protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL),
+        .type = GUINT32_TO_LE(VD_AGENT_CLIPBOARD),
+        .opaque = GUINT64_TO_LE(opaque),
+        .size = GUINT32_TO_LE(size),
+    };
+    uint32_t i;
+
+    g_byte_array_append(msg, (guint8 *)&header, sizeof(header));
+    for (i = 0; i < size; i++) {
+        guint8 byte = opaque + i;
+
+        g_byte_array_append(msg, &byte, 1);
+    }
+    return msg;
+}
+
+static void check_message(GByteArray *received, int port_nr,
+                          uint32_t opaque, uint32_t size)
+{
+    VDAgentMessage header;
+    int received_port;
+    uint32_t i;
+
+    g_assert_cmpuint(received->len, ==, sizeof(int) + sizeof(header) + size);
+    memcpy(&received_port, received->data, sizeof(int));
+    memcpy(&header, received->data + sizeof(int), sizeof(header));
+    g_assert_cmpint(received_port, ==, port_nr);
+    g_assert_cmpuint(header.type, ==, VD_AGENT_CLIPBOARD);
+    g_assert_cmpuint(header.opaque, ==, opaque);
+    g_assert_cmpuint(header.size, ==, size);
+    for (i = 0; i < size; i++) {
+        g_assert_cmpuint(received->data[sizeof(int) + sizeof(header) + i], ==,
+                         (guint8)(opaque + i));
+    }
+}
+
+static void append_chunk(GByteArray *out, uint32_t port_nr,
+                         const guint8 *data, uint32_t size)
+{
+    VDIChunkHeader chunk = {
+        .port = GUINT32_TO_LE(port_nr),
+        .size = GUINT32_TO_LE(size),
+    };
+
+    g_byte_array_append(out, (guint8 *)&chunk, sizeof(chunk));
+    g_byte_array_append(out, data, size);
+}
+
+/* Runs in its own thread, so the port can be read meanwhile */
+static gpointer host_write_thread(gpointer data)
+{
+    GByteArray *out = data;
+    guint pos = 0;
+
+    while (pos < out->len) {
+        ssize_t res = write(test_port->fd, out->data + pos, out->len - pos);
+        g_assert_cmpint(res, >, 0);
+        pos += res;
+    }
+    return NULL;
+}
+
+static void wait_received(guint n_messages)
+{
+    while (test_port->received->len < n_messages) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    g_assert_cmpuint(test_port->received->len, ==, n_messages);
+}
+
+/* Messages on both ports arrive in chunks alternating between the ports
+ * and are assembled inline, in the arena and in buffers of their own */
+static void test_interleaved_ports(gboolean io_thread)
+{
+    static const uint32_t sizes[] = {
+        0, 10, 64, 65, 1000, 4096, 4097, 5000, 70000, 100, 20, 4000,
+    };
+    const guint n_messages = G_N_ELEMENTS(sizes);
+    TestPort *port = test_port_new(io_thread);
+    GByteArray *out = g_byte_array_new();
+    GByteArray *msgs[2];
+    GThread *writer;
+    guint next[2] = { 0, 0 };
+    guint pos[2] = { 0, 0 };
+    guint i, p;
+
+    vdagent_virtio_port_set_arena_limit(port->vport, 4096);
+
+    msgs[0] = make_message(0, sizes[0]);
+    msgs[1] = make_message(100, sizes[0]);
+    /* one chunk of up to 1000 bytes from each port in turn */
+    while (next[0] < n_messages || next[1] < n_messages) {
+        for (p = 0; p < 2; p++) {
+            uint32_t size;
+
+            if (next[p] == n_messages) {
+                continue;
+            }
+            size = MIN(msgs[p]->len - pos[p], 1000);
+            append_chunk(out, VDP_CLIENT_PORT + p, msgs[p]->data + pos[p], size);
+            pos[p] += size;
+            if (pos[p] == msgs[p]->len) {
+                g_byte_array_unref(msgs[p]);
+                pos[p] = 0;
+                if (++next[p] < n_messages) {
+                    msgs[p] = make_message(100 * p + next[p], sizes[next[p]]);
+                }
+            }
+        }
+    }
+
+    writer = g_thread_new("host-write", host_write_thread, out);
+    wait_received(2 * n_messages);
+    g_thread_join(writer);
+
+    /* in order on each port */
+    next[0] = next[1] = 0;
+    for (i = 0; i < port->received->len; i++) {
+        GByteArray *received = g_ptr_array_index(port->received, i);
+        int port_nr;
+
+        memcpy(&port_nr, received->data, sizeof(port_nr));
+        p = port_nr - VDP_CLIENT_PORT;
+        g_assert_cmpuint(p, <, 2);
+        check_message(received, port_nr, 100 * p + next[p], sizes[next[p]]);
+        next[p]++;
+    }
+
+    g_byte_array_unref(out);
+    test_port_free(port);
+}
+
+/* A client disconnecting in the middle of a message on the client port
+ * drops that message, but not the one of the next client after it */
+static void test_client_disconnect(gboolean io_thread)
+{
+    TestPort *port = test_port_new(io_thread);
+    GByteArray *out = g_byte_array_new();
+    GByteArray *old_msg = make_message(1, 5000);
+    GByteArray *new_msg = make_message(2, 5000);
+    VDAgentMessage disconnect = {
+        .protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL),
+        .type = GUINT32_TO_LE(VD_AGENT_CLIENT_DISCONNECTED),
+    };
+    VDAgentMessage header;
+    GByteArray *received;
+    GThread *writer;
+    guint pos;
+    int port_nr;
+
+    /* the second chunk is read straight into the message buffer */
+    append_chunk(out, VDP_CLIENT_PORT, old_msg->data, 1000);
+    append_chunk(out, VDP_CLIENT_PORT, old_msg->data + 1000, 1000);
+    append_chunk(out, VDP_SERVER_PORT, (guint8 *)&disconnect, sizeof(disconnect));
+    for (pos = 0; pos < new_msg->len; pos += 1000) {
+        append_chunk(out, VDP_CLIENT_PORT, new_msg->data + pos,
+                     MIN(new_msg->len - pos, 1000));
+    }
+
+    writer = g_thread_new("host-write", host_write_thread, out);
+    wait_received(2);
+    g_thread_join(writer);
+
+    received = g_ptr_array_index(port->received, 0);
+    g_assert_cmpuint(received->len, ==, sizeof(int) + sizeof(header));
+    memcpy(&port_nr, received->data, sizeof(port_nr));
+    memcpy(&header, received->data + sizeof(int), sizeof(header));
+    g_assert_cmpint(port_nr, ==, VDP_SERVER_PORT);
+    g_assert_cmpuint(header.type, ==, VD_AGENT_CLIENT_DISCONNECTED);
+    check_message(g_ptr_array_index(port->received, 1), VDP_CLIENT_PORT, 2, 5000);
+
+    g_byte_array_unref(old_msg);
+    g_byte_array_unref(new_msg);
+    g_byte_array_unref(out);
+    test_port_free(port);
+}
+
+/* Returns whether the port wrote anything once the main context is idle */
+static gboolean host_readable(void)
+{
+    struct pollfd pfd = { .fd = test_port->fd, .events = POLLIN };
+
+    while (g_main_context_iteration(NULL, FALSE));
+    return poll(&pfd, 1, 0) == 1;
+}
+
+/* Read @size bytes written by the port */
+static GByteArray *host_read(gsize size)
+{
+    GByteArray *in = g_byte_array_sized_new(size);
+    struct pollfd pfd = { .fd = test_port->fd, .events = POLLIN };
+
+    g_byte_array_set_size(in, 0);
+    while (in->len < size) {
+        g_main_context_iteration(NULL, FALSE);
+        if (poll(&pfd, 1, 10) == 1) {
+            guint len = in->len;
+            ssize_t res;
+
+            g_byte_array_set_size(in, size);
+            res = read(test_port->fd, in->data + len, size - len);
+            g_assert_cmpint(res, >, 0);
+            g_byte_array_set_size(in, len + res);
+        }
+    }
+    return in;
+}
+
+/* Checks @in holds @msg in a single chunk at @pos, returns the next position */
+static guint check_chunk(GByteArray *in, guint pos, uint32_t port_nr, GByteArray *msg)
+{
+    VDIChunkHeader chunk;
+
+    g_assert_cmpuint(in->len - pos, >=, sizeof(chunk) + msg->len);
+    memcpy(&chunk, in->data + pos, sizeof(chunk));
+    g_assert_cmpuint(GUINT32_FROM_LE(chunk.port), ==, port_nr);
+    g_assert_cmpuint(GUINT32_FROM_LE(chunk.size), ==, msg->len);
+    pos += sizeof(chunk);
+    g_assert_cmpint(memcmp(in->data + pos, msg->data, msg->len), ==, 0);
+    return pos + msg->len;
+}
+
+/* Messages committed in a batch, nested or not, are only written once the
+ * outermost batch ends, an incomplete one is left out */
+static void test_batch(void)
+{
+    TestPort *port = test_port_new(FALSE);
+    GByteArray *first = make_message(1, 100);
+    GByteArray *second = make_message(2, 1000);
+    VirtioPortMessage *msg;
+    GByteArray *in;
+    guint pos;
+
+    vdagent_virtio_port_begin_batch(port->vport);
+    vdagent_virtio_port_write(port->vport, VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, 1,
+                              first->data + sizeof(VDAgentMessage),
+                              first->len - sizeof(VDAgentMessage));
+
+    vdagent_virtio_port_begin_batch(port->vport);
+    msg = vdagent_virtio_port_message_start(port->vport, VDP_CLIENT_PORT,
+                                            VD_AGENT_CLIPBOARD, 3, 100);
+    vdagent_virtio_port_message_append(msg, second->data, 50);
+    g_assert_cmpint(vdagent_virtio_port_message_commit(msg), ==, -1);
+    vdagent_virtio_port_end_batch(port->vport);
+    g_assert_false(host_readable());
+
+    vdagent_virtio_port_write(port->vport, VDP_CLIENT_PORT, VD_AGENT_CLIPBOARD, 2,
+                              second->data + sizeof(VDAgentMessage),
+                              second->len - sizeof(VDAgentMessage));
+    g_assert_false(host_readable());
+    vdagent_virtio_port_end_batch(port->vport);
+
+    in = host_read(2 * sizeof(VDIChunkHeader) + first->len + second->len);
+    pos = check_chunk(in, 0, VDP_CLIENT_PORT, first);
+    check_chunk(in, pos, VDP_CLIENT_PORT, second);
+    g_assert_false(host_readable());
+
+    g_byte_array_unref(in);
+    g_byte_array_unref(first);
+    g_byte_array_unref(second);
+    test_port_free(port);
+}
+
+/* Queue a message of @type with @opaque, about @selection unless it's -1,
+ * returns it as make_message() does with the type set */
+static GByteArray *write_clipboard(TestPort *port, uint32_t type,
+                                   uint32_t opaque, gint selection)
+{
+    GByteArray *msg = make_message(opaque, 100);
+    VDAgentMessage *header = (VDAgentMessage *)msg->data;
+    VirtioPortMessage *vmsg;
+
+    header->type = GUINT32_TO_LE(type);
+    vmsg = vdagent_virtio_port_message_start(port->vport, VDP_CLIENT_PORT,
+                                             type, opaque, 100);
+    if (selection >= 0) {
+        vdagent_virtio_port_message_set_selection(vmsg, selection);
+    }
+    vdagent_virtio_port_message_append(vmsg, msg->data + sizeof(VDAgentMessage), 100);
+    g_assert_cmpint(vdagent_virtio_port_message_commit(vmsg), ==, 0);
+    return msg;
+}
+
+/* Grabs and releases go before queued bulk data, but not before the
+ * clipboard data of their selection, or of any if theirs isn't known */
+static void test_clipboard_order(void)
+{
+    TestPort *port = test_port_new(FALSE);
+    GByteArray *msgs[5], *in;
+    static const guint expected[] = { 2, 0, 1, 3, 4 };
+    gsize total = 0;
+    guint i, pos;
+
+    vdagent_virtio_port_begin_batch(port->vport);
+    msgs[0] = write_clipboard(port, VD_AGENT_CLIPBOARD, 0, 1);
+    msgs[1] = write_clipboard(port, VD_AGENT_FILE_XFER_DATA, 1, -1);
+    msgs[2] = write_clipboard(port, VD_AGENT_CLIPBOARD_GRAB, 2, 0);
+    msgs[3] = write_clipboard(port, VD_AGENT_CLIPBOARD_RELEASE, 3, 1);
+    msgs[4] = write_clipboard(port, VD_AGENT_CLIPBOARD_GRAB, 4, -1);
+    vdagent_virtio_port_end_batch(port->vport);
+
+    for (i = 0; i < G_N_ELEMENTS(msgs); i++) {
+        total += sizeof(VDIChunkHeader) + msgs[i]->len;
+    }
+    in = host_read(total);
+    pos = 0;
+    for (i = 0; i < G_N_ELEMENTS(expected); i++) {
+        pos = check_chunk(in, pos, VDP_CLIENT_PORT, msgs[expected[i]]);
+    }
+
+    g_byte_array_unref(in);
+    for (i = 0; i < G_N_ELEMENTS(msgs); i++) {
+        g_byte_array_unref(msgs[i]);
+    }
+    test_port_free(port);
+}
+
+int main(int argc, char *argv[])
+{
+    // reassembly from the main context
+    test_interleaved_ports(FALSE);
+
+    // reassembly in the I/O thread, delivered through the ring
+    test_interleaved_ports(TRUE);
+
+    test_client_disconnect(FALSE);
+    test_client_disconnect(TRUE);
+
+    test_batch();
+
+    test_clipboard_order();
+
+    return 0;
+}
@@ -0,0 +1,975 @@
+/* vdagentd-load.c spice host stand-in and load generator for spice-vdagentd
+ *
+ * Copyright 2026 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Starts spice-vdagentd with its virtio port on a unix socket played by
+ * this program, a fifo for fake uinput device and a session agent played
+ * by this program as well, so every message can be followed from the host
+ * to where it ends up:
+ *  - mouse states until their events are read back from the fifo,
+ *  - monitor configs until the daemon replies,
+ *  - clipboard grab/request/data cycles and file transfers until the
+ *    agent receives them.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+#include <spice/vd_agent.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <glib/gstdio.h>
+
+#include "udscs.h"
+#include "vdagentd-proto.h"
+
+#define SCREEN_WIDTH 4096
+#define SCREEN_HEIGHT 2160
+
+/* Stop generating while this much is waiting to be written to the port */
+#define HOST_OUT_HIGH_WATERMARK (256 * 1024)
+
+#define FILE_XFER_BLOCK_SIZE (64 * 1024)
+
+static gchar *vdagentd_path = NULL;
+static gint n_mouse = 10000;
+static gint n_monitors = 100;
+static gint n_clipboard = 100;
+static gint clipboard_size = 64 * 1024;
+static gint n_file_xfers = 4;
+static gint64 file_size = 4 * 1024 * 1024;
+static gint timeout = 60;
+static gboolean io_thread = FALSE;
+
+enum {
+    LATENCY_MOUSE,
+    LATENCY_MONITORS_CONFIG,
+    LATENCY_CLIPBOARD_GRAB,
+    LATENCY_CLIPBOARD,
+    LATENCY_FILE_XFER_START,
+    LATENCY_FILE_XFER_DATA,
+    LATENCY_FILE_XFER,
+    LATENCY_COUNT
+};
+
+static const char * const latency_names[LATENCY_COUNT] = {
+    "mouse-state",
+    "monitors-config",
+    "clipboard-grab",
+    "clipboard",
+    "file-xfer-start",
+    "file-xfer-data",
+    "file-xfer",
+};
+
+/* in microseconds */
+static GArray *latencies[LATENCY_COUNT];
+
+struct file_xfer {
+    uint32_t id;
+    gint64 start_time;
+    gboolean can_send;
+    guint64 sent;
+    guint64 received;
+    /* send times of the data messages in flight */
+    GQueue data_times;
+};
+
+static GMainLoop *loop;
+static int ret = 1;
+static GPid daemon_pid;
+static guint daemon_watch;
+static gint64 load_start;
+
+static int listen_fd = -1;
+static guint listen_watch;
+static int host_fd = -1;
+static guint host_in_watch;
+static guint host_out_watch;
+static GByteArray *host_out;
+static gsize host_out_pos;
+static GByteArray *host_in;
+static GByteArray *host_msg;
+static guint64 host_messages_out;
+static guint64 host_bytes_out;
+static gboolean host_started;
+
+static int uinput_fd = -1;
+static guint uinput_watch;
+static guint8 uinput_buf[sizeof(struct input_event)];
+static gsize uinput_buf_len;
+
+static UdscsConnection *agent;
+static guint agent_connect_source;
+
+static gint mouse_sent;
+static gint mouse_final_x;
+static gboolean mouse_done;
+/* send times by x position, positions cycle over the screen width */
+static gint64 mouse_times[SCREEN_WIDTH];
+static gint mouse_x = -1;
+
+static gint monitors_sent;
+static gint monitors_replied;
+static GQueue monitors_times = G_QUEUE_INIT;
+
+static gint clipboard_started;
+static gint clipboard_done;
+static gboolean clipboard_busy;
+static gint64 clipboard_grab_time;
+static gint64 clipboard_data_time;
+
+static struct file_xfer *file_xfers;
+static gint file_xfers_done;
+static gint file_xfers_failed;
+
+static guint8 *payload;
+
+static void add_latency(guint type, gint64 start)
+{
+    gint64 latency = g_get_monotonic_time() - start;
+
+    g_array_append_val(latencies[type], latency);
+}
+
+static gboolean load_done(void)
+{
+    return (n_mouse == 0 || mouse_done) &&
+           monitors_replied == n_monitors &&
+           clipboard_done == n_clipboard &&
+           file_xfers_done == n_file_xfers;
+}
+
+static void check_done(void)
+{
+    if (load_done()) {
+        ret = 0;
+        g_main_loop_quit(loop);
+    }
+}
+
+static void quit_error(const char *msg)
+{
+    g_printerr("%s\n", msg);
+    g_main_loop_quit(loop);
+}
+
+/* ---------- host side of the virtio port ---------- */
+
+static void pump(void);
+
+static gboolean host_out_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    while (host_out_pos < host_out->len) {
+        ssize_t n = write(host_fd, host_out->data + host_out_pos,
+                          host_out->len - host_out_pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                return G_SOURCE_CONTINUE;
+            }
+            quit_error("error writing to the port");
+            host_out_watch = 0;
+            return G_SOURCE_REMOVE;
+        }
+        host_out_pos += n;
+        if (host_out->len - host_out_pos < HOST_OUT_HIGH_WATERMARK / 2) {
+            g_byte_array_remove_range(host_out, 0, host_out_pos);
+            host_out_pos = 0;
+            pump();
+        }
+    }
+    g_byte_array_set_size(host_out, 0);
+    host_out_pos = 0;
+    host_out_watch = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Frames the message the same way as virtio-port.c, in chunks of at
+ * most VD_AGENT_MAX_DATA_SIZE bytes */
+static void host_write(uint32_t type, const void *prefix, uint32_t prefix_size,
+                       const void *data, uint32_t data_size)
+{
+    VDAgentMessage header;
+    GByteArray *msg;
+    guint pos;
+
+    header.protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL);
+    header.type = GUINT32_TO_LE(type);
+    header.opaque = 0;
+    header.size = GUINT32_TO_LE(prefix_size + data_size);
+
+    msg = g_byte_array_sized_new(sizeof(header) + prefix_size + data_size);
+    g_byte_array_append(msg, (const guint8 *)&header, sizeof(header));
+    if (prefix_size) {
+        g_byte_array_append(msg, prefix, prefix_size);
+    }
+    if (data_size) {
+        g_byte_array_append(msg, data, data_size);
+    }
+
+    for (pos = 0; pos < msg->len; ) {
+        VDIChunkHeader chunk;
+        guint size = MIN(msg->len - pos, VD_AGENT_MAX_DATA_SIZE);
+
+        chunk.port = GUINT32_TO_LE(VDP_CLIENT_PORT);
+        chunk.size = GUINT32_TO_LE(size);
+        g_byte_array_append(host_out, (const guint8 *)&chunk, sizeof(chunk));
+        g_byte_array_append(host_out, msg->data + pos, size);
+        pos += size;
+    }
+    g_byte_array_unref(msg);
+
+    host_messages_out++;
+    host_bytes_out += prefix_size + data_size;
+    if (!host_out_watch) {
+        host_out_watch = g_unix_fd_add(host_fd, G_IO_OUT, host_out_cb, NULL);
+    }
+}
+
+static void send_capabilities(void)
+{
+    uint32_t size = sizeof(VDAgentAnnounceCapabilities) + VD_AGENT_CAPS_BYTES;
+    VDAgentAnnounceCapabilities *caps = g_malloc0(size);
+    guint i;
+
+    caps->request = GUINT32_TO_LE(1);
+    VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MOUSE_STATE);
+    VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MONITORS_CONFIG);
+    VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_REPLY);
+    VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
+    for (i = 0; i < VD_AGENT_CAPS_SIZE; i++) {
+        caps->caps[i] = GUINT32_TO_LE(caps->caps[i]);
+    }
+    host_write(VD_AGENT_ANNOUNCE_CAPABILITIES, caps, size, NULL, 0);
+    g_free(caps);
+}
+
+static void send_mouse(void)
+{
+    VDAgentMouseState mouse = { 0 };
+    gint x;
+
+    /* x starts at 1 as uinput only reports changes from 0,0 */
+    x = 1 + mouse_sent % (SCREEN_WIDTH - 1);
+    mouse.x = GUINT32_TO_LE(x);
+    mouse.y = GUINT32_TO_LE(SCREEN_HEIGHT / 2);
+    mouse_times[x] = g_get_monotonic_time();
+    mouse_final_x = x;
+    mouse_sent++;
+    host_write(VD_AGENT_MOUSE_STATE, &mouse, sizeof(mouse), NULL, 0);
+}
+
+static void send_monitors_config(void)
+{
+    struct {
+        VDAgentMonitorsConfig config;
+        VDAgentMonConfig monitor;
+    } msg = { { 0 } };
+    gint64 *time = g_new(gint64, 1);
+
+    msg.config.num_of_monitors = GUINT32_TO_LE(1);
+    /* storm of resizes, alternating between two sizes */
+    msg.monitor.width = GUINT32_TO_LE(monitors_sent % 2 ? 1920 : SCREEN_WIDTH);
+    msg.monitor.height = GUINT32_TO_LE(monitors_sent % 2 ? 1080 : SCREEN_HEIGHT);
+    msg.monitor.depth = GUINT32_TO_LE(32);
+    *time = g_get_monotonic_time();
+    g_queue_push_tail(&monitors_times, time);
+    monitors_sent++;
+    host_write(VD_AGENT_MONITORS_CONFIG, &msg, sizeof(msg), NULL, 0);
+}
+
+static void send_clipboard_grab(void)
+{
+    uint32_t type = GUINT32_TO_LE(VD_AGENT_CLIPBOARD_UTF8_TEXT);
+
+    clipboard_busy = TRUE;
+    clipboard_started++;
+    clipboard_grab_time = g_get_monotonic_time();
+    host_write(VD_AGENT_CLIPBOARD_GRAB, &type, sizeof(type), NULL, 0);
+}
+
+static void send_file_xfer_start(struct file_xfer *xfer)
+{
+    VDAgentFileXferStartMessage start;
+    gchar *keyfile;
+
+    keyfile = g_strdup_printf("[vdagent-file-xfer]\nname=load-%u\nsize=%"
+                              G_GINT64_FORMAT "\n", xfer->id, file_size);
+    start.id = GUINT32_TO_LE(xfer->id);
+    xfer->start_time = g_get_monotonic_time();
+    host_write(VD_AGENT_FILE_XFER_START, &start, sizeof(start),
+               keyfile, strlen(keyfile) + 1);
+    g_free(keyfile);
+}
+
+static gboolean send_file_xfer_data(struct file_xfer *xfer)
+{
+    VDAgentFileXferDataMessage data;
+    gint64 *time;
+    guint64 size;
+
+    if (!xfer->can_send || xfer->sent == file_size) {
+        return FALSE;
+    }
+    size = MIN(file_size - xfer->sent, FILE_XFER_BLOCK_SIZE);
+    data.id = GUINT32_TO_LE(xfer->id);
+    data.size = GUINT64_TO_LE(size);
+    time = g_new(gint64, 1);
+    *time = g_get_monotonic_time();
+    g_queue_push_tail(&xfer->data_times, time);
+    xfer->sent += size;
+    host_write(VD_AGENT_FILE_XFER_DATA, &data, sizeof(data), payload, size);
+    return TRUE;
+}
+
+/* Queue one message of every kind with some left to send, round robin,
+ * until enough is waiting to be written */
+static void pump(void)
+{
+    gboolean sent = TRUE;
+    gint i;
+
+    if (!host_started) {
+        return;
+    }
+    while (sent && host_out->len - host_out_pos < HOST_OUT_HIGH_WATERMARK) {
+        sent = FALSE;
+        if (mouse_sent < n_mouse) {
+            send_mouse();
+            sent = TRUE;
+        }
+        if (monitors_sent < n_monitors) {
+            send_monitors_config();
+            sent = TRUE;
+        }
+        if (!clipboard_busy && clipboard_started < n_clipboard) {
+            send_clipboard_grab();
+            sent = TRUE;
+        }
+        for (i = 0; i < n_file_xfers; i++) {
+            sent |= send_file_xfer_data(&file_xfers[i]);
+        }
+    }
+}
+
+static void start_load(void)
+{
+    gint i;
+
+    send_capabilities();
+    host_started = TRUE;
+    load_start = g_get_monotonic_time();
+    for (i = 0; i < n_file_xfers; i++) {
+        send_file_xfer_start(&file_xfers[i]);
+    }
+    pump();
+    check_done();
+}
+
+static void host_handle_file_xfer_status(VDAgentFileXferStatusMessage *status)
+{
+    uint32_t id = GUINT32_FROM_LE(status->id);
+    struct file_xfer *xfer;
+
+    if (id >= (uint32_t)n_file_xfers) {
+        return;
+    }
+    xfer = &file_xfers[id];
+    switch (GUINT32_FROM_LE(status->result)) {
+    case VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA:
+        add_latency(LATENCY_FILE_XFER_START, xfer->start_time);
+        xfer->can_send = TRUE;
+        pump();
+        break;
+    case VD_AGENT_FILE_XFER_STATUS_SUCCESS:
+        add_latency(LATENCY_FILE_XFER, xfer->start_time);
+        file_xfers_done++;
+        break;
+    default:
+        g_printerr("file-xfer %u failed: %u\n", id, GUINT32_FROM_LE(status->result));
+        file_xfers_failed++;
+        file_xfers_done++;
+        break;
+    }
+}
+
+static void host_handle_message(VDAgentMessage *header, guint8 *data)
+{
+    switch (header->type) {
+    case VD_AGENT_ANNOUNCE_CAPABILITIES:
+        if (!host_started) {
+            start_load();
+        }
+        break;
+    case VD_AGENT_REPLY: {
+        VDAgentReply *reply = (VDAgentReply *)data;
+        gint64 *time;
+
+        if (header->size < sizeof(*reply) ||
+            GUINT32_FROM_LE(reply->type) != VD_AGENT_MONITORS_CONFIG) {
+            break;
+        }
+        time = g_queue_pop_head(&monitors_times);
+        if (time) {
+            add_latency(LATENCY_MONITORS_CONFIG, *time);
+            g_free(time);
+        }
+        monitors_replied++;
+        pump();
+        break;
+    }
+    case VD_AGENT_CLIPBOARD_REQUEST: {
+        VDAgentClipboard clipboard;
+
+        clipboard.type = GUINT32_TO_LE(VD_AGENT_CLIPBOARD_UTF8_TEXT);
+        clipboard_data_time = g_get_monotonic_time();
+        host_write(VD_AGENT_CLIPBOARD, &clipboard, sizeof(clipboard),
+                   payload, clipboard_size);
+        break;
+    }
+    case VD_AGENT_FILE_XFER_STATUS:
+        if (header->size >= sizeof(VDAgentFileXferStatusMessage)) {
+            host_handle_file_xfer_status((VDAgentFileXferStatusMessage *)data);
+        }
+        break;
+    default:
+        break;
+    }
+    check_done();
+}
+
+/* Reassemble the messages from the chunks read */
+static void host_parse(void)
+{
+    VDIChunkHeader chunk;
+    VDAgentMessage header;
+    gsize pos = 0;
+
+    while (host_in->len - pos >= sizeof(chunk)) {
+        memcpy(&chunk, host_in->data + pos, sizeof(chunk));
+        chunk.size = GUINT32_FROM_LE(chunk.size);
+        if (host_in->len - pos < sizeof(chunk) + chunk.size) {
+            break;
+        }
+        g_byte_array_append(host_msg, host_in->data + pos + sizeof(chunk), chunk.size);
+        pos += sizeof(chunk) + chunk.size;
+
+        while (host_msg->len >= sizeof(header)) {
+            memcpy(&header, host_msg->data, sizeof(header));
+            header.type = GUINT32_FROM_LE(header.type);
+            header.size = GUINT32_FROM_LE(header.size);
+            if (host_msg->len < sizeof(header) + header.size) {
+                break;
+            }
+            host_handle_message(&header, host_msg->data + sizeof(header));
+            g_byte_array_remove_range(host_msg, 0, sizeof(header) + header.size);
+        }
+    }
+    g_byte_array_remove_range(host_in, 0, pos);
+}
+
+static gboolean host_in_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    guint8 buf[16 * 1024];
+    ssize_t n;
+
+    n = read(host_fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return G_SOURCE_CONTINUE;
+    }
+    if (n <= 0) {
+        quit_error("spice-vdagentd closed the port");
+        host_in_watch = 0;
+        return G_SOURCE_REMOVE;
+    }
+    g_byte_array_append(host_in, buf, n);
+    host_parse();
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean listen_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    host_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (host_fd < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return G_SOURCE_CONTINUE;
+        }
+        quit_error("error accepting the port connection");
+        listen_watch = 0;
+        return G_SOURCE_REMOVE;
+    }
+    host_in_watch = g_unix_fd_add(host_fd, G_IO_IN, host_in_cb, NULL);
+    listen_watch = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* ---------- fake uinput device ---------- */
+
+static void uinput_handle_event(struct input_event *ev)
+{
+    if (ev->type == EV_ABS && ev->code == ABS_X) {
+        mouse_x = ev->value;
+        return;
+    }
+    if (ev->type != EV_SYN || mouse_x < 0 || mouse_x >= SCREEN_WIDTH) {
+        return;
+    }
+    if (mouse_times[mouse_x]) {
+        add_latency(LATENCY_MOUSE, mouse_times[mouse_x]);
+        mouse_times[mouse_x] = 0;
+    }
+    /* states sent in between may have been merged into this one */
+    if (mouse_sent == n_mouse && mouse_x == mouse_final_x) {
+        mouse_done = TRUE;
+        check_done();
+    }
+}
+
+static gboolean uinput_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    guint8 buf[64 * sizeof(struct input_event)];
+    ssize_t n;
+    gsize pos = 0;
+
+    n = read(uinput_fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return G_SOURCE_CONTINUE;
+    }
+    if (n <= 0) {
+        quit_error("error reading the uinput fifo");
+        uinput_watch = 0;
+        return G_SOURCE_REMOVE;
+    }
+    while (pos < n) {
+        gsize size = MIN(n - pos, sizeof(uinput_buf) - uinput_buf_len);
+
+        memcpy(uinput_buf + uinput_buf_len, buf + pos, size);
+        uinput_buf_len += size;
+        pos += size;
+        if (uinput_buf_len == sizeof(uinput_buf)) {
+            uinput_handle_event((struct input_event *)uinput_buf);
+            uinput_buf_len = 0;
+        }
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+/* ---------- session agent ---------- */
+
+static struct file_xfer *agent_lookup_xfer(uint32_t id)
+{
+    return id < (uint32_t)n_file_xfers ? &file_xfers[id] : NULL;
+}
+
+static void agent_read(UdscsConnection *conn,
+                       struct udscs_message_header *header, uint8_t *data)
+{
+    switch (header->type) {
+    case VDAGENTD_CLIPBOARD_GRAB:
+        add_latency(LATENCY_CLIPBOARD_GRAB, clipboard_grab_time);
+        udscs_write(conn, VDAGENTD_CLIPBOARD_REQUEST, header->arg1,
+                    VD_AGENT_CLIPBOARD_UTF8_TEXT, NULL, 0);
+        break;
+    case VDAGENTD_CLIPBOARD_DATA:
+        if (header->size != clipboard_size) {
+            g_printerr("clipboard data of %u bytes, expected %d\n",
+                       header->size, clipboard_size);
+        }
+        add_latency(LATENCY_CLIPBOARD, clipboard_data_time);
+        clipboard_done++;
+        clipboard_busy = FALSE;
+        pump();
+        break;
+    case VDAGENTD_FILE_XFER_START: {
+        VDAgentFileXferStartMessage *start = (VDAgentFileXferStartMessage *)data;
+
+        udscs_write(conn, VDAGENTD_FILE_XFER_STATUS, start->id,
+                    VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA, NULL, 0);
+        break;
+    }
+    case VDAGENTD_FILE_XFER_DATA: {
+        VDAgentFileXferDataMessage *msg = (VDAgentFileXferDataMessage *)data;
+        struct file_xfer *xfer = agent_lookup_xfer(msg->id);
+        gint64 *time;
+
+        if (xfer == NULL) {
+            break;
+        }
+        time = g_queue_pop_head(&xfer->data_times);
+        if (time) {
+            add_latency(LATENCY_FILE_XFER_DATA, *time);
+            g_free(time);
+        }
+        xfer->received += msg->size;
+        if (xfer->received == file_size) {
+            udscs_write(conn, VDAGENTD_FILE_XFER_STATUS, xfer->id,
+                        VD_AGENT_FILE_XFER_STATUS_SUCCESS, NULL, 0);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    check_done();
+}
+
+static void agent_error_cb(VDAgentConnection *conn, GError *err)
+{
+    if (err) {
+        g_printerr("agent connection error: %s\n", err->message);
+        g_error_free(err);
+    }
+    quit_error("spice-vdagentd closed the agent connection");
+}
+
+static gboolean agent_connect_cb(gpointer user_data)
+{
+    const char *socket_path = user_data;
+    struct vdagentd_guest_xorg_resolution res = { 0 };
+
+    if (!g_file_test(socket_path, G_FILE_TEST_EXISTS)) {
+        return G_SOURCE_CONTINUE;
+    }
+    agent = udscs_connect(socket_path, agent_read, agent_error_cb, 0, NULL);
+    if (agent == NULL) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    /* the daemon opens the port once it knows the resolution */
+    res.width = SCREEN_WIDTH;
+    res.height = SCREEN_HEIGHT;
+    udscs_write(agent, VDAGENTD_GUEST_XORG_RESOLUTION, SCREEN_WIDTH,
+                SCREEN_HEIGHT, (uint8_t *)&res, sizeof(res));
+    agent_connect_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* ---------- daemon ---------- */
+
+static void daemon_exit_cb(GPid pid, gint status, gpointer user_data)
+{
+    g_spawn_close_pid(pid);
+    daemon_pid = 0;
+    daemon_watch = 0;
+    quit_error("spice-vdagentd exited");
+}
+
+/* -X is only there when built with session integration */
+static gboolean daemon_has_option(const char *option)
+{
+    gchar *argv[] = { vdagentd_path, (gchar *)"--help", NULL };
+    gchar *out = NULL;
+    gboolean found;
+
+    if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_STDERR_TO_DEV_NULL,
+                      NULL, NULL, &out, NULL, NULL, NULL)) {
+        return FALSE;
+    }
+    found = out && strstr(out, option) != NULL;
+    g_free(out);
+    return found;
+}
+
+static gboolean spawn_daemon(const char *port_path, const char *socket_path,
+                             const char *uinput_path)
+{
+    GPtrArray *argv = g_ptr_array_new();
+    GError *err = NULL;
+    gboolean ok;
+
+    g_ptr_array_add(argv, vdagentd_path);
+    g_ptr_array_add(argv, (gpointer)"-x");
+    g_ptr_array_add(argv, (gpointer)"-f");
+    g_ptr_array_add(argv, (gpointer)"-s");
+    g_ptr_array_add(argv, (gpointer)port_path);
+    g_ptr_array_add(argv, (gpointer)"-S");
+    g_ptr_array_add(argv, (gpointer)socket_path);
+    g_ptr_array_add(argv, (gpointer)"-u");
+    g_ptr_array_add(argv, (gpointer)uinput_path);
+    if (io_thread) {
+        g_ptr_array_add(argv, (gpointer)"-t");
+    }
+    if (daemon_has_option("disable-session-integration")) {
+        g_ptr_array_add(argv, (gpointer)"-X");
+    }
+    g_ptr_array_add(argv, NULL);
+
+    ok = g_spawn_async(NULL, (gchar **)argv->pdata, NULL,
+                       G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &daemon_pid, &err);
+    g_ptr_array_free(argv, TRUE);
+    if (!ok) {
+        g_printerr("Could not start %s: %s\n", vdagentd_path, err->message);
+        g_error_free(err);
+        return FALSE;
+    }
+    daemon_watch = g_child_watch_add(daemon_pid, daemon_exit_cb, NULL);
+    return TRUE;
+}
+
+static gboolean timeout_cb(gpointer user_data)
+{
+    quit_error("Timeout reached");
+    return G_SOURCE_REMOVE;
+}
+
+/* ---------- report ---------- */
+
+static gint compare_latency(gconstpointer a, gconstpointer b)
+{
+    gint64 la = *(const gint64 *)a, lb = *(const gint64 *)b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static gint64 percentile(GArray *samples, guint percent)
+{
+    guint i = samples->len * percent / 100;
+
+    return g_array_index(samples, gint64, MIN(i, samples->len - 1));
+}
+
+static void report(void)
+{
+    gint64 elapsed = g_get_monotonic_time() - load_start;
+    double seconds = elapsed / (double)G_USEC_PER_SEC;
+    guint i;
+
+    if (!host_started) {
+        return;
+    }
+    printf("%" G_GUINT64_FORMAT " messages, %" G_GUINT64_FORMAT " bytes in %.3f s: "
+           "%.0f messages/s, %.1f MiB/s\n",
+           host_messages_out, host_bytes_out, seconds,
+           seconds > 0 ? host_messages_out / seconds : 0.0,
+           seconds > 0 ? host_bytes_out / seconds / (1024 * 1024) : 0.0);
+    if (file_xfers_failed) {
+        printf("%d file transfers failed\n", file_xfers_failed);
+    }
+
+    printf("%-16s %8s %10s %10s %10s %10s\n",
+           "latency (us)", "count", "p50", "p90", "p99", "max");
+    for (i = 0; i < LATENCY_COUNT; i++) {
+        GArray *samples = latencies[i];
+
+        if (samples->len == 0) {
+            continue;
+        }
+        g_array_sort(samples, compare_latency);
+        printf("%-16s %8u %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT
+               " %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT "\n",
+               latency_names[i], samples->len,
+               percentile(samples, 50), percentile(samples, 90),
+               percentile(samples, 99),
+               g_array_index(samples, gint64, samples->len - 1));
+    }
+}
+
+static GOptionEntry cmd_entries[] = {
+    { "vdagentd", 'v', 0,
+      G_OPTION_ARG_FILENAME, &vdagentd_path,
+      "spice-vdagentd binary to run (src/spice-vdagentd)", NULL },
+
+    { "mouse", 'm', 0,
+      G_OPTION_ARG_INT, &n_mouse,
+      "Number of mouse states to send (10000)", NULL },
+
+    { "monitors", 'M', 0,
+      G_OPTION_ARG_INT, &n_monitors,
+      "Number of monitor configs to send (100)", NULL },
+
+    { "clipboard", 'c', 0,
+      G_OPTION_ARG_INT, &n_clipboard,
+      "Number of clipboard grab/request/data cycles (100)", NULL },
+
+    { "clipboard-size", 0, 0,
+      G_OPTION_ARG_INT, &clipboard_size,
+      "Size of the clipboard data (65536)", NULL },
+
+    { "file-xfers", 'F', 0,
+      G_OPTION_ARG_INT, &n_file_xfers,
+      "Number of parallel file transfers (4)", NULL },
+
+    { "file-size", 0, 0,
+      G_OPTION_ARG_INT64, &file_size,
+      "Size of every file transferred (4194304)", NULL },
+
+    { "timeout", 'T', 0,
+      G_OPTION_ARG_INT, &timeout,
+      "Give up after this many seconds (60)", NULL },
+
+    { "virtio-io-thread", 't', 0,
+      G_OPTION_ARG_NONE, &io_thread,
+      "Run spice-vdagentd with its virtio I/O thread", NULL },
+
+    { NULL }
+};
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *err = NULL;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    gchar *tmp_dir, *port_path, *socket_path, *uinput_path;
+    gint i;
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, cmd_entries, NULL);
+    g_option_context_set_summary(context,
+        "Plays the spice host and a session agent to put load on spice-vdagentd");
+    g_option_context_parse(context, &argc, &argv, &err);
+    g_option_context_free(context);
+
+    if (err) {
+        g_printerr("Invalid arguments, %s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    if (n_mouse < 0 || n_monitors < 0 || n_clipboard < 0 || clipboard_size < 0 ||
+        n_file_xfers < 0 || file_size < 0) {
+        g_printerr("Invalid arguments, counts and sizes can't be negative\n");
+        return 1;
+    }
+    if (vdagentd_path == NULL) {
+        vdagentd_path = g_strdup("src/spice-vdagentd");
+    }
+
+    tmp_dir = g_dir_make_tmp("vdagentd-load-XXXXXX", &err);
+    if (tmp_dir == NULL) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    port_path = g_build_filename(tmp_dir, "port", NULL);
+    socket_path = g_build_filename(tmp_dir, "vdagentd", NULL);
+    uinput_path = g_build_filename(tmp_dir, "uinput", NULL);
+
+    for (i = 0; i < LATENCY_COUNT; i++) {
+        latencies[i] = g_array_new(FALSE, FALSE, sizeof(gint64));
+    }
+    host_out = g_byte_array_new();
+    host_in = g_byte_array_new();
+    host_msg = g_byte_array_new();
+    payload = g_malloc(MAX(clipboard_size, FILE_XFER_BLOCK_SIZE));
+    memset(payload, 'x', MAX(clipboard_size, FILE_XFER_BLOCK_SIZE));
+    file_xfers = g_new0(struct file_xfer, n_file_xfers);
+    for (i = 0; i < n_file_xfers; i++) {
+        file_xfers[i].id = i;
+        g_queue_init(&file_xfers[i].data_times);
+    }
+    loop = g_main_loop_new(NULL, FALSE);
+
+    /* opened read-write so reads don't see EOF before the daemon opens it */
+    if (mkfifo(uinput_path, 0600) != 0 ||
+        (uinput_fd = open(uinput_path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        g_printerr("%s: %s\n", uinput_path, g_strerror(errno));
+        goto out;
+    }
+    uinput_watch = g_unix_fd_add(uinput_fd, G_IO_IN, uinput_cb, NULL);
+
+    g_strlcpy(addr.sun_path, port_path, sizeof(addr.sun_path));
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 1) != 0) {
+        g_printerr("%s: %s\n", port_path, g_strerror(errno));
+        goto out;
+    }
+    listen_watch = g_unix_fd_add(listen_fd, G_IO_IN, listen_cb, NULL);
+
+    if (!spawn_daemon(port_path, socket_path, uinput_path)) {
+        goto out;
+    }
+    agent_connect_source = g_timeout_add(10, agent_connect_cb, socket_path);
+    g_timeout_add_seconds(timeout, timeout_cb, NULL);
+
+    g_main_loop_run(loop);
+    report();
+
+out:
+    g_clear_pointer(&agent, vdagent_connection_destroy);
+    if (daemon_pid) {
+        g_source_remove(daemon_watch);
+        kill(daemon_pid, SIGTERM);
+        waitpid(daemon_pid, NULL, 0);
+        g_spawn_close_pid(daemon_pid);
+    }
+    /* allow the VDAgentConnection to finalize properly */
+    g_main_context_iteration(NULL, FALSE);
+
+    if (agent_connect_source) {
+        g_source_remove(agent_connect_source);
+    }
+    if (listen_watch) {
+        g_source_remove(listen_watch);
+    }
+    if (host_in_watch) {
+        g_source_remove(host_in_watch);
+    }
+    if (host_out_watch) {
+        g_source_remove(host_out_watch);
+    }
+    if (uinput_watch) {
+        g_source_remove(uinput_watch);
+    }
+    if (host_fd >= 0) {
+        close(host_fd);
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+    }
+    if (uinput_fd >= 0) {
+        close(uinput_fd);
+    }
+    g_unlink(port_path);
+    g_unlink(socket_path);
+    g_unlink(uinput_path);
+    g_rmdir(tmp_dir);
+
+    for (i = 0; i < n_file_xfers; i++) {
+        g_queue_clear_full(&file_xfers[i].data_times, g_free);
+    }
+    g_queue_clear_full(&monitors_times, g_free);
+    for (i = 0; i < LATENCY_COUNT; i++) {
+        g_array_unref(latencies[i]);
+    }
+    g_free(file_xfers);
+    g_free(payload);
+    g_byte_array_unref(host_out);
+    g_byte_array_unref(host_in);
+    g_byte_array_unref(host_msg);
+    g_main_loop_unref(loop);
+    g_free(port_path);
+    g_free(socket_path);
+    g_free(uinput_path);
+    g_free(tmp_dir);
+    g_free(vdagentd_path);
+    return ret;
+}
@@ -0,0 +1,289 @@
+/* vdagentd-replay.c replays a trace recorded by spice-vdagentd --capture-file
+ *
+ * Copyright 2026 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The frames read from the virtio port are written, in order, to a unix
+ * socket standing in for the port. By default the socket is read by an
+ * in-process VirtioPort and the time it takes to parse the whole trace
+ * is reported, with --socket a spice-vdagentd started with
+ * "-s PATH" can be driven instead.
+ * Frames read from the agents are only counted. */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "capture.h"
+#include "virtio-port.h"
+
+static gboolean realtime = FALSE;
+static gboolean io_thread = FALSE;
+static gchar *socket_path = NULL;
+
+static GMainLoop *loop;
+static guint64 n_messages = 0;
+static guint64 n_bytes = 0;
+static guint64 type_count[VD_AGENT_END_MESSAGE];
+
+struct replay {
+    FILE *file;
+    int fd;
+    guint64 n_virtio;
+    guint64 n_udscs;
+};
+
+static void read_cb(VirtioPort *vport, int port_nr,
+                    VDAgentMessage *message_header, uint8_t *data)
+{
+    n_messages++;
+    n_bytes += message_header->size;
+    if (message_header->type < VD_AGENT_END_MESSAGE) {
+        type_count[message_header->type]++;
+    }
+}
+
+static void error_cb(VDAgentConnection *conn, GError *err)
+{
+    /* the end of the trace */
+    if (err) {
+        g_printerr("Port error: %s\n", err->message);
+        g_error_free(err);
+    }
+    g_main_loop_quit(loop);
+}
+
+static gboolean write_all(int fd, const uint8_t *buf, gsize size)
+{
+    while (size) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            g_printerr("write: %s\n", g_strerror(errno));
+            return FALSE;
+        }
+        buf += n;
+        size -= n;
+    }
+    return TRUE;
+}
+
+static gpointer replay_thread(gpointer user_data)
+{
+    struct replay *replay = user_data;
+    struct vdagentd_capture_record record;
+    gint64 start = g_get_monotonic_time();
+    GError *err = NULL;
+    uint8_t *data;
+
+    while ((data = vdagentd_capture_read_record(replay->file, &record, &err))) {
+        if (record.source != VDAGENTD_CAPTURE_VIRTIO) {
+            replay->n_udscs++;
+            g_free(data);
+            continue;
+        }
+        if (realtime) {
+            gint64 delay = start + record.timestamp - g_get_monotonic_time();
+            if (delay > 0) {
+                g_usleep(delay);
+            }
+        }
+        replay->n_virtio++;
+        if (!write_all(replay->fd, data, record.size)) {
+            g_free(data);
+            break;
+        }
+        g_free(data);
+    }
+    if (err) {
+        g_printerr("Trace error: %s\n", err->message);
+        g_error_free(err);
+    }
+    close(replay->fd);
+    return NULL;
+}
+
+static int listen_to(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        g_printerr("%s: path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 ||
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(fd, 1) != 0) {
+        g_printerr("%s: %s\n", path, g_strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static GOptionEntry cmd_entries[] = {
+    { "realtime", 'r', 0,
+      G_OPTION_ARG_NONE, &realtime,
+      "Keep the delays between the recorded frames", NULL },
+
+    { "socket", 's', 0,
+      G_OPTION_ARG_FILENAME, &socket_path,
+      "Feed the spice-vdagentd connecting to this socket", NULL },
+
+    { "io-thread", 't', 0,
+      G_OPTION_ARG_NONE, &io_thread,
+      "Handle virtio serial I/O in a separate thread", NULL },
+
+    { NULL }
+};
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *err = NULL;
+    struct replay replay = { NULL, -1 };
+    VirtioPort *vport = NULL;
+    GThread *thread;
+    gchar *tmp_dir = NULL;
+    gchar *path;
+    gint64 start, elapsed;
+    int listen_fd;
+    int ret = 1;
+    guint i;
+
+    context = g_option_context_new("TRACE");
+    g_option_context_add_main_entries(context, cmd_entries, NULL);
+    g_option_context_set_summary(context,
+        "Replays the virtio port traffic recorded by spice-vdagentd --capture-file");
+    g_option_context_parse(context, &argc, &argv, &err);
+    g_option_context_free(context);
+
+    if (err) {
+        g_printerr("Invalid arguments, %s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    if (argc != 2) {
+        g_printerr("Usage: %s [--realtime] [--socket PATH] [--io-thread] TRACE\n",
+                   argv[0]);
+        return 1;
+    }
+
+    replay.file = g_fopen(argv[1], "rb");
+    if (replay.file == NULL) {
+        g_printerr("%s: %s\n", argv[1], g_strerror(errno));
+        return 1;
+    }
+    if (!vdagentd_capture_read_header(replay.file, &err)) {
+        g_printerr("%s: %s\n", argv[1], err->message);
+        g_error_free(err);
+        goto out;
+    }
+
+    if (socket_path) {
+        path = g_strdup(socket_path);
+    } else {
+        tmp_dir = g_dir_make_tmp("vdagentd-replay-XXXXXX", &err);
+        if (tmp_dir == NULL) {
+            g_printerr("%s\n", err->message);
+            g_error_free(err);
+            goto out;
+        }
+        path = g_build_filename(tmp_dir, "port", NULL);
+    }
+
+    listen_fd = listen_to(path);
+    if (listen_fd < 0) {
+        goto out_path;
+    }
+    if (socket_path) {
+        printf("Waiting for spice-vdagentd -s %s\n", path);
+    } else {
+        /* the connection is queued in the backlog until accepted */
+        loop = g_main_loop_new(NULL, FALSE);
+        vport = vdagent_virtio_port_create_full(path, read_cb, error_cb, io_thread);
+        if (vport == NULL) {
+            close(listen_fd);
+            goto out_loop;
+        }
+    }
+
+    replay.fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    if (replay.fd < 0) {
+        g_printerr("accept: %s\n", g_strerror(errno));
+        goto out_loop;
+    }
+
+    start = g_get_monotonic_time();
+    thread = g_thread_new("replay", replay_thread, &replay);
+    if (vport) {
+        g_main_loop_run(loop);
+    }
+    g_thread_join(thread);
+    elapsed = g_get_monotonic_time() - start;
+
+    printf("%" G_GUINT64_FORMAT " virtio frames replayed, "
+           "%" G_GUINT64_FORMAT " agent frames skipped\n",
+           replay.n_virtio, replay.n_udscs);
+    if (vport) {
+        printf("%" G_GUINT64_FORMAT " messages, %" G_GUINT64_FORMAT " bytes "
+               "in %.3f ms, %.1f MiB/s\n",
+               n_messages, n_bytes, elapsed / 1000.0,
+               elapsed ? n_bytes / (elapsed / (double) G_USEC_PER_SEC) / (1024 * 1024) : 0.0);
+        for (i = 0; i < VD_AGENT_END_MESSAGE; i++) {
+            if (type_count[i]) {
+                printf("  type %2u: %" G_GUINT64_FORMAT "\n", i, type_count[i]);
+            }
+        }
+    }
+    ret = 0;
+
+out_loop:
+    if (vport) {
+        vdagent_connection_destroy(vport);
+        /* allow the VDAgentConnection to finalize properly */
+        g_main_context_iteration(NULL, FALSE);
+    }
+    g_clear_pointer(&loop, g_main_loop_unref);
+    g_unlink(path);
+out_path:
+    if (tmp_dir) {
+        g_rmdir(tmp_dir);
+        g_free(tmp_dir);
+    }
+    g_free(path);
+out:
+    fclose(replay.file);
+    g_free(socket_path);
+    return ret;
+}